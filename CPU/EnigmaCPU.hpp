@@ -3,15 +3,15 @@
 
 #include <cmath>
 #include "../memory/EnigmaMemory.hpp"
+#include "../memory/EnigmaStack.hpp"
 #ifndef ENIGMA_MANAGER
 #include "../Manager/EnigmaManager.hpp"
 #endif
-#define STACK_START 0x5
-#define STACK_END 0x104
-
+// the stack used to take 0x5 to 0x104 of the data memory, it has its own segment now[see memory/EnigmaStack.hpp]
+// but the data still starts here so that the existing programs keep their addresses
 #define DATA_MEM_START 0x105;
 
-static std::uint64_t start_data_mem = DATA_MEM_START;
+static thread_local std::uint64_t start_data_mem = DATA_MEM_START;
 
 static std::uint64_t sign_Ext(std::uint64_t toext, int ext_bit)
 {
@@ -117,14 +117,20 @@ double strtoDec64(std::string num)
     return res;
 }
 
+struct HeapArena; // the guest heap[see Manager/EnigmaHeap.hpp]
+
 namespace CPU
 {
-    static Memory instruction_memory;
-    static Memory data_memory;
+    // every thread is a VM of its own, a hart gets copies of the memory handles of the VM that spawned it so they
+    // share the memories[see CPU/EnigmaHarts.hpp]. Everything else that the dispatch loop touches is the hart's own
+    static thread_local Memory instruction_memory;
+    static thread_local Memory data_memory;
+    static thread_local Stack stack_memory;
+    static thread_local std::shared_ptr<HeapArena> heap; // made by the first malloc
 
-    static std::uint64_t mem_pointer = 0x0;
+    static thread_local std::uint64_t mem_pointer = 0x0;
 
-    static bool running = true;
+    static thread_local bool running = true;
 
     enum Register : qword
     {
@@ -154,10 +160,15 @@ namespace CPU
         FLAGS_COUNT
     };
 
+    // the registers of the standard devices, as offsets from MMIO_BASE[see Manager/EnigmaDevices.hpp]
     enum MemMappedRegrs: qword
     {
-       KEYS = 0x0,
-       KEYD = 0x1,
+       KEYS = 0x0,           // console status, 1 while there is input left
+       KEYD = 0x1,           // console data, reading takes the next character and writing prints one
+       TIME = 0x8,           // timer, microseconds since it was mapped
+       BLOCK_SECTOR = 0x10,  // block device, the sector the next command works on
+       BLOCK_COMMAND = 0x18, // writing a command runs it, reading gives 0 if the last one worked
+       BLOCK_BUFFER = 0x200, // the sector the commands read into and write from
     };
 
     enum Instructions
@@ -216,29 +227,85 @@ namespace CPU
         MOVS,
         MOVSE,
 
-        // call is equivalent to jmp and this will be handled by the assembler generating the code
-
         SAVE, // for saving something to the memory
 
         HALT,
         SYSCALL,
+
+        // subroutines
+        CALL, // push the return address to the stack and jump to the subroutine
+        RET,  // pop the return address from the stack and go back
+
+        // atomics on the data memory shared by the harts[see CPU/EnigmaHarts.hpp]
+        CAS,       // compare and swap
+        FETCH_ADD, // add to the word in memory and get what was there
+        XCHG,      // swap a register with the word in memory
+        FENCE,     // full memory barrier
+
+        // counters the guest can read without a syscall
+        RDCYCLE, // the instructions retired by the hart
+        RDTIME,  // the host's monotonic clock in microseconds
+
+        // never in a program, the debugger patches it over the instructions it stops at[see Manager/EnigmaDebugger.hpp]
+        BREAK,
+    };
+
+    // why the dispatch loop stopped
+    enum Status : byte
+    {
+        HALTED,     // halt or the exit syscall, the exit code is in ar
+        OUT_OF_GAS, // the metered run used up its budget[see Manager/EnigmaMetering.hpp]
+        FAULTED,    // the guest faulted, see the fault kind
+        BREAKPOINT, // the debugger stopped it, pc is the instruction that runs next
+        STOPPED,    // a hart still running when its program was done[see EnigmaHarts.hpp]
     };
 
+    // what the dispatch loop returns
+    struct Trap
+    {
+        Status status;
+        FaultKind fault;
+        qword pc;      // the word that was being executed when the fault happened
+        qword address; // the address or value that caused the fault
+    };
+
+    static thread_local Trap trap;
+
     // 6 bits will be dedicated to instructions since it implies for a possiblility of 63 instructions and we
-    // currently have 50 leaving 13 for expansion
+    // currently have 56 leaving 8 for expansion
 
-    static qword _registers[regr_count];
-    static byte flags[FLAGS_COUNT];
-    static qword instr;
-    static byte curr_instr;
+    static thread_local qword _registers[regr_count];
+    static thread_local byte flags[FLAGS_COUNT];
+    static thread_local qword instr;
+    static thread_local byte curr_instr;
+    static thread_local qword retired; // instructions the hart on this thread has executed, what rdcycle reads
 
-    // this function initializes the stack pointer and instruction pointer to 0. stack begins from 0 to 255 and then it can be whatever it want
+    // every call also records its return address here, next to the stack slot it was pushed to
+    // ret checks the address it pops against the top entry so it knows it is going back to a call's return site
+    struct ReturnEntry
+    {
+        qword slot;
+        qword address;
+    };
+    static thread_local std::vector<ReturnEntry> return_stack;
+
+    // this function initializes the stack pointer and instruction pointer to 0. sp is the offset into the stack segment
     inline void init()
     {
-        _registers[sp] = STACK_START;
+        _registers[sp] = 0;
         _registers[pc] = 0x0;
     }
 
+    // installed as the memory's fault handler while the dispatch loop runs
+    // the faulting instruction finishes with harmless values and then the loop stops, the fast path pays nothing
+    inline void on_fault(FaultKind kind, qword address)
+    {
+        if (trap.status == FAULTED)
+            return; // keep the first fault
+        trap = {FAULTED, kind, _registers[pc], address};
+        running = false;
+    }
+
     inline void fetch()
     {
         instr = instruction_memory.mem_read64(_registers[pc]);
@@ -251,158 +318,43 @@ namespace CPU
 
 #include "EnigmaInstructions.hpp"
 
-    inline void execute()
+    // run the decoded instruction, its handler comes from the ISA table[see CPU/EnigmaISA.hpp]
+    inline void execute();
+
+    // start a run: faults are trapped from here on instead of exiting
+    inline void begin_run()
     {
-        switch (curr_instr)
-        {
-        case ADD:
-            InstructionsImpl::add();
-            break;
-        case SUB:
-            InstructionsImpl::sub();
-            break;
-        case MUL:
-            InstructionsImpl::mul();
-            break;
-        case DIV:
-            InstructionsImpl::div();
-            break;
-        case INC:
-            InstructionsImpl::inc();
-            break;
-        case DEC:
-            InstructionsImpl::dec();
-            break;
-        case NEG:
-            InstructionsImpl::neg();
-            break;
-        case MOV:
-            InstructionsImpl::mov();
-            break;
-        case MOVSX:
-            InstructionsImpl::movsx();
-            break;
-        case MOVZX:
-            InstructionsImpl::movzx();
-            break;
-        case LOAD:
-            InstructionsImpl::load();
-            break;
-        case STORE:
-            InstructionsImpl::store();
-            break;
-        case LEA:
-            InstructionsImpl::lea();
-            break;
-        case PUSH:
-            InstructionsImpl::push();
-            break;
-        case POP:
-            InstructionsImpl::pop();
-            break;
-        case PUSH_REG:
-            InstructionsImpl::pushr();
-            break;
-        case POP_REG:
-            InstructionsImpl::popr();
-            break;
-        case SAVE:
-            InstructionsImpl::save();
-            break;
-        case AND:
-            InstructionsImpl::iand();
-            break;
-        case OR:
-            InstructionsImpl::ior();
-            break;
-        case NOT:
-            InstructionsImpl::inot();
-            break;
-        case XOR:
-            InstructionsImpl::ixor();
-            break;
-        case LSHIFT:
-            InstructionsImpl::lshift();
-            break;
-        case RSHIFT:
-            InstructionsImpl::rshift();
-            break;
-        case CMP:
-            InstructionsImpl::cmp();
-            break;
-        case JMP:
-            InstructionsImpl::jmp();
-            break;
-        case JE:
-            InstructionsImpl::je();
-            break;
-        case JG:
-            InstructionsImpl::jg();
-            break;
-        case JGE:
-            InstructionsImpl::jge();
-            break;
-        case JNE:
-            InstructionsImpl::jne();
-            break;
-        case JNZ:
-            InstructionsImpl::jnz();
-            break;
-        case JS:
-            InstructionsImpl::js();
-            break;
-        case JSE:
-            InstructionsImpl::jse();
-            break;
-        case JZ:
-            InstructionsImpl::jz();
-            break;
-        case MOVZ:
-            InstructionsImpl::movz();
-            break;
-        case MOVNZ:
-            InstructionsImpl::movnz();
-            break;
-        case MOVE:
-            InstructionsImpl::move();
-            break;
-        case MOVNE:
-            InstructionsImpl::movne();
-            break;
-        case MOVG:
-            InstructionsImpl::movg();
-            break;
-        case MOVGE:
-            InstructionsImpl::movge();
-            break;
-        case MOVS:
-            InstructionsImpl::movs();
-            break;
-        case MOVSE:
-            InstructionsImpl::movse();
-            break;
-        case NOP:
-            break;
-        case SYSCALL:
-            Manager::handlesyscalls();
-            break;
-        case HALT:
-            running = false;
-            break;
-        }
+        trap = {HALTED, NO_FAULT, 0, 0};
+        running = true;
+        fault_handler = on_fault;
+    }
+
+    inline Trap end_run()
+    {
+        fault_handler = nullptr;
+        return trap;
     }
 
-    inline void run()
+    inline Trap run()
     {
+        begin_run();
         while (running == true)
         {
             fetch();
             decode();
             execute();
             _registers[pc] += 8;
+            retired++;
         }
-        exit(_registers[ar]);
+        return end_run();
     }
 };
 
+#include "EnigmaISA.hpp"
+
+void CPU::execute()
+{
+    ISA::handlers[instr >> 56]();
+}
+
 #endif
\ No newline at end of file
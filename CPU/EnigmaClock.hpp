@@ -0,0 +1,87 @@
+#ifndef ENIGMA_CLOCK
+#define ENIGMA_CLOCK
+
+#include "../memory/EnigmaMemory.hpp"
+#include <chrono>
+#include <thread>
+
+/*
+The time page behind rdtime, the same idea as the vDSO: a host thread keeps writing the monotonic clock to a word
+every harts reads with a plain load, so reading the time costs the guest no more than a load from memory and never
+traps into the host. The time is in microseconds since the process started and goes forward in steps of
+CLOCK_PERIOD_US, anything finer grained than that should be measured with rdcycle instead.
+The page is started by the first rdtime and the thread stops once nothing has read the time for CLOCK_IDLE_US.
+A reader that finds it stopped writes the time itself and starts it again, so the time never goes back and is
+never older than the idle period either way.
+*/
+
+#ifndef CLOCK_PERIOD_US
+#define CLOCK_PERIOD_US 50
+#endif
+
+#ifndef CLOCK_IDLE_US
+#define CLOCK_IDLE_US 100000
+#endif
+
+namespace Clock
+{
+    struct alignas(64) Page
+    {
+        std::atomic<qword> micros{0};
+        std::atomic<bool> wanted{false}; // read since the thread last looked, only ever set when it isn't
+    };
+
+    static Page page;
+    static std::atomic<bool> ticking(false);
+
+    // the time on the page, starts the page if it isn't yet
+    inline qword now();
+};
+
+static const std::chrono::steady_clock::time_point clock_start = std::chrono::steady_clock::now();
+
+// the page only goes forward even with a reader and the thread writing at once
+static void clock_write()
+{
+    qword micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clock_start).count();
+    qword seen = Clock::page.micros.load(std::memory_order_relaxed);
+    while (seen < micros && !Clock::page.micros.compare_exchange_weak(seen, micros, std::memory_order_release))
+        ;
+}
+
+static void clock_tick()
+{
+    // a sleep can take longer than asked for so the idle period is measured and not counted in ticks
+    qword looked = 0;
+    while (true)
+    {
+        clock_write();
+        std::this_thread::sleep_for(std::chrono::microseconds(CLOCK_PERIOD_US));
+        if (Clock::page.micros.load(std::memory_order_relaxed) - looked < CLOCK_IDLE_US)
+            continue;
+        looked = Clock::page.micros.load(std::memory_order_relaxed);
+        if (Clock::page.wanted.exchange(false))
+            continue;
+        Clock::ticking.store(false);
+        // a reader in between saw the thread still going and didn't start another one
+        bool expected = false;
+        if (!Clock::page.wanted.load() || !Clock::ticking.compare_exchange_strong(expected, true))
+            return;
+    }
+}
+
+qword Clock::now()
+{
+    if (!page.wanted.load(std::memory_order_relaxed))
+        page.wanted.store(true, std::memory_order_relaxed);
+    if (!ticking.load(std::memory_order_acquire))
+    {
+        clock_write();
+        bool expected = false;
+        if (ticking.compare_exchange_strong(expected, true))
+            std::thread(clock_tick).detach();
+    }
+    return page.micros.load(std::memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef ENIGMA_HARTS
+#define ENIGMA_HARTS
+
+#include "EnigmaCPU.hpp"
+#include "../Manager/EnigmaReplay.hpp"
+#include <thread>
+#include <mutex>
+#include <memory>
+
+/*
+A hart is a hardware thread of the guest. The program starts on hart 0 and the spawn syscall starts more of them,
+each on its own host thread with its own registers, flags, stack and dispatch loop, all of them sharing the
+instruction and the data memory of their VM. Every other thread in the process is a VM of its own.
+The harts only synchronise through the atomic instructions, plain loads and stores racing with each other are
+the guest's problem just like on real hardware.
+
+While more than one hart runs, the data memory can't grow. Its bytes stay where they are[see memory/EnigmaPages.hpp]
+but every hart has its own handle with its own pointer limit, the others wouldn't see the new size. The syscalls
+that grow it fault instead. A metered run stays on a single hart so the gas it uses is deterministic.
+
+The program is done once its first hart stops. The harts still running then are told to stop and are joined, they
+look every HART_STOP_EVERY instructions and stop with STOPPED. One parked in a blocking syscall[a receive on a
+channel, see Manager/EnigmaChannels.hpp] only sees it when the syscall returns.
+*/
+
+#ifndef HART_STOP_EVERY
+#define HART_STOP_EVERY 4096
+#endif
+
+namespace Harts
+{
+    struct Hart
+    {
+        std::thread thread;
+        qword result;   // ar when the hart stopped
+        CPU::Trap trap; // why it stopped
+    };
+
+    // the harts spawned in a VM
+    struct Group
+    {
+        std::vector<std::unique_ptr<Hart>> harts; // hart id - 1, a joined hart leaves a nullptr behind
+        std::mutex lock;
+        std::atomic<qword> running{0}; // the ones that haven't stopped yet
+        std::atomic<bool> stop{false};  // set by join_all, the harts stop on their own
+    };
+
+    static thread_local std::shared_ptr<Group> group; // of the VM on this thread, made by the first spawn
+
+    static thread_local bool metered = false; // set by the metered loop[see Manager/EnigmaMetering.hpp]
+
+    // called before a hart is spawned, the debugger takes its breakpoints out here[see Manager/EnigmaDebugger.hpp]
+    static thread_local void (*before_spawn)() = nullptr;
+
+    // start a hart at entry with arg in ar, returns its id or 0 if it couldn't be started
+    inline qword spawn(qword entry, qword arg);
+
+    // wait for the hart to stop, returns false if there is no such hart or it has already been joined
+    inline bool join(qword id, qword &result, CPU::Trap &trap);
+
+    // stop every hart that is left and wait for them, the program is done once its first hart stops
+    inline void join_all();
+
+    // are any of the harts spawned by this VM still running
+    inline bool others_running() { return group != nullptr && group->running > 0; }
+};
+
+namespace Stream
+{
+    // a hart gets the instruction memory as it is when it's spawned, spawn has the rest of a streamed image taken in
+    // first[see Manager/EnigmaStream.hpp]
+    inline void finish();
+};
+
+static void hart_main(Harts::Hart *hart, qword entry, qword arg, Memory instructions, Memory data, qword mem_pointer,
+                      std::shared_ptr<HeapArena> heap, std::shared_ptr<Harts::Group> group, Replay::Mode replay)
+{
+    // the rest of the thread_local state starts zeroed, that's a fresh hart with an empty stack
+    CPU::instruction_memory = instructions;
+    CPU::data_memory = data;
+    CPU::heap = heap;
+    CPU::mem_pointer = mem_pointer;
+    Harts::group = group;
+    Replay::spawned_by = replay;
+    CPU::init();
+    CPU::_registers[CPU::pc] = entry;
+    CPU::_registers[CPU::ar] = arg;
+    // CPU::run but looking at the group's stop flag now and then
+    CPU::begin_run();
+    while (CPU::running == true)
+    {
+        for (qword i = 0; i < HART_STOP_EVERY && CPU::running == true; i++)
+        {
+            CPU::fetch();
+            CPU::decode();
+            CPU::execute();
+            CPU::_registers[CPU::pc] += 8;
+            CPU::retired++;
+        }
+        if (CPU::running == true && group->stop.load(std::memory_order_relaxed))
+        {
+            CPU::trap = {CPU::STOPPED, NO_FAULT, CPU::_registers[CPU::pc], 0};
+            CPU::running = false;
+        }
+    }
+    hart->trap = CPU::end_run();
+    hart->result = CPU::_registers[CPU::ar];
+    group->running--;
+}
+
+qword Harts::spawn(qword entry, qword arg)
+{
+    if (metered)
+        return 0;
+    if (before_spawn != nullptr)
+        before_spawn();
+    if (group == nullptr)
+        group = std::make_shared<Group>();
+    // the proofs were made for the registers of the first hart and not for whatever the new one starts with,
+    // they are dropped while nothing else can be fetching the words they are in and can't come back while harts run
+    if (group->running == 0)
+        Analysis::drop_proofs();
+    Stream::finish();
+    std::lock_guard<std::mutex> guard(group->lock);
+    group->harts.push_back(std::unique_ptr<Hart>(new Hart()));
+    Hart *hart = group->harts.back().get();
+    group->running++;
+    // a hart spawned by a hart inherits what its first hart was doing
+    Replay::Mode replay = Replay::mode != Replay::LIVE ? Replay::mode : Replay::spawned_by;
+    hart->thread = std::thread(hart_main, hart, entry, arg, CPU::instruction_memory, CPU::data_memory, CPU::mem_pointer, CPU::heap, group, replay);
+    return group->harts.size();
+}
+
+bool Harts::join(qword id, qword &result, CPU::Trap &trap)
+{
+    if (group == nullptr)
+        return false;
+    std::unique_ptr<Hart> hart;
+    {
+        std::lock_guard<std::mutex> guard(group->lock);
+        auto &harts = group->harts;
+        if (id == 0 || id > harts.size() || harts[id - 1] == nullptr || harts[id - 1]->thread.get_id() == std::this_thread::get_id())
+            return false;
+        hart = std::move(harts[id - 1]);
+    }
+    hart->thread.join();
+    result = hart->result;
+    trap = hart->trap;
+    return true;
+}
+
+void Harts::join_all()
+{
+    if (group == nullptr)
+        return;
+    group->stop = true;
+    while (true)
+    {
+        std::vector<std::unique_ptr<Hart>> left;
+        {
+            std::lock_guard<std::mutex> guard(group->lock);
+            for (auto &hart : group->harts)
+            {
+                if (hart != nullptr)
+                    left.push_back(std::move(hart));
+            }
+            group->harts.clear();
+        }
+        if (left.empty())
+            break;
+        // a hart being joined here can still spawn more, so go around until none are left
+        for (auto &hart : left)
+            hart->thread.join();
+    }
+    // the VM can run again and spawn new ones
+    group->stop = false;
+}
+
+#endif
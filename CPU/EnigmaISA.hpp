@@ -0,0 +1,250 @@
+#ifndef ENIGMA_ISA
+#define ENIGMA_ISA
+
+#include <string>
+#include <sstream>
+#include <array>
+#include <utility>
+
+/*
+The one description of the instruction set. Every opcode has a row in ISA::ops with its mnemonic, the operands each
+of its four formats takes, which formats have a second word, which ones have 3 bit register fields and which ones
+access the data memory, and the handlers that execute it. The dispatch loop, the analysis, the translator, the
+disassembler and the encoder all read this table instead of knowing the encodings themselves.
+
+An instruction word is laid out as
+  opcode[6] format[2] ... first register[3] last register[3]       register forms
+  opcode[6] format[2] immediate[53] last register[3]               immediate forms
+Register fields are 2 bits[ar to dr] except in the movs between registers which reach every one of the 8 general
+purpose registers, that's the only place the width changes and ISA::last and ISA::first take care of it.
+The handlers of the opcodes whose formats differ are templates on the format, one for each, so they don't look at
+the format bits at run time and use the compile time versions ISA::last<op, format> and ISA::first<op, format>,
+which fold to a constant mask. ISA::handlers lays them all out by the top byte of the word for the dispatch loop.
+*/
+
+namespace ISA
+{
+    // what the operands of a format are
+    enum Shape : byte
+    {
+        NONE,
+        REG,          // the last register
+        REG_REG,      // first, last
+        REG_IMM,      // last, the 53 bit immediate
+        REG_LOAD,     // last, the 55 bit immediate of load
+        REG_DEREF,    // first, the address in the last register
+        REG_MEM,      // last, the address in the second word
+        STORE_MEM,    // the register whose index is in the last register, the address in the second word
+        MEM,          // the address in the second word
+        TARGET,       // the instruction in the second word
+        ATOMIC,       // first, the address in the last register
+    };
+
+    struct Op
+    {
+        byte code;
+        const char *name;
+        Shape shapes[4];    // by format
+        byte two_words;     // a bit for every format that has a second word
+        byte wide;          // a bit for every format whose register fields are 3 bits
+        byte memory;        // a bit for every format that accesses memory[and has BOUNDS_PROVEN reserved]
+        void (*execute[4])(); // by format, the ones that don't care about it have the same handler 4 times
+    };
+
+    static const byte ALL = 0b1111;
+    static const byte FORMAT3 = 0b1000;
+
+#define ENIGMA_SAME(shape) {shape, shape, shape, shape}
+#define ENIGMA_ARITH {REG_REG, REG_IMM, REG_IMM, REG_MEM}
+#define ENIGMA_LOGIC {REG_REG, REG_IMM, REG_REG, REG_IMM}
+#define ENIGMA_MOV {REG_REG, REG_IMM, REG_REG, REG_DEREF}
+#define ENIGMA_ANY(handler) {InstructionsImpl::handler, InstructionsImpl::handler, InstructionsImpl::handler, InstructionsImpl::handler}
+#define ENIGMA_FORMATS(handler) {InstructionsImpl::handler<0>, InstructionsImpl::handler<1>, InstructionsImpl::handler<2>, InstructionsImpl::handler<3>}
+
+    constexpr Op ops[64] = {
+        {CPU::NOP, "nop", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {CPU::ADD, "add", ENIGMA_ARITH, FORMAT3, 0, FORMAT3, ENIGMA_FORMATS(add)},
+        {CPU::SUB, "sub", ENIGMA_ARITH, FORMAT3, 0, FORMAT3, ENIGMA_FORMATS(sub)},
+        {CPU::MUL, "mul", ENIGMA_ARITH, FORMAT3, 0, FORMAT3, ENIGMA_FORMATS(mul)},
+        {CPU::DIV, "div", ENIGMA_ARITH, FORMAT3, 0, FORMAT3, ENIGMA_FORMATS(div)},
+        {CPU::INC, "inc", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(inc)},
+        {CPU::DEC, "dec", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(dec)},
+        {CPU::NEG, "neg", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(neg)},
+        {CPU::AND, "and", ENIGMA_LOGIC, 0, 0, 0, ENIGMA_FORMATS(iand)},
+        {CPU::NOT, "not", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(inot)},
+        {CPU::OR, "or", ENIGMA_LOGIC, 0, 0, 0, ENIGMA_FORMATS(ior)},
+        {CPU::XOR, "xor", ENIGMA_LOGIC, 0, 0, 0, ENIGMA_FORMATS(ixor)},
+        {CPU::LSHIFT, "lshift", ENIGMA_LOGIC, 0, 0, 0, ENIGMA_FORMATS(lshift)},
+        {CPU::RSHIFT, "rshift", ENIGMA_LOGIC, 0, 0, 0, ENIGMA_FORMATS(rshift)},
+        {CPU::MOV, "mov", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(mov)},
+        {CPU::MOVZX, "movzx", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movzx)},
+        {CPU::MOVSX, "movsx", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movsx)},
+        {CPU::STORE, "store", ENIGMA_SAME(STORE_MEM), ALL, 0, ALL, ENIGMA_ANY(store)},
+        {CPU::LOAD, "load", ENIGMA_SAME(REG_LOAD), 0, 0, 0, ENIGMA_ANY(load)},
+        {CPU::LEA, "lea", ENIGMA_SAME(MEM), ALL, 0, 0, ENIGMA_ANY(lea)},
+        {CPU::PUSH, "push", ENIGMA_SAME(NONE), 0, 0, ALL, ENIGMA_ANY(push)},
+        {CPU::POP, "pop", ENIGMA_SAME(NONE), 0, 0, ALL, ENIGMA_ANY(pop)},
+        {CPU::PUSH_REG, "pushr", ENIGMA_SAME(REG), 0, 0, ALL, ENIGMA_ANY(pushr)},
+        {CPU::POP_REG, "popr", ENIGMA_SAME(REG), 0, 0, ALL, ENIGMA_ANY(popr)},
+        {CPU::CMP, "cmp", ENIGMA_SAME(REG_REG), 0, 0, 0, ENIGMA_ANY(cmp)},
+        {CPU::JMP, "jmp", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jmp)},
+        {CPU::JZ, "jz", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jz)},
+        {CPU::JNZ, "jnz", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jnz)},
+        {CPU::JN, "jn", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)}, // reserved, runs as a nop
+        {CPU::JNN, "jnn", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {CPU::JE, "je", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(je)},
+        {CPU::JNE, "jne", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jne)},
+        {CPU::JG, "jg", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jg)},
+        {CPU::JGE, "jge", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jge)},
+        {CPU::JS, "js", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(js)},
+        {CPU::JSE, "jse", ENIGMA_SAME(TARGET), ALL, 0, 0, ENIGMA_ANY(jse)},
+        {CPU::MOVZ, "movz", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movz)},
+        {CPU::MOVNZ, "movnz", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movnz)},
+        {CPU::MOVE, "move", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(move)},
+        {CPU::MOVNE, "movne", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movne)},
+        {CPU::MOVG, "movg", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movg)},
+        {CPU::MOVGE, "movge", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movge)},
+        {CPU::MOVS, "movs", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movs)},
+        {CPU::MOVSE, "movse", ENIGMA_MOV, 0, 0b0111, FORMAT3, ENIGMA_FORMATS(movse)},
+        {CPU::SAVE, "save", ENIGMA_SAME(REG_MEM), ALL, 0, ALL, ENIGMA_ANY(save)},
+        {CPU::HALT, "halt", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(halt)},
+        {CPU::SYSCALL, "syscall", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(syscall)},
+        {CPU::CALL, "call", ENIGMA_SAME(TARGET), ALL, 0, ALL, ENIGMA_ANY(call)},
+        {CPU::RET, "ret", ENIGMA_SAME(NONE), 0, 0, ALL, ENIGMA_ANY(ret)},
+        {CPU::CAS, "cas", ENIGMA_SAME(ATOMIC), 0, 0, 0, ENIGMA_ANY(cas)},
+        {CPU::FETCH_ADD, "fetch_add", ENIGMA_SAME(ATOMIC), 0, 0, 0, ENIGMA_ANY(fetch_add)},
+        {CPU::XCHG, "xchg", ENIGMA_SAME(ATOMIC), 0, 0, 0, ENIGMA_ANY(xchg)},
+        {CPU::FENCE, "fence", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(fence)},
+        {CPU::RDCYCLE, "rdcycle", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(rdcycle)},
+        {CPU::RDTIME, "rdtime", ENIGMA_SAME(REG), 0, 0, 0, ENIGMA_ANY(rdtime)},
+        {CPU::BREAK, "break", ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(brk)},
+        // the opcodes left for expansion run as nops
+        {56, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {57, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {58, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {59, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {60, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {61, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {62, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+        {63, nullptr, ENIGMA_SAME(NONE), 0, 0, 0, ENIGMA_ANY(nop)},
+    };
+
+#undef ENIGMA_SAME
+#undef ENIGMA_ARITH
+#undef ENIGMA_LOGIC
+#undef ENIGMA_MOV
+#undef ENIGMA_ANY
+#undef ENIGMA_FORMATS
+
+    // every row has to sit at its own opcode
+    constexpr bool in_order()
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            if (ops[i].code != i)
+                return false;
+        }
+        return true;
+    }
+    static_assert(in_order(), "the ISA table is out of order");
+
+    // the handler of every opcode and format in one table indexed by the top byte of the word[opcode << 2 | format],
+    // so the dispatch loop makes a single indirect call straight into the code for that format
+    template <std::size_t... Index>
+    constexpr std::array<void (*)(), 256> make_handlers(std::index_sequence<Index...>)
+    {
+        return {{ops[Index >> 2].execute[Index & 3]...}};
+    }
+    constexpr std::array<void (*)(), 256> handlers = make_handlers(std::make_index_sequence<256>());
+
+    // the fields of a word
+    constexpr byte opcode(qword word) { return word >> 58; }
+    constexpr byte format(qword word) { return (word >> 56) & 3UL; }
+    constexpr qword imm(qword word) { return (word >> 3) & 0x1FFFFFFFFFFFFF; }
+    constexpr qword load_imm(qword word) { return (word >> 3) & 0x3FFFFFFFFFFFFFF; }
+
+    constexpr bool has(byte formats, qword word) { return (formats >> format(word)) & 1; }
+    constexpr qword reg_mask(qword word) { return has(ops[opcode(word)].wide, word) ? 7UL : 3UL; }
+    constexpr qword last(qword word) { return word & reg_mask(word); }
+    constexpr qword first(qword word) { return (word >> 3) & reg_mask(word); }
+
+    // the same for the handlers, where the opcode and format are known when compiling
+    template <byte Op, byte Format = 0>
+    constexpr qword last(qword word) { return word & ((ops[Op].wide >> Format) & 1 ? 7UL : 3UL); }
+    template <byte Op, byte Format = 0>
+    constexpr qword first(qword word) { return (word >> 3) & ((ops[Op].wide >> Format) & 1 ? 7UL : 3UL); }
+
+    constexpr qword length(qword word) { return has(ops[opcode(word)].two_words, word) ? 16 : 8; }
+    constexpr bool accesses_memory(qword word) { return has(ops[opcode(word)].memory, word); }
+    constexpr Shape shape(qword word) { return ops[opcode(word)].shapes[format(word)]; }
+
+    // build the first word of an instruction, field is the first register or the immediate
+    constexpr qword encode(byte op, byte format, qword field, qword last)
+    {
+        return ((qword)op << 58) | ((qword)format << 56) | ((field & 0x1FFFFFFFFFFFFF) << 3) | (last & 7UL);
+    }
+
+    // the second word of a jump or call that continues at the instruction at target
+    constexpr qword target_word(qword target) { return target - 8; }
+
+    // the text of the instruction, operand is its second word if it has one
+    inline std::string disassemble(qword word, qword operand = 0);
+};
+
+static const char *isa_reg_names[] = {"ar", "br", "cr", "dr", "er1", "er2", "er3", "er4"};
+
+// a mapped address is its size and the address
+static std::string isa_mapped(qword address)
+{
+    std::ostringstream out;
+    out << "[" << ((address >> 60) & 15) << ":0x" << std::hex << (address & 0xFFFFFFFFFFFFFFF) << "]";
+    return out.str();
+}
+
+std::string ISA::disassemble(qword word, qword operand)
+{
+    const Op &op = ops[opcode(word)];
+    std::ostringstream out;
+    if (op.name == nullptr)
+    {
+        out << ".word 0x" << std::hex << word;
+        return out.str();
+    }
+    out << op.name;
+    switch (shape(word))
+    {
+    case NONE:
+        break;
+    case REG:
+        out << " " << isa_reg_names[last(word)];
+        break;
+    case REG_REG:
+        out << " " << isa_reg_names[first(word)] << ", " << isa_reg_names[last(word)];
+        break;
+    case REG_IMM:
+        out << " " << isa_reg_names[last(word)] << ", " << imm(word);
+        break;
+    case REG_LOAD:
+        out << " " << isa_reg_names[last(word)] << ", 0x" << std::hex << load_imm(word);
+        break;
+    case REG_DEREF:
+    case ATOMIC:
+        out << " " << isa_reg_names[first(word)] << ", [" << isa_reg_names[last(word)] << "]";
+        break;
+    case REG_MEM:
+        out << " " << isa_reg_names[last(word)] << ", " << isa_mapped(operand);
+        break;
+    case STORE_MEM:
+        out << " @" << isa_reg_names[last(word)] << ", " << isa_mapped(operand);
+        break;
+    case MEM:
+        out << " " << isa_mapped(operand);
+        break;
+    case TARGET:
+        out << " 0x" << std::hex << operand + 8;
+        break;
+    }
+    return out.str();
+}
+
+#endif
@@ -7,6 +7,8 @@
 // because 3 bits cannot address more than 7 registers, it is impossible for users
 // to address sp and pc and cause mayhem
 
+#include "EnigmaClock.hpp"
+#include "../Manager/EnigmaReplay.hpp"
 
 namespace InstructionsImpl
 {
@@ -23,8 +25,11 @@ namespace InstructionsImpl
     void jse();
 
     // move instructions
+    template <byte Format>
     void mov();
+    template <byte Format>
     void movzx();
+    template <byte Format>
     void movsx();
     void store();
     void load();
@@ -33,27 +38,44 @@ namespace InstructionsImpl
     void pop();
     void pushr();
     void popr();
+    template <byte Format>
     void movz();
+    template <byte Format>
     void movnz();
+    template <byte Format>
     void move();
+    template <byte Format>
     void movne();
+    template <byte Format>
     void movg();
+    template <byte Format>
     void movge();
+    template <byte Format>
     void movs();
+    template <byte Format>
     void movse();
 
     // logical operations
+    template <byte Format>
     void iand();
     void inot();
+    template <byte Format>
     void ior();
+    template <byte Format>
     void ixor();
+    template <byte Format>
     void lshift();
+    template <byte Format>
     void rshift();
 
     // arithmetic operations
+    template <byte Format>
     void add();
+    template <byte Format>
     void sub();
+    template <byte Format>
     void mul();
+    template <byte Format>
     void div();
     void inc();
     void dec();
@@ -62,6 +84,34 @@ namespace InstructionsImpl
     // memory operation
     void save();
 
+    // subroutines
+    void call();
+    void ret();
+
+    // atomics
+    void cas();
+    void fetch_add();
+    void xchg();
+
+    // counters
+    void rdcycle();
+    void rdtime();
+
+    // the ones that only have to be functions for the ISA table[see CPU/EnigmaISA.hpp]
+    void nop();
+    void halt();
+    void syscall();
+    void fence();
+
+    // debugging
+    void brk();
+
+};
+
+namespace Analysis
+{
+    // ret calls this when it goes somewhere the load-time analysis didn't expect[see Manager/EnigmaAnalysis.hpp]
+    inline void drop_proofs();
 };
 
 std::pair<std::uint8_t, std::uint64_t> map_mem(std::uint64_t addr)
@@ -73,10 +123,53 @@ std::pair<std::uint8_t, std::uint64_t> map_mem(std::uint64_t addr)
     return std::make_pair((addr >> 60) & 15, addr & 0xFFFFFFFFFFFFFFF);
 }
 
+// bit 55 is reserved in the first word of every instruction that accesses data memory through a constant address
+// or a mapped register and of every stack instruction. The loader sets it on the accesses it has proven to be in bounds[see Manager/EnigmaAnalysis.hpp]
+// and the handlers then skip the bounds checks for them
+#define BOUNDS_PROVEN (1UL << 55)
+
 #ifndef ENIGMA_CPU
 #include "EnigmaCPU.hpp"
 #endif
 
+// reads from the mapped address without any bounds check
+// the size is known to be 1, 2, 4 or 8 because the loader doesn't prove anything else
+static qword read_proven(std::pair<std::uint8_t, std::uint64_t> mapped)
+{
+    switch (mapped.first)
+    {
+    case 1:
+        return CPU::data_memory.mem_read8_unchecked(mapped.second);
+    case 2:
+        return CPU::data_memory.mem_read16_unchecked(mapped.second);
+    case 4:
+        return CPU::data_memory.mem_read32_unchecked(mapped.second);
+    default:
+        return CPU::data_memory.mem_read64_unchecked(mapped.second);
+    }
+}
+
+static void compare(std::uint64_t reg1, std::uint64_t reg2);
+
+static void write_proven(std::pair<std::uint8_t, std::uint64_t> mapped, qword value)
+{
+    switch (mapped.first)
+    {
+    case 1:
+        CPU::data_memory.mem_write8_unchecked(mapped.second, value);
+        break;
+    case 2:
+        CPU::data_memory.mem_write16_unchecked(mapped.second, value);
+        break;
+    case 4:
+        CPU::data_memory.mem_write32_unchecked(mapped.second, value);
+        break;
+    default:
+        CPU::data_memory.mem_write64_unchecked(mapped.second, value);
+        break;
+    }
+}
+
 /*
 this function basically compares the values at given registers and
 does every possible operation that could trigger a specific flag then it exits
@@ -88,6 +181,13 @@ void InstructionsImpl::cmp()
     // because the instruction only works on registers, the last 6 bits will be used for the operands leaving other bits reserved
     std::uint64_t reg1 = CPU::_registers[CPU::instr & 3UL];        // get the last register
     std::uint64_t reg2 = CPU::_registers[(CPU::instr >> 3 & 3UL)]; // get the first register
+    compare(reg1, reg2);
+}
+
+// sets the flags for cmp, reg1 is the last operand and reg2 the first
+// the translated programs[see Manager/EnigmaAOT.hpp] call this as well
+static void compare(std::uint64_t reg1, std::uint64_t reg2)
+{
     // start comparing
     if (reg1 == reg2 == 0)
     {
@@ -249,6 +349,7 @@ void InstructionsImpl::jse()
     }
 }
 
+template <byte Format>
 void InstructionsImpl::mov()
 {
     //  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
@@ -256,187 +357,177 @@ void InstructionsImpl::mov()
     //  or an immediate value or an address which is being held by another register
     //  or the value at the address being held by another register
     //  first 6 bits for instruction itself, 2 bits for what format to use, the remaining for operands
-    short format = (CPU::instr >> 56) & 3UL; // get the format type
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // for register-register mov: 00
         //  000000 00 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits for the operands
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = CPU::_registers[CPU::instr & 7UL]; // put the value
-        break;
+        CPU::_registers[ISA::first<CPU::MOV, 0>(CPU::instr)] = CPU::_registers[ISA::last<CPU::MOV, 0>(CPU::instr)]; // put the value
     }
-    case 1:
+    else if constexpr (Format == 1)
     {
         // for register-imm mov: 01
         //  000000 01 00000000 00000000 00000000 00000000 00000000 00000000 00000 000
         // last 3 bits for the destination register and the remaining bits for the immediate value
         // the immediate can be as large as 2^53 bits which is very large for an immediate
-        CPU::_registers[(CPU::instr & 7UL)] = (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF; // get the immediate value
-        break;
+        CPU::_registers[ISA::last<CPU::MOV, 1>(CPU::instr)] = (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF; // get the immediate value
     }
-    case 2:
+    else if constexpr (Format == 2)
     {
         // for register-addr mov: 10
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits are for the operand registers
         // this is the same as case 0, why? for clear distinction, to know that the value being handled is clearly an address
         // you can use 00 as well which does the same
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = CPU::_registers[CPU::instr & 7UL]; // put the address
-        break;
+        CPU::_registers[ISA::first<CPU::MOV, 2>(CPU::instr)] = CPU::_registers[ISA::last<CPU::MOV, 2>(CPU::instr)]; // put the address
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         // for register-register[addr] mov: 11
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // this operation moves the value at the address at the source register and saves it in the destination register
         // the address should be loaded into the register first
-        auto mapped = map_mem(CPU::_registers[CPU::instr & 3UL]);
-        if (mapped.first == 1)
+        auto mapped = map_mem(CPU::_registers[ISA::last<CPU::MOV, 3>(CPU::instr)]);
+        if (CPU::instr & BOUNDS_PROVEN)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_read8(mapped.second);
+            CPU::_registers[ISA::first<CPU::MOV, 3>(CPU::instr)] = read_proven(mapped);
+        }
+        else if (mapped.first == 1)
+        {
+            CPU::_registers[ISA::first<CPU::MOV, 3>(CPU::instr)] = CPU::data_memory.mem_read8(mapped.second);
         }
         else if (mapped.first == 2)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_read16(mapped.second);
+            CPU::_registers[ISA::first<CPU::MOV, 3>(CPU::instr)] = CPU::data_memory.mem_read16(mapped.second);
         }
         else if (mapped.first == 4)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_read32(mapped.second);
+            CPU::_registers[ISA::first<CPU::MOV, 3>(CPU::instr)] = CPU::data_memory.mem_read32(mapped.second);
         }
         else if (mapped.first == 8)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_read64(mapped.second);
+            CPU::_registers[ISA::first<CPU::MOV, 3>(CPU::instr)] = CPU::data_memory.mem_read64(mapped.second);
         }
-        break;
-    }
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movzx()
 {
     // 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     // this instruction will zero extend any value and then only put it in the destination register
     // movzx is exactly the same to mov and everything is the same except, it will zero extend the values
     // regardless of their signs[copied the following from mov]
-    short format = (CPU::instr >> 56) & 3UL; // get the format type
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // for register-register mov: 00
         //  000000 00 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits for the operands
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = zero_Ext(CPU::_registers[CPU::instr & 7UL]); // put the value
-        break;
+        CPU::_registers[ISA::first<CPU::MOVZX, 0>(CPU::instr)] = zero_Ext(CPU::_registers[ISA::last<CPU::MOVZX, 0>(CPU::instr)]); // put the value
     }
-    case 1:
+    else if constexpr (Format == 1)
     {
         // for register-imm mov: 01
         //  000000 01 00000000 00000000 00000000 00000000 00000000 00000000 00000 000
         // last 3 bits for the destination register and the remaining bits for the immediate value
         // the immediate can be as large as 2^53 bits which is very large for an immediate
-        CPU::_registers[(CPU::instr & 7UL)] = zero_Ext((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF); // get the immediate value
-        break;
+        CPU::_registers[ISA::last<CPU::MOVZX, 1>(CPU::instr)] = zero_Ext((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF); // get the immediate value
     }
-    case 2:
+    else if constexpr (Format == 2)
     {
         // for register-addr mov: 10
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits are for the operand registers
         // this is the same as case 0, why? for clear distinction, to know that the value being handled is clearly an address
         // you can use 00 as well which does the same
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = zero_Ext(CPU::_registers[CPU::instr & 7UL]); // put the address
-        break;
+        CPU::_registers[ISA::first<CPU::MOVZX, 2>(CPU::instr)] = zero_Ext(CPU::_registers[ISA::last<CPU::MOVZX, 2>(CPU::instr)]); // put the address
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         // for register-register[addr] mov: 11
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // this operation moves the value at the address at the source register and saves it in the destination register
         // the address should be loaded into the register first
-        auto mapped = map_mem(CPU::_registers[CPU::instr & 3UL]);
-        if (mapped.first == 1)
+        auto mapped = map_mem(CPU::_registers[ISA::last<CPU::MOVZX, 3>(CPU::instr)]);
+        if (CPU::instr & BOUNDS_PROVEN)
+        {
+            CPU::_registers[ISA::first<CPU::MOVZX, 3>(CPU::instr)] = zero_Ext(read_proven(mapped));
+        }
+        else if (mapped.first == 1)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = zero_Ext(CPU::data_memory.mem_read8(mapped.second));
+            CPU::_registers[ISA::first<CPU::MOVZX, 3>(CPU::instr)] = zero_Ext(CPU::data_memory.mem_read8(mapped.second));
         }
         else if (mapped.first == 2)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = zero_Ext(CPU::data_memory.mem_read16(mapped.second));
+            CPU::_registers[ISA::first<CPU::MOVZX, 3>(CPU::instr)] = zero_Ext(CPU::data_memory.mem_read16(mapped.second));
         }
         else if (mapped.first == 4)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = zero_Ext(CPU::data_memory.mem_read32(mapped.second));
+            CPU::_registers[ISA::first<CPU::MOVZX, 3>(CPU::instr)] = zero_Ext(CPU::data_memory.mem_read32(mapped.second));
         }
         else if (mapped.first == 8)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = zero_Ext(CPU::data_memory.mem_read64(mapped.second));
+            CPU::_registers[ISA::first<CPU::MOVZX, 3>(CPU::instr)] = zero_Ext(CPU::data_memory.mem_read64(mapped.second));
         }
-        break;
-    }
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movsx()
 {
     // this is also exactly the same as movzx but it instead extends the sign of the values
     // this extends the values by 1's only
-    short format = (CPU::instr >> 56) & 3UL; // get the format type
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // for register-register mov: 00
         //  000000 00 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits for the operands
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = sign_Ext(CPU::_registers[CPU::instr & 7UL], 1); // put the value
-        break;
+        CPU::_registers[ISA::first<CPU::MOVSX, 0>(CPU::instr)] = sign_Ext(CPU::_registers[ISA::last<CPU::MOVSX, 0>(CPU::instr)], 1); // put the value
     }
-    case 1:
+    else if constexpr (Format == 1)
     {
         // for register-imm mov: 01
         //  000000 01 00000000 00000000 00000000 00000000 00000000 00000000 00000 000
         // last 3 bits for the destination register and the remaining bits for the immediate value
         // the immediate can be as large as 2^53 bits which is very large for an immediate
-        CPU::_registers[(CPU::instr & 7UL)] = sign_Ext((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF, 1); // get the immediate value
-        break;
+        CPU::_registers[ISA::last<CPU::MOVSX, 1>(CPU::instr)] = sign_Ext((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF, 1); // get the immediate value
     }
-    case 2:
+    else if constexpr (Format == 2)
     {
         // for register-addr mov: 10
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // last 6 bits are for the operand registers
         // this is the same as case 0, why? for clear distinction, to know that the value being handled is clearly an address
         // you can use 00 as well which does the same
-        CPU::_registers[(CPU::instr >> 3) & 7UL] = sign_Ext(CPU::_registers[CPU::instr & 7UL], 1); // put the address
-        break;
+        CPU::_registers[ISA::first<CPU::MOVSX, 2>(CPU::instr)] = sign_Ext(CPU::_registers[ISA::last<CPU::MOVSX, 2>(CPU::instr)], 1); // put the address
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         // for register-register[addr] mov: 11
         //  000000 10 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
         // this operation moves the value at the address at the source register and saves it in the destination register
         // the address should be loaded into the register first
-        auto mapped = map_mem(CPU::_registers[CPU::instr & 3UL]);
-        if (mapped.first == 1)
+        auto mapped = map_mem(CPU::_registers[ISA::last<CPU::MOVSX, 3>(CPU::instr)]);
+        if (CPU::instr & BOUNDS_PROVEN)
+        {
+            CPU::_registers[ISA::first<CPU::MOVSX, 3>(CPU::instr)] = sign_Ext(read_proven(mapped), 1);
+        }
+        else if (mapped.first == 1)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = sign_Ext(CPU::data_memory.mem_read8(mapped.second), 1);
+            CPU::_registers[ISA::first<CPU::MOVSX, 3>(CPU::instr)] = sign_Ext(CPU::data_memory.mem_read8(mapped.second), 1);
         }
         else if (mapped.first == 2)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = sign_Ext(CPU::data_memory.mem_read16(mapped.second), 1);
+            CPU::_registers[ISA::first<CPU::MOVSX, 3>(CPU::instr)] = sign_Ext(CPU::data_memory.mem_read16(mapped.second), 1);
         }
         else if (mapped.first == 4)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = sign_Ext(CPU::data_memory.mem_read32(mapped.second), 1);
+            CPU::_registers[ISA::first<CPU::MOVSX, 3>(CPU::instr)] = sign_Ext(CPU::data_memory.mem_read32(mapped.second), 1);
         }
         else if (mapped.first == 8)
         {
-            CPU::_registers[(CPU::instr >> 3) & 3UL] = sign_Ext(CPU::data_memory.mem_read64(mapped.second), 1);
+            CPU::_registers[ISA::first<CPU::MOVSX, 3>(CPU::instr)] = sign_Ext(CPU::data_memory.mem_read64(mapped.second), 1);
         }
-        break;
-    }
     }
 }
 
@@ -445,10 +536,21 @@ void InstructionsImpl::store()
     // 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     // this instruction only takes address and the destination register,
     std::uint8_t regr = CPU::_registers[CPU::instr & 3UL];
-    CPU::_registers[CPU::pc]++;
+    bool proven = CPU::instr & BOUNDS_PROVEN;
+    if (regr >= CPU::sp)
+    {
+        // only the general purpose registers can be stored to
+        raise_fault(BAD_OPERAND, regr);
+        return;
+    }
+    CPU::_registers[CPU::pc] += 8;
     CPU::fetch(); // address must be in the next address
     auto mapped = map_mem(CPU::instr);
-    if (mapped.first == 1)
+    if (proven)
+    {
+        CPU::_registers[(regr)] = zero_Ext(read_proven(mapped));
+    }
+    else if (mapped.first == 1)
     {
         CPU::_registers[(regr)] = zero_Ext(CPU::data_memory.mem_read8(mapped.second));
     }
@@ -485,108 +587,119 @@ void InstructionsImpl::push()
 {
     // this instruction pushes all of the values in the registers to the stack in the order
     // ar, br, cr, dr, er1, er2, er3, er4
-    for (int i = 0; i < 8; i++)
-    {
-        CPU::data_memory.mem_write64(CPU::_registers[CPU::sp], CPU::_registers[i]);
-        CPU::_registers[CPU::sp] += 8;
-    }
+    // they are next to each other in _registers so it is a single block copy
+    if (CPU::instr & BOUNDS_PROVEN)
+        CPU::stack_memory.push_unchecked(CPU::_registers[CPU::sp], CPU::_registers, 8);
+    else
+        CPU::stack_memory.push(CPU::_registers[CPU::sp], CPU::_registers, 8);
 }
 
 void InstructionsImpl::pop()
 {
     // this instruction pops the values in the stack to the registers in the order
     // er4, er3, er2, er1, dr, cr, br, ar
-    for (int i = 7; i >= 0; i--)
-    {
-        CPU::_registers[CPU::sp] -= 8;
-        CPU::_registers[i] = CPU::data_memory.mem_read64(CPU::_registers[CPU::sp]);
-    }
+    if (CPU::instr & BOUNDS_PROVEN)
+        CPU::stack_memory.pop_unchecked(CPU::_registers[CPU::sp], CPU::_registers, 8);
+    else
+        CPU::stack_memory.pop(CPU::_registers[CPU::sp], CPU::_registers, 8);
 }
 
 void InstructionsImpl::pushr()
 {
     // push the specified register to the top of stack
-    CPU::data_memory.mem_write64(CPU::_registers[CPU::sp], CPU::_registers[CPU::instr & 3UL]);
-    CPU::_registers[CPU::sp] += 8;
+    if (CPU::instr & BOUNDS_PROVEN)
+        CPU::stack_memory.push_unchecked(CPU::_registers[CPU::sp], &CPU::_registers[CPU::instr & 3UL], 1);
+    else
+        CPU::stack_memory.push(CPU::_registers[CPU::sp], &CPU::_registers[CPU::instr & 3UL], 1);
 }
 
 void InstructionsImpl::popr()
 {
     // pop the top to stack to the specified register
-    CPU::_registers[CPU::sp] -= 8;
-    CPU::_registers[CPU::instr & 3UL] = CPU::data_memory.mem_read64(CPU::_registers[CPU::sp]);
+    if (CPU::instr & BOUNDS_PROVEN)
+        CPU::stack_memory.pop_unchecked(CPU::_registers[CPU::sp], &CPU::_registers[CPU::instr & 3UL], 1);
+    else
+        CPU::stack_memory.pop(CPU::_registers[CPU::sp], &CPU::_registers[CPU::instr & 3UL], 1);
 }
 
+template <byte Format>
 void InstructionsImpl::movz()
 {
     if (CPU::flags[CPU::ZERO] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movnz()
 {
     if (CPU::flags[CPU::ZERO] != 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::move()
 {
     if (CPU::flags[CPU::EQUAL] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movne()
 {
     if (CPU::flags[CPU::NOT_EQ] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movg()
 {
     if (CPU::flags[CPU::GREATER] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movge()
 {
     if (CPU::flags[CPU::GREATER_EQ] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movs()
 {
     if (CPU::flags[CPU::SMALLER] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::movse()
 {
     if (CPU::flags[CPU::SMALLER] == 1)
     {
-        mov();
+        mov<Format>();
     }
 }
 
+template <byte Format>
 void InstructionsImpl::iand()
 {
     // 000000 0 0 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     // can only apply and to register-register and register-imm
-    short format = (CPU::instr >> 56) & 1UL;
-    if (format == 1)
+    if constexpr ((Format & 1) == 1)
     {
         CPU::_registers[CPU::instr & 3UL] &= (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF;
     }
@@ -604,12 +717,12 @@ void InstructionsImpl::inot()
     CPU::_registers[pos] = ~CPU::_registers[pos];
 }
 
+template <byte Format>
 void InstructionsImpl::ior()
 {
     //  000000 0 0 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     // can only or a register to another register or register to an immediate value
-    short format = (CPU::instr >> 56) & 1UL;
-    if (format == 1)
+    if constexpr ((Format & 1) == 1)
     {
         CPU::_registers[CPU::instr & 3UL] |= (CPU::instr >> 3) | 0x1FFFFFFFFFFFFF;
     }
@@ -619,12 +732,12 @@ void InstructionsImpl::ior()
     }
 }
 
+template <byte Format>
 void InstructionsImpl::ixor()
 {
     //  000000 0 0 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     //  can only xor a register to another register or register to an immediate value
-    short format = (CPU::instr >> 56) & 1UL;
-    if (format == 1)
+    if constexpr ((Format & 1) == 1)
     {
         CPU::_registers[CPU::instr & 3UL] ^= (CPU::instr >> 3) ^ 0x1FFFFFFFFFFFFF;
     }
@@ -634,65 +747,65 @@ void InstructionsImpl::ixor()
     }
 }
 
+template <byte Format>
 void InstructionsImpl::lshift()
 {
     //  00000000 0 0000000 00000000 00000000 00000000 00000000 00000000 00000000
     //  can only lshift the value in a register according to the number of bits in another register
     //  or according to the given immediate bits
-    short format = (CPU::instr >> 56) & 1UL;
-    if (format == 1)
+    if constexpr ((Format & 1) == 1)
     {
-        CPU::_registers[CPU::instr & 3UL] = CPU::_registers[CPU::instr & 3UL] >> ((CPU::instr >> 3) ^ 0x1FFFFFFFFFFFFF);
+        CPU::_registers[CPU::instr & 3UL] = CPU::_registers[CPU::instr & 3UL] << ((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF);
     }
     else
     {
-        CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::_registers[(CPU::instr >> 3) & 3UL] >> CPU::_registers[CPU::instr & 3UL];
+        CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::_registers[(CPU::instr >> 3) & 3UL] << CPU::_registers[CPU::instr & 3UL];
     }
 }
 
+template <byte Format>
 void InstructionsImpl::rshift()
 {
     //  000000 0 0 00000000 00000000 00000000 00000000 00000000 00000000 00000 000
-    //  can only lshift the value in a register according to the number of bits in another register
+    //  can only rshift the value in a register according to the number of bits in another register
     //  or according to the given immediate bits
-    short format = (CPU::instr >> 56) & 1UL;
-    if (format == 1)
+    if constexpr ((Format & 1) == 1)
     {
-        CPU::_registers[CPU::instr & 3UL] = CPU::_registers[CPU::instr & 3UL] << ((CPU::instr >> 3) ^ 0x1FFFFFFFFFFFFF);
+        CPU::_registers[CPU::instr & 3UL] = CPU::_registers[CPU::instr & 3UL] >> ((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF);
     }
     else
     {
-        CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::_registers[(CPU::instr >> 3) & 3UL] << CPU::_registers[CPU::instr & 3UL];
+        CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::_registers[(CPU::instr >> 3) & 3UL] >> CPU::_registers[CPU::instr & 3UL];
     }
 }
 
+template <byte Format>
 void InstructionsImpl::add()
 {
     // 000000 00 00000000 00000000 00000000 00000000 00000000 00000000 00000 000
     // add can be of 4 types: register-register, register-immediate, immediate-register, register-memory
     // register-immediate and immediate-register are the same with different representing bits
-    auto format = (CPU::instr >> 56) & 3UL;
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // R-R
         CPU::_registers[(CPU::instr >> 3) & 3UL] += CPU::_registers[CPU::instr & 3UL];
-        break;
     }
-    case 1:
-    case 2:
+    else if constexpr (Format == 1 || Format == 2)
     {
         CPU::_registers[(CPU::instr & 3UL)] += (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF;
-        break;
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         auto reg = CPU::instr & 3UL;
+        bool proven = CPU::instr & BOUNDS_PROVEN;
         CPU::_registers[CPU::pc] += 8;
         CPU::fetch();
         auto mapped = map_mem(CPU::instr);
-        if (mapped.first == 1)
+        if (proven)
+        {
+            CPU::_registers[reg] += read_proven(mapped);
+        }
+        else if (mapped.first == 1)
         {
             CPU::_registers[reg] += CPU::data_memory.mem_read8(mapped.second);
         }
@@ -708,35 +821,33 @@ void InstructionsImpl::add()
         {
             CPU::_registers[reg] += CPU::data_memory.mem_read64(mapped.second);
         }
-        break;
-    }
     }
 }
 
+template <byte Format>
 void InstructionsImpl::sub()
 {
-    auto format = (CPU::instr >> 56) & 3UL;
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // R-R
         CPU::_registers[(CPU::instr >> 3) & 3UL] -= CPU::_registers[CPU::instr & 3UL];
-        break;
     }
-    case 1:
-    case 2:
+    else if constexpr (Format == 1 || Format == 2)
     {
         CPU::_registers[(CPU::instr & 3UL)] -= (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF;
-        break;
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         auto reg = CPU::instr & 3UL;
+        bool proven = CPU::instr & BOUNDS_PROVEN;
         CPU::_registers[CPU::pc] += 8;
         CPU::fetch();
         auto mapped = map_mem(CPU::instr);
-        if (mapped.first == 1)
+        if (proven)
+        {
+            CPU::_registers[reg] -= read_proven(mapped);
+        }
+        else if (mapped.first == 1)
         {
             CPU::_registers[reg] -= CPU::data_memory.mem_read8(mapped.second);
         }
@@ -752,35 +863,33 @@ void InstructionsImpl::sub()
         {
             CPU::_registers[reg] -= CPU::data_memory.mem_read64(mapped.second);
         }
-        break;
-    }
     }
 }
 
+template <byte Format>
 void InstructionsImpl::mul()
 {
-    auto format = (CPU::instr >> 56) & 3UL;
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // R-R
         CPU::_registers[(CPU::instr >> 3) & 3UL] *= CPU::_registers[CPU::instr & 3UL];
-        break;
     }
-    case 1:
-    case 2:
+    else if constexpr (Format == 1 || Format == 2)
     {
         CPU::_registers[(CPU::instr & 3UL)] *= (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF;
-        break;
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         auto reg = CPU::instr & 3UL;
+        bool proven = CPU::instr & BOUNDS_PROVEN;
         CPU::_registers[CPU::pc] += 8;
         CPU::fetch();
         auto mapped = map_mem(CPU::instr);
-        if (mapped.first == 1)
+        if (proven)
+        {
+            CPU::_registers[reg] *= read_proven(mapped);
+        }
+        else if (mapped.first == 1)
         {
             CPU::_registers[reg] *= CPU::data_memory.mem_read8(mapped.second);
         }
@@ -796,52 +905,69 @@ void InstructionsImpl::mul()
         {
             CPU::_registers[reg] *= CPU::data_memory.mem_read64(mapped.second);
         }
-        break;
-    }
     }
 }
 
+template <byte Format>
 void InstructionsImpl::div()
 {
-   auto format = (CPU::instr >> 56) & 3UL;
-    switch (format)
-    {
-    case 0:
+    if constexpr (Format == 0)
     {
         // R-R
+        if (CPU::_registers[CPU::instr & 3UL] == 0)
+        {
+            raise_fault(DIVIDE_BY_ZERO, 0);
+            return;
+        }
         CPU::_registers[(CPU::instr >> 3) & 3UL] /= CPU::_registers[CPU::instr & 3UL];
-        break;
     }
-    case 1:
-    case 2:
+    else if constexpr (Format == 1 || Format == 2)
     {
+        if (((CPU::instr >> 3) & 0x1FFFFFFFFFFFFF) == 0)
+        {
+            raise_fault(DIVIDE_BY_ZERO, 0);
+            return;
+        }
         CPU::_registers[(CPU::instr & 3UL)] /= (CPU::instr >> 3) & 0x1FFFFFFFFFFFFF;
-        break;
     }
-    case 3:
+    else if constexpr (Format == 3)
     {
         auto reg = CPU::instr & 3UL;
+        bool proven = CPU::instr & BOUNDS_PROVEN;
         CPU::_registers[CPU::pc] += 8;
         CPU::fetch();
         auto mapped = map_mem(CPU::instr);
-        if (mapped.first == 1)
+        qword divisor;
+        if (proven)
         {
-            CPU::_registers[reg] /= CPU::data_memory.mem_read8(mapped.second);
+            divisor = read_proven(mapped);
+        }
+        else if (mapped.first == 1)
+        {
+            divisor = CPU::data_memory.mem_read8(mapped.second);
         }
         else if (mapped.first == 2)
         {
-            CPU::_registers[reg] /= CPU::data_memory.mem_read16(mapped.second);
+            divisor = CPU::data_memory.mem_read16(mapped.second);
         }
         else if (mapped.first == 4)
         {
-            CPU::_registers[reg] /= CPU::data_memory.mem_read32(mapped.second);
+            divisor = CPU::data_memory.mem_read32(mapped.second);
         }
         else if (mapped.first == 8)
         {
-            CPU::_registers[reg] /= CPU::data_memory.mem_read64(mapped.second);
+            divisor = CPU::data_memory.mem_read64(mapped.second);
         }
-        break;
-    }
+        else
+        {
+            return;
+        }
+        if (divisor == 0)
+        {
+            raise_fault(DIVIDE_BY_ZERO, mapped.second);
+            return;
+        }
+        CPU::_registers[reg] /= divisor;
     }
 }
 
@@ -870,10 +996,15 @@ void InstructionsImpl::save()
     //  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
     //  this takes a destination register and stores it in given memory address
     auto reg = CPU::instr & 3UL;
+    bool proven = CPU::instr & BOUNDS_PROVEN;
     CPU::_registers[CPU::pc] += 8;
     CPU::fetch();
     auto mapped = map_mem(CPU::instr);
-    if (mapped.first == 1)
+    if (proven)
+    {
+        write_proven(mapped, CPU::_registers[reg]);
+    }
+    else if (mapped.first == 1)
     {
         CPU::data_memory.mem_write8(mapped.second, CPU::_registers[reg]);
     }
@@ -891,5 +1022,136 @@ void InstructionsImpl::save()
     }
 }
 
+void InstructionsImpl::call()
+{
+    //  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
+    // the first 6 bits for the instruction, the address of the subroutine is in the next word just like jmp
+    // the return address pushed is the address of that word so the pc lands right after the call on ret
+    bool proven = CPU::instr & BOUNDS_PROVEN;
+    CPU::_registers[CPU::pc] += 8;
+    qword slot = CPU::_registers[CPU::sp];
+    // the entries at or above the slot have already been popped by the guest
+    while (!CPU::return_stack.empty() && CPU::return_stack.back().slot >= slot)
+        CPU::return_stack.pop_back();
+    if (proven)
+        CPU::stack_memory.push_unchecked(CPU::_registers[CPU::sp], &CPU::_registers[CPU::pc], 1);
+    else
+        CPU::stack_memory.push(CPU::_registers[CPU::sp], &CPU::_registers[CPU::pc], 1);
+    CPU::return_stack.push_back({slot, CPU::_registers[CPU::pc]});
+    CPU::fetch();
+    CPU::_registers[CPU::pc] = CPU::instr;
+}
+
+void InstructionsImpl::ret()
+{
+    //  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
+    // takes no operands, the return address is whatever is on top of the stack
+    qword address = CPU::_registers[CPU::pc]; // stays put if the stack underflows
+    if (CPU::instr & BOUNDS_PROVEN)
+        CPU::stack_memory.pop_unchecked(CPU::_registers[CPU::sp], &address, 1);
+    else
+        CPU::stack_memory.pop(CPU::_registers[CPU::sp], &address, 1);
+    qword slot = CPU::_registers[CPU::sp];
+    while (!CPU::return_stack.empty() && CPU::return_stack.back().slot > slot)
+        CPU::return_stack.pop_back();
+    if (!CPU::return_stack.empty() && CPU::return_stack.back().slot == slot && CPU::return_stack.back().address == address)
+    {
+        CPU::return_stack.pop_back();
+    }
+    else
+    {
+        // the guest changed its return address or returned without a call, it is no longer in sync with the calls
+        CPU::return_stack.clear();
+        Analysis::drop_proofs();
+    }
+    CPU::_registers[CPU::pc] = address;
+}
+
+// the atomics only take 8 byte mapped addresses
+static bool atomic_address(qword addr, qword &address)
+{
+    auto mapped = map_mem(addr);
+    if (mapped.first != 8)
+    {
+        raise_fault(BAD_OPERAND, addr);
+        return false;
+    }
+    address = mapped.second;
+    return true;
+}
+
+void InstructionsImpl::cas()
+{
+    // 000000 00 00000000 00000000 00000000 00000000 00000000 00000000 00 000 000
+    // the last register holds the address, ar the expected value and the first register the value to write
+    // ar gets the value that was in memory and the equal flags tell if the swap happened
+    qword address;
+    if (!atomic_address(CPU::_registers[CPU::instr & 3UL], address))
+        return;
+    qword expected = CPU::_registers[CPU::ar];
+    qword old = CPU::data_memory.mem_cas64(address, expected, CPU::_registers[(CPU::instr >> 3) & 3UL]);
+    CPU::_registers[CPU::ar] = old;
+    CPU::flags[CPU::EQUAL] = old == expected;
+    CPU::flags[CPU::NOT_EQ] = old != expected;
+}
+
+void InstructionsImpl::fetch_add()
+{
+    // same operands as cas, the first register is added to the word and gets the value from before the add
+    qword address;
+    if (!atomic_address(CPU::_registers[CPU::instr & 3UL], address))
+        return;
+    CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_fetch_add64(address, CPU::_registers[(CPU::instr >> 3) & 3UL]);
+}
+
+void InstructionsImpl::xchg()
+{
+    // the first register and the word at the address in the last register swap their values
+    qword address;
+    if (!atomic_address(CPU::_registers[CPU::instr & 3UL], address))
+        return;
+    CPU::_registers[(CPU::instr >> 3) & 3UL] = CPU::data_memory.mem_exchange64(address, CPU::_registers[(CPU::instr >> 3) & 3UL]);
+}
+
+void InstructionsImpl::rdcycle()
+{
+    // the last register gets the number of instructions this hart retired before this one
+    CPU::_registers[CPU::instr & 3UL] = CPU::retired;
+}
+
+void InstructionsImpl::rdtime()
+{
+    // the last register gets the time page[see CPU/EnigmaClock.hpp], recorded since it's different on every run
+    CPU::_registers[CPU::instr & 3UL] = Replay::value(Clock::now);
+}
+
+void InstructionsImpl::nop()
+{
+}
+
+void InstructionsImpl::halt()
+{
+    CPU::running = false;
+}
+
+void InstructionsImpl::syscall()
+{
+    Manager::handlesyscalls();
+}
+
+void InstructionsImpl::fence()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void InstructionsImpl::brk()
+{
+    // stop on the breakpoint without running it, the dispatch loop moves past every instruction so undo that here
+    CPU::trap = {CPU::BREAKPOINT, NO_FAULT, CPU::_registers[CPU::pc], 0};
+    CPU::running = false;
+    CPU::_registers[CPU::pc] -= 8;
+    CPU::retired--;
+}
+
 #endif
 //  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
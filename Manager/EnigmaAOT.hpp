@@ -0,0 +1,370 @@
+#ifndef ENIGMA_AOT
+#define ENIGMA_AOT
+
+#include "EnigmaMetering.hpp"
+#include <ostream>
+#include <sstream>
+
+/*
+Ahead of time translation of the program in the instruction memory to C++.
+Every block found by the analysis becomes a label, the registers ar to er4 become locals and every instruction
+is turned into the few lines of C++ that do the same thing, with its operands and immediates already decoded.
+The memory accesses go through the same Memory accessors as the interpreter so faults are raised the same way.
+
+The generated file is compiled with the host compiler and the headers of the VM, which are its runtime:
+the syscalls, the stack and the instructions that aren't worth translating[stores and movs through a register,
+the stack instructions, call and ret] run the interpreter's handler on the synced registers.
+Whatever can't be reached through a known block[a ret to an address the analysis didn't see for example] is
+handed back to the interpreter, so a translated program always behaves exactly like the interpreted one,
+gas included when compiled with ENIGMA_AOT_METERED[the block costs are the ones at translation time].
+The harts a translated program spawns run in the interpreter. The instructions a block retires are counted when
+it is entered, so after a fault in the middle of a block rdcycle counts the rest of the block as well.
+*/
+
+namespace AOT
+{
+    // write the translation unit for the loaded program starting at pc, source is only used in the header comment
+    // returns false if the program couldn't be analysed, nothing is written then
+    inline bool emit(std::ostream &out, const std::string &source);
+};
+
+static std::string aot_hex(qword value)
+{
+    std::ostringstream out;
+    out << "0x" << std::hex << value;
+    return out.str();
+}
+
+static std::string aot_reg(qword index)
+{
+    return "r" + std::to_string(index);
+}
+
+// continue at next, directly if it starts a block
+static std::string aot_goto(qword next)
+{
+    if ((next & 7) == 0 && (next >> 3) < Analysis::block_index.size() && Analysis::block_index[next >> 3] != Analysis::NO_BLOCK)
+        return "goto L_" + std::to_string(next) + ";";
+    return "{ next = " + aot_hex(next) + "; goto dispatch; }";
+}
+
+// the flags each conditional jump and mov looks at, the same tests as their handlers
+static const char *aot_condition(std::uint8_t op)
+{
+    switch (op)
+    {
+    case CPU::JZ:
+    case CPU::MOVZ:
+        return "CPU::flags[CPU::ZERO] == 1";
+    case CPU::JNZ:
+    case CPU::MOVNZ:
+        return "CPU::flags[CPU::ZERO] != 1";
+    case CPU::JE:
+    case CPU::MOVE:
+        return "CPU::flags[CPU::EQUAL] == 1";
+    case CPU::JNE:
+        return "CPU::flags[CPU::EQUAL] != 1 && CPU::flags[CPU::NOT_EQ] == 1";
+    case CPU::MOVNE:
+        return "CPU::flags[CPU::NOT_EQ] == 1";
+    case CPU::JG:
+    case CPU::MOVG:
+        return "CPU::flags[CPU::GREATER] == 1";
+    case CPU::JGE:
+        return "CPU::flags[CPU::GREATER_EQ] == 1 || CPU::flags[CPU::GREATER] == 1";
+    case CPU::MOVGE:
+        return "CPU::flags[CPU::GREATER_EQ] == 1";
+    case CPU::JSE:
+        return "CPU::flags[CPU::SMALLER_EQ] == 1 || CPU::flags[CPU::SMALLER] == 1";
+    default:
+        // js, movs and movse
+        return "CPU::flags[CPU::SMALLER] == 1";
+    }
+}
+
+// the read of a constant mapped address, empty if the size isn't one the handlers take
+static std::string aot_read(qword mapped_addr)
+{
+    auto mapped = map_mem(mapped_addr);
+    if (mapped.first != 1 && mapped.first != 2 && mapped.first != 4 && mapped.first != 8)
+        return "";
+    return "CPU::data_memory.mem_read" + std::to_string(mapped.first * 8) + "(" + aot_hex(mapped.second) + ")";
+}
+
+// translate a single instruction, returns true if it always leaves the block by itself
+// ahead is the number of instructions of the block from this one on, the block adds them all to retired up front
+static bool aot_insn(std::ostream &out, qword addr, qword instr, qword operand, qword ahead)
+{
+    std::uint8_t op = ISA::opcode(instr);
+    std::uint8_t format = ISA::format(instr);
+    qword imm = ISA::imm(instr);
+    qword length = ISA::length(instr);
+    std::string last = aot_reg(ISA::last(instr));    // the register in the last bits
+    std::string first = aot_reg(ISA::first(instr));  // the register right before it
+    // pc is only kept up to date where the instruction can fault, it's what the trap reports
+    std::string at = "CPU::_registers[CPU::pc] = " + aot_hex(length == 16 ? addr + 8 : addr) + "; ";
+    std::string check = " CHECK(" + aot_hex(addr + length) + ")";
+    std::string handler = "HANDLER(" + aot_hex(addr) + ", " + aot_hex(instr) + ")";
+
+    out << "    // " << aot_hex(addr) << ": " << ISA::disassemble(instr, operand) << "\n    ";
+    switch (op)
+    {
+    case CPU::ADD:
+    case CPU::SUB:
+    case CPU::MUL:
+    {
+        const char *assign = op == CPU::ADD ? " += " : op == CPU::SUB ? " -= " : " *= ";
+        if (format == 0)
+            out << first << assign << last << ";";
+        else if (format != 3)
+            out << last << assign << aot_hex(imm) << ";";
+        else if (!aot_read(operand).empty())
+            out << at << last << assign << aot_read(operand) << ";" << check;
+        break;
+    }
+    case CPU::DIV:
+        if (format == 0)
+            out << "if (" << last << " == 0) { " << at << "raise_fault(DIVIDE_BY_ZERO, 0); } else " << first << " /= " << last << ";" << check;
+        else if (format != 3)
+            out << (imm == 0 ? at + "raise_fault(DIVIDE_BY_ZERO, 0);" + check : last + " /= " + aot_hex(imm) + ";");
+        else if (!aot_read(operand).empty())
+            out << "{ " << at << "qword divisor = " << aot_read(operand) << "; if (divisor == 0) raise_fault(DIVIDE_BY_ZERO, "
+                << aot_hex(map_mem(operand).second) << "); else " << last << " /= divisor; }" << check;
+        break;
+    case CPU::INC:
+        out << last << "++;";
+        break;
+    case CPU::DEC:
+        out << last << "--;";
+        break;
+    case CPU::NEG:
+        out << last << " = ~" << last << " + 1;";
+        break;
+    case CPU::AND:
+        out << ((format & 1) == 1 ? last + " &= " + aot_hex(imm) : first + " &= " + last) << ";";
+        break;
+    case CPU::NOT:
+        out << last << " = ~" << last << ";";
+        break;
+    case CPU::OR:
+        out << ((format & 1) == 1 ? last + " |= " + aot_hex((instr >> 3) | 0x1FFFFFFFFFFFFF) : first + " |= " + last) << ";";
+        break;
+    case CPU::XOR:
+        out << ((format & 1) == 1 ? last + " ^= " + aot_hex((instr >> 3) ^ 0x1FFFFFFFFFFFFF) : first + " ^= " + last) << ";";
+        break;
+    case CPU::LSHIFT:
+    case CPU::RSHIFT:
+    {
+        // the shift count is masked the way the host's shift instruction does it for the interpreter
+        const char *shift = op == CPU::LSHIFT ? " << " : " >> ";
+        if ((format & 1) == 1)
+            out << last << " = " << last << shift << (imm & 63) << ";";
+        else
+            out << first << " = " << first << shift << "(" << last << " & 63);";
+        break;
+    }
+    case CPU::MOV:
+    case CPU::MOVZX:
+    case CPU::MOVSX:
+    case CPU::MOVZ:
+    case CPU::MOVNZ:
+    case CPU::MOVE:
+    case CPU::MOVNE:
+    case CPU::MOVG:
+    case CPU::MOVGE:
+    case CPU::MOVS:
+    case CPU::MOVSE:
+    {
+        if (format == 3)
+        {
+            out << handler;
+            break;
+        }
+        if (op != CPU::MOV && op != CPU::MOVZX && op != CPU::MOVSX)
+            out << "if (" << aot_condition(op) << ") ";
+        out << (format == 1 ? last + " = " + aot_hex(imm) : first + " = " + last) << ";";
+        break;
+    }
+    case CPU::LOAD:
+        out << last << " = " << aot_hex(ISA::load_imm(instr)) << ";";
+        break;
+    case CPU::LEA:
+        out << "r0 = " << aot_hex(operand) << ";";
+        break;
+    case CPU::SAVE:
+    {
+        auto mapped = map_mem(operand);
+        if (mapped.first == 1 || mapped.first == 2 || mapped.first == 4 || mapped.first == 8)
+            out << at << "CPU::data_memory.mem_write" << mapped.first * 8 << "(" << aot_hex(mapped.second) << ", " << last << ");" << check;
+        break;
+    }
+    case CPU::CMP:
+        out << "compare(" << last << ", " << first << ");";
+        break;
+    case CPU::FENCE:
+        out << "std::atomic_thread_fence(std::memory_order_seq_cst);";
+        break;
+    case CPU::RDCYCLE:
+        out << last << " = CPU::retired - " << ahead << ";";
+        break;
+    case CPU::RDTIME:
+        out << last << " = Replay::value(Clock::now);";
+        break;
+    case CPU::JMP:
+        out << aot_goto(operand + 8) << "\n";
+        return true;
+    case CPU::JZ:
+    case CPU::JNZ:
+    case CPU::JE:
+    case CPU::JNE:
+    case CPU::JG:
+    case CPU::JGE:
+    case CPU::JS:
+    case CPU::JSE:
+        out << "if (" << aot_condition(op) << ") " << aot_goto(operand + 8) << "\n    " << aot_goto(addr + 16) << "\n";
+        return true;
+    case CPU::HALT:
+        out << "CPU::running = false; CPU::_registers[CPU::pc] = " << aot_hex(addr + 8) << "; goto stop;\n";
+        return true;
+    case CPU::CALL:
+    case CPU::RET:
+        // where these go is only known once they ran
+        out << handler << "\n    next = CPU::_registers[CPU::pc] + 8; goto dispatch;\n";
+        return true;
+    case CPU::STORE:
+    case CPU::PUSH:
+    case CPU::POP:
+    case CPU::PUSH_REG:
+    case CPU::POP_REG:
+    case CPU::SYSCALL:
+    case CPU::CAS:
+    case CPU::FETCH_ADD:
+    case CPU::XCHG:
+        out << handler;
+        break;
+    default:
+        // nop and the opcodes without a handler
+        out << ";";
+        break;
+    }
+    out << "\n";
+    return false;
+}
+
+bool AOT::emit(std::ostream &out, const std::string &source)
+{
+    // the image is written out as it is loaded, the proofs are made again when the translated program starts
+    Analysis::drop_proofs();
+    if (!Analysis::build_cfg(CPU::_registers[CPU::pc]))
+        return false;
+    Metering::price_blocks();
+
+    out << "// translated from " << source << " by the Enigma AOT compiler, don't edit\n"
+        << "// build it with the VM's root in the include path, define ENIGMA_AOT_METERED to charge gas\n"
+        << "// and ENIGMA_AOT_NO_MAIN to link enigma_aot_run into another program\n"
+        << "#include \"Manager/EnigmaManager.hpp\"\n\n";
+
+    out << "static qword enigma_image[] = {";
+    for (qword pos = 0; pos < CPU::mem_pointer; pos += 8)
+        out << (pos % 32 == 0 ? "\n    " : " ") << aot_hex(CPU::instruction_memory.mem_read64(pos)) << ",";
+    out << "\n};\n\n";
+
+    out << "#define SYNC_OUT";
+    for (qword i = 0; i < CPU::sp; i++)
+        out << " CPU::_registers[" << i << "] = r" << i << ";";
+    out << "\n#define SYNC_IN";
+    for (qword i = 0; i < CPU::sp; i++)
+        out << " r" << i << " = CPU::_registers[" << i << "];";
+    out << "\n// run the interpreter's handler on the word at addr\n"
+        << "#define HANDLER(addr, word) SYNC_OUT CPU::_registers[CPU::pc] = addr; CPU::instr = word; CPU::decode(); CPU::execute(); SYNC_IN\\\n"
+        << "    if (!CPU::running) { CPU::_registers[CPU::pc] += 8; goto stop; }\n"
+        << "// stop where the interpreter would have if the last instruction faulted\n"
+        << "#define CHECK(end) if (!CPU::running) { CPU::_registers[CPU::pc] = end; goto stop; }\n"
+        << "#ifdef ENIGMA_AOT_METERED\n"
+        << "#define CHARGE(addr, cost) if (Metering::gas < cost) { CPU::_registers[CPU::pc] = addr; CPU::trap.status = CPU::OUT_OF_GAS; goto stop; } Metering::gas -= cost;\n"
+        << "#define RESUME Metering::run\n"
+        << "#else\n"
+        << "#define CHARGE(addr, cost)\n"
+        << "#define RESUME CPU::run\n"
+        << "#endif\n\n";
+
+    out << "CPU::Trap enigma_aot_run()\n{\n"
+        << "    std::vector<qword> image(enigma_image, enigma_image + sizeof(enigma_image) / sizeof(qword));\n"
+        << "    Manager::load_instructions(image);\n"
+        << "    // whatever gets handed back to the interpreter still gets the proofs and the block costs\n"
+        << "    CPU::return_stack.clear();\n"
+        << "    Analysis::prove_bounds();\n"
+        << "#ifdef ENIGMA_AOT_METERED\n"
+        << "    Metering::price_blocks();\n"
+        << "    Harts::metered = true;\n"
+        << "#endif\n"
+        << "    CPU::begin_run();\n"
+        << "    qword";
+    for (qword i = 0; i < CPU::sp; i++)
+        out << (i == 0 ? " " : ", ") << "r" << i << " = CPU::_registers[" << i << "]";
+    out << ";\n    qword next = CPU::_registers[CPU::pc];\n    goto dispatch;\n\n";
+
+    for (auto &block : Analysis::blocks)
+    {
+        out << "L_" << block.start << ":\n    CHARGE(" << aot_hex(block.start) << ", " << block.cost << ")\n"
+            << "    CPU::retired += " << block.count << ";\n";
+        bool left = false;
+        qword ahead = block.count;
+        for (qword pos = block.start; pos < block.end; ahead--)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            qword length = Analysis::instr_length(instr);
+            left = aot_insn(out, pos, instr, length == 16 ? CPU::instruction_memory.mem_read64(pos + 8) : 0, ahead);
+            pos += length;
+        }
+        if (!left)
+            out << "    " << aot_goto(block.end) << "\n";
+        out << "\n";
+    }
+
+    out << "dispatch:\n    switch (next)\n    {\n";
+    for (auto &block : Analysis::blocks)
+        out << "    case " << aot_hex(block.start) << ":\n        goto L_" << block.start << ";\n";
+    out << "    }\n"
+        << "    // not the start of a translated block, the interpreter takes it from here\n"
+        << "    SYNC_OUT\n"
+        << "    CPU::_registers[CPU::pc] = next;\n"
+        << "    {\n"
+        << "        CPU::Trap trap = RESUME();\n"
+        << "        Harts::join_all();\n"
+        << "        Replay::flush();\n"
+        << "        return trap;\n"
+        << "    }\n\n"
+        << "stop:\n"
+        << "    SYNC_OUT\n"
+        << "    Harts::metered = false;\n"
+        << "    Harts::join_all();\n"
+        << "    Replay::flush();\n"
+        << "    return CPU::end_run();\n"
+        << "}\n\n";
+
+    out << "#ifndef ENIGMA_AOT_NO_MAIN\n"
+        << "int main(int argc, char **argv)\n{\n"
+        << "#ifdef ENIGMA_AOT_METERED\n"
+        << "    Metering::gas = argc > 1 ? std::stoull(argv[1]) : 0;\n"
+        << "#else\n"
+        << "    (void)argc;\n"
+        << "    (void)argv;\n"
+        << "#endif\n"
+        << "    CPU::Trap trap = enigma_aot_run();\n"
+        << "    if (trap.status == CPU::FAULTED)\n"
+        << "    {\n"
+        << "        std::cerr << \"fault \" << (int)trap.fault << \" at \" << trap.pc << std::endl;\n"
+        << "        return -1;\n"
+        << "    }\n"
+        << "    if (trap.status == CPU::OUT_OF_GAS)\n"
+        << "    {\n"
+        << "        std::cerr << \"out of gas at \" << CPU::_registers[CPU::pc] << std::endl;\n"
+        << "        return -1;\n"
+        << "    }\n"
+        << "    return CPU::_registers[CPU::ar];\n"
+        << "}\n"
+        << "#endif\n";
+    return true;
+}
+
+#endif
@@ -0,0 +1,588 @@
+#ifndef ENIGMA_ANALYSIS
+#define ENIGMA_ANALYSIS
+
+#include "../CPU/EnigmaInstructions.hpp"
+#include <algorithm>
+
+/*
+This is the load-time analysis of the program sitting in the instruction memory.
+It rebuilds the control flow graph of the program from the entry point and then runs an abstract interpretation
+over it where every register is tracked as a range of the values it can hold.
+With those ranges, every access to the data memory that is always in bounds for the current memory size and every
+push or pop that always fits the stack segment gets the BOUNDS_PROVEN bit in its first word and its handler skips
+the bounds check.
+
+The guest can never write to the instruction memory so the marks stay valid until the data memory shrinks
+below the size they were proven against. Every syscall that resizes the data memory calls revalidate() which
+strips the marks when that happens. Reserved bits must be zero in a guest program, a BOUNDS_PROVEN bit coming
+from the program itself is cleared from every word as it's loaded and again before the proofs are made, whether
+the word can be reached or not[see strip_reserved].
+
+A ret is assumed to go back to the instruction after one of the calls. The return stack kept by the CPU checks
+this at run time and when a ret goes anywhere else, the proofs are dropped.
+
+A program can be shared by any number of VMs as a code segment: two frozen copies of it, one without the proofs and
+one with the proofs made for the registers, the data memory size and the stack size of the VM that shared it. A
+VM on a segment starts on the proven copy if it starts with the same registers and at least as much data memory and
+stack and on the plain one otherwise, the analysis never runs for it and nothing of the program is its own. Dropping the proofs moves it
+to the plain copy. Anything that writes to the program[the optimizer, the debugger, loading more of it] gives the
+VM a private copy first with own_code.
+*/
+
+namespace Analysis
+{
+    // a program shared between VMs, nothing in it changes once it's made[see Manager::share_program]
+    struct CodeSegment
+    {
+        Memory code;                      // without the proofs
+        Memory proven;                    // with the proofs made for the state below
+        qword registers[CPU::regr_count]; // the registers they were made for
+        qword proven_against;             // the data memory size they were made for
+        qword stack_size;                 // and the stack size
+        qword length;                     // the bytes of the program, what mem_pointer was
+    };
+
+    // a straight line of instructions with a single entry at start
+    struct Block
+    {
+        qword start; // address of the first instruction
+        qword end;   // address just past the last instruction
+        qword count; // number of instructions
+        qword cost;  // gas charged when the block is entered[see Manager/EnigmaMetering.hpp]
+        std::vector<std::uint32_t> successors; // indices of the blocks that can follow this one
+    };
+
+    // the range of values a register can hold, all values when lo = 0 and hi = BIN_MAX
+    struct Range
+    {
+        qword lo;
+        qword hi;
+    };
+
+    struct State
+    {
+        Range regs[CPU::regr_count];
+    };
+
+    static const std::uint32_t NO_BLOCK = 0xFFFFFFFF;
+
+    // after this many changes to a block's entry state, any range that still grows is given up on
+    static const int WIDEN_AFTER = 8;
+
+    // like the memories, the analysis belongs to the VM running on the thread
+    static thread_local std::vector<Block> blocks;
+    static thread_local std::vector<std::uint32_t> block_index; // the block starting at an address, indexed by address >> 3
+
+    static thread_local std::vector<qword> proven_sites; // addresses of the instructions carrying BOUNDS_PROVEN
+    static thread_local std::size_t proven_against = 0;  // the data memory size the proofs were made for
+
+    // the segment the VM's program is on, nullptr if it has a program of its own
+    static thread_local std::shared_ptr<const CodeSegment> segment;
+    static thread_local bool segment_proven = false; // running on the proven copy of the segment
+
+    // the length in bytes of the instruction, some instructions take their operand from the next word
+    inline qword instr_length(qword instr);
+
+    // does the instruction access the data memory[and so has bit 55 reserved for BOUNDS_PROVEN]
+    inline bool accesses_memory(qword instr);
+
+    // clear BOUNDS_PROVEN from every word in [from, to) of the instruction memory that reads as an instruction
+    // accessing memory, the program's own bits never get to run
+    inline void strip_reserved(qword from, qword to);
+
+    // discover every reachable instruction from entry and split them into blocks
+    // fails if the program jumps to an address that is not a multiple of 8
+    inline bool build_cfg(qword entry);
+
+    // the whole pass: build the graph, compute the register ranges and mark the proven accesses
+    inline void prove_bounds();
+
+    // strip the proofs if the data memory became smaller than what they were made for
+    inline void revalidate();
+
+    // strip every proof
+    inline void drop_proofs();
+
+    // give the VM a writable program of its own if it's on a segment, before anything writes to the program
+    inline void own_code();
+};
+
+qword Analysis::instr_length(qword instr)
+{
+    return ISA::length(instr);
+}
+
+bool Analysis::accesses_memory(qword instr)
+{
+    return ISA::accesses_memory(instr);
+}
+
+void Analysis::strip_reserved(qword from, qword to)
+{
+    // every word and not just the instructions a walk from the start would find, a jump can land on any of them.
+    // An operand that reads like a memory access has an opcode in its top bits so it's an address or a target
+    // past 2^56 with or without bit 55, out of reach of any memory either way
+    for (qword pos = from & ~7UL; pos + 8 <= to && !CPU::instruction_memory.out_of_bounds(pos, 8); pos += 8)
+    {
+        qword instr = CPU::instruction_memory.mem_read64(pos);
+        if ((instr & BOUNDS_PROVEN) && accesses_memory(instr))
+            CPU::instruction_memory.mem_write64(pos, instr & ~BOUNDS_PROVEN);
+    }
+}
+
+// the addresses execution can continue at after the instruction at addr
+// a jump continues right after its target since the pc is incremented once the jump is done
+// for a call these are the subroutine and the return site, a ret has none that are known here
+static std::vector<qword> successors_of(qword addr, qword instr)
+{
+    std::vector<qword> next;
+    std::uint8_t op = instr >> 58;
+    if (op == CPU::HALT || op == CPU::RET)
+        return next;
+    if (op == CPU::JMP || op == CPU::JZ || op == CPU::JNZ || op == CPU::JE || op == CPU::JNE ||
+        op == CPU::JG || op == CPU::JGE || op == CPU::JS || op == CPU::JSE || op == CPU::CALL)
+    {
+        if (CPU::instruction_memory.out_of_bounds(addr + 8, 8))
+            return next;
+        next.push_back(CPU::instruction_memory.mem_read64(addr + 8) + 8);
+        if (op == CPU::JMP)
+            return next;
+    }
+    next.push_back(addr + Analysis::instr_length(instr));
+    return next;
+}
+
+static bool is_branch(qword instr)
+{
+    std::uint8_t op = instr >> 58;
+    return op == CPU::HALT || op == CPU::JMP || op == CPU::JZ || op == CPU::JNZ || op == CPU::JE ||
+           op == CPU::JNE || op == CPU::JG || op == CPU::JGE || op == CPU::JS || op == CPU::JSE ||
+           op == CPU::CALL || op == CPU::RET;
+}
+
+bool Analysis::build_cfg(qword entry)
+{
+    blocks.clear();
+    qword code_size = CPU::instruction_memory.current_size();
+    block_index.assign((code_size >> 3) + 1, NO_BLOCK);
+    std::vector<bool> reachable((code_size >> 3) + 1, false);
+    std::vector<bool> leader((code_size >> 3) + 1, false);
+
+    // first find every instruction that can be executed and the leaders of the blocks
+    std::vector<qword> worklist = {entry};
+    leader[entry >> 3] = true;
+    while (!worklist.empty())
+    {
+        qword addr = worklist.back();
+        worklist.pop_back();
+        if ((addr & 7) != 0)
+            return false;
+        if (CPU::instruction_memory.out_of_bounds(addr, 8) || reachable[addr >> 3])
+            continue;
+        reachable[addr >> 3] = true;
+        qword instr = CPU::instruction_memory.mem_read64(addr);
+        for (qword next : successors_of(addr, instr))
+        {
+            if ((next & 7) != 0)
+                return false;
+            if (next >= code_size)
+                continue; // the fetch will fail there
+            if (is_branch(instr))
+                leader[next >> 3] = true;
+            worklist.push_back(next);
+        }
+    }
+
+    // then cut the reachable instructions into blocks, a block ends at a branch or right before another leader
+    for (qword addr = 0; addr + 8 <= code_size; addr += 8)
+    {
+        if (!reachable[addr >> 3] || !leader[addr >> 3])
+            continue;
+        block_index[addr >> 3] = blocks.size();
+        Block block = {addr, addr, 0, 0, {}};
+        qword pos = addr;
+        while (true)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            pos += instr_length(instr);
+            block.count++;
+            if (is_branch(instr) || pos + 8 > code_size || !reachable[pos >> 3] || leader[pos >> 3])
+                break;
+        }
+        block.end = pos;
+        blocks.push_back(block);
+    }
+    // the registers after a call come from the subroutine's ret and not from the call itself
+    // so a call only leads to the subroutine and every ret leads to every return site
+    std::vector<std::uint32_t> return_sites;
+    std::vector<std::uint32_t> returning;
+    for (std::uint32_t b = 0; b < blocks.size(); b++)
+    {
+        Block &block = blocks[b];
+        qword last = block.start;
+        for (qword pos = block.start; pos < block.end; pos += instr_length(CPU::instruction_memory.mem_read64(pos)))
+            last = pos;
+        qword instr = CPU::instruction_memory.mem_read64(last);
+        if ((instr >> 58) == CPU::RET)
+            returning.push_back(b);
+        for (qword next : successors_of(last, instr))
+        {
+            if (next >= code_size || block_index[next >> 3] == NO_BLOCK)
+                continue;
+            if ((instr >> 58) == CPU::CALL && next == block.end)
+                return_sites.push_back(block_index[next >> 3]);
+            else
+                block.successors.push_back(block_index[next >> 3]);
+        }
+    }
+    for (std::uint32_t b : returning)
+        blocks[b].successors = return_sites;
+    return true;
+}
+
+static const Analysis::Range TOP = {0, BIN_MAX};
+
+static Analysis::Range exact(qword value)
+{
+    return {value, value};
+}
+
+static Analysis::Range add_range(Analysis::Range r, qword by)
+{
+    if (r.hi > BIN_MAX - by)
+        return TOP;
+    return {r.lo + by, r.hi + by};
+}
+
+static Analysis::Range sub_range(Analysis::Range r, qword by)
+{
+    if (r.lo < by)
+        return TOP;
+    return {r.lo - by, r.hi - by};
+}
+
+static bool same_range(Analysis::Range a, Analysis::Range b)
+{
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+// is [addr, addr + size) always below the limit for every addr in r
+static bool fits(Analysis::Range r, qword size, qword limit)
+{
+    return r.hi < limit && limit - r.hi >= size;
+}
+
+// a constant mapped address as taken by save, store and the memory forms of arithmetic
+static bool mapped_fits(qword addr, qword limit)
+{
+    auto mapped = map_mem(addr);
+    if (mapped.first != 1 && mapped.first != 2 && mapped.first != 4 && mapped.first != 8)
+        return false;
+    return fits(exact(mapped.second), mapped.first, limit);
+}
+
+// a mapped address held in a register, all of its values must map to the same size
+static bool mapped_fits(Analysis::Range r, qword limit)
+{
+    if ((r.lo >> 60) != (r.hi >> 60))
+        return false;
+    std::uint8_t size = r.lo >> 60;
+    if (size != 1 && size != 2 && size != 4 && size != 8)
+        return false;
+    return fits({r.lo & 0xFFFFFFFFFFFFFFF, r.hi & 0xFFFFFFFFFFFFFFF}, size, limit);
+}
+
+static void clobber_all(Analysis::State &state)
+{
+    for (int i = 0; i < 8; i++)
+        state.regs[i] = TOP;
+}
+
+// the effect of mov, movzx and movsx[the extensions don't change the value]
+static void mov_effect(qword instr, Analysis::State &state, qword limit, bool &proven)
+{
+    switch ((instr >> 56) & 3UL)
+    {
+    case 0:
+    case 2:
+        state.regs[ISA::first(instr)] = state.regs[ISA::last(instr)];
+        break;
+    case 1:
+        state.regs[ISA::last(instr)] = exact(ISA::imm(instr));
+        break;
+    case 3:
+        proven = mapped_fits(state.regs[ISA::last(instr)], limit);
+        state.regs[ISA::first(instr)] = TOP;
+        break;
+    }
+}
+
+// apply the instruction at addr to the state and tell if its memory access is always in bounds
+static bool step(qword addr, qword instr, Analysis::State &state, qword limit)
+{
+    qword stack_size = CPU::stack_memory.size();
+    bool proven = false;
+    std::uint8_t op = instr >> 58;
+    std::uint8_t format = (instr >> 56) & 3UL;
+    Analysis::Range &sp = state.regs[CPU::sp];
+    qword operand = 0;
+    if (Analysis::instr_length(instr) == 16 && !CPU::instruction_memory.out_of_bounds(addr + 8, 8))
+        operand = CPU::instruction_memory.mem_read64(addr + 8);
+    switch (op)
+    {
+    case CPU::LOAD:
+        state.regs[instr & 3UL] = exact((instr >> 3) & 0x3FFFFFFFFFFFFFF);
+        break;
+    case CPU::MOV:
+    case CPU::MOVZX:
+    case CPU::MOVSX:
+        mov_effect(instr, state, limit, proven);
+        break;
+    case CPU::MOVZ:
+    case CPU::MOVNZ:
+    case CPU::MOVE:
+    case CPU::MOVNE:
+    case CPU::MOVG:
+    case CPU::MOVGE:
+    case CPU::MOVS:
+    case CPU::MOVSE:
+    {
+        // the move may or may not happen
+        Analysis::State moved = state;
+        mov_effect(instr, moved, limit, proven);
+        for (int i = 0; i < 8; i++)
+            state.regs[i] = {std::min(state.regs[i].lo, moved.regs[i].lo), std::max(state.regs[i].hi, moved.regs[i].hi)};
+        break;
+    }
+    case CPU::LEA:
+        state.regs[CPU::ar] = exact(operand);
+        break;
+    case CPU::INC:
+        state.regs[instr & 3UL] = add_range(state.regs[instr & 3UL], 1);
+        break;
+    case CPU::DEC:
+        state.regs[instr & 3UL] = sub_range(state.regs[instr & 3UL], 1);
+        break;
+    case CPU::ADD:
+    case CPU::SUB:
+    case CPU::MUL:
+    case CPU::DIV:
+        if (format == 3)
+        {
+            proven = mapped_fits(operand, limit);
+            state.regs[instr & 3UL] = TOP;
+        }
+        else if (format != 0 && op == CPU::ADD)
+            state.regs[instr & 3UL] = add_range(state.regs[instr & 3UL], (instr >> 3) & 0x1FFFFFFFFFFFFF);
+        else if (format != 0 && op == CPU::SUB)
+            state.regs[instr & 3UL] = sub_range(state.regs[instr & 3UL], (instr >> 3) & 0x1FFFFFFFFFFFFF);
+        else
+        {
+            state.regs[instr & 3UL] = TOP;
+            state.regs[(instr >> 3) & 3UL] = TOP;
+        }
+        break;
+    case CPU::AND:
+    case CPU::NOT:
+    case CPU::OR:
+    case CPU::XOR:
+    case CPU::LSHIFT:
+    case CPU::RSHIFT:
+    case CPU::NEG:
+        state.regs[instr & 3UL] = TOP;
+        state.regs[(instr >> 3) & 3UL] = TOP;
+        break;
+    case CPU::STORE:
+        // store picks the destination register by the value of another register, it can be any general purpose one
+        proven = mapped_fits(operand, limit);
+        clobber_all(state);
+        break;
+    case CPU::SAVE:
+        proven = mapped_fits(operand, limit);
+        break;
+    case CPU::PUSH:
+        proven = fits(sp, 64, stack_size);
+        sp = add_range(sp, 64);
+        break;
+    case CPU::POP:
+        proven = sp.lo >= 64 && sp.hi <= stack_size;
+        sp = sub_range(sp, 64);
+        clobber_all(state);
+        break;
+    case CPU::PUSH_REG:
+        proven = fits(sp, 8, stack_size);
+        sp = add_range(sp, 8);
+        break;
+    case CPU::POP_REG:
+        proven = sp.lo >= 8 && sp.hi <= stack_size;
+        sp = sub_range(sp, 8);
+        state.regs[instr & 3UL] = TOP;
+        break;
+    case CPU::CALL:
+        proven = fits(sp, 8, stack_size);
+        sp = add_range(sp, 8);
+        break;
+    case CPU::RET:
+        proven = sp.lo >= 8 && sp.hi <= stack_size;
+        sp = sub_range(sp, 8);
+        break;
+    case CPU::SYSCALL:
+        clobber_all(state);
+        break;
+    case CPU::CAS:
+        state.regs[CPU::ar] = TOP;
+        break;
+    case CPU::FETCH_ADD:
+    case CPU::XCHG:
+        state.regs[(instr >> 3) & 3UL] = TOP;
+        break;
+    case CPU::RDCYCLE:
+    case CPU::RDTIME:
+        state.regs[instr & 3UL] = TOP;
+        break;
+    }
+    return proven;
+}
+
+void Analysis::prove_bounds()
+{
+    // a segment comes with its proofs, they're only good if the VM starts where the one that made them did
+    if (segment != nullptr)
+    {
+        segment_proven = CPU::data_memory.safe_size() >= segment->proven_against &&
+                         CPU::stack_memory.size() >= segment->stack_size &&
+                         std::equal(CPU::_registers, CPU::_registers + CPU::regr_count, segment->registers);
+        CPU::instruction_memory = segment_proven ? segment->proven : segment->code;
+        proven_against = segment_proven ? segment->proven_against : 0;
+        return;
+    }
+    // the program's own bits are never trusted, the host may have written words since they were loaded
+    drop_proofs();
+    strip_reserved(0, CPU::instruction_memory.current_size());
+    if (!build_cfg(CPU::_registers[CPU::pc]))
+        return;
+
+    // words read as the operand of a two word instruction can't be rewritten even if they are also executed
+    std::vector<bool> operand_word(block_index.size(), false);
+    for (auto &block : blocks)
+    {
+        for (qword pos = block.start; pos < block.end;)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            if (instr_length(instr) == 16)
+                operand_word[(pos >> 3) + 1] = true;
+            pos += instr_length(instr);
+        }
+    }
+
+    qword limit = CPU::data_memory.safe_size();
+    std::vector<State> entry(blocks.size());
+    std::vector<bool> reached(blocks.size(), false);
+    std::vector<int> changes(blocks.size(), 0);
+
+    // the entry state is exact since this runs right before the execution starts
+    State start;
+    for (qword i = 0; i < CPU::regr_count; i++)
+        start.regs[i] = exact(CPU::_registers[i]);
+    std::uint32_t first = block_index[CPU::_registers[CPU::pc] >> 3];
+    if (first == NO_BLOCK)
+        return;
+    entry[first] = start;
+    reached[first] = true;
+
+    std::vector<std::uint32_t> worklist = {first};
+    while (!worklist.empty())
+    {
+        std::uint32_t current = worklist.back();
+        worklist.pop_back();
+        State state = entry[current];
+        for (qword pos = blocks[current].start; pos < blocks[current].end;)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            step(pos, instr, state, limit);
+            pos += instr_length(instr);
+        }
+        for (std::uint32_t next : blocks[current].successors)
+        {
+            if (!reached[next])
+            {
+                reached[next] = true;
+                entry[next] = state;
+                worklist.push_back(next);
+                continue;
+            }
+            bool changed = false;
+            for (qword i = 0; i < CPU::regr_count; i++)
+            {
+                Range old = entry[next].regs[i];
+                Range joined = {std::min(old.lo, state.regs[i].lo), std::max(old.hi, state.regs[i].hi)};
+                if (same_range(old, joined))
+                    continue;
+                changed = true;
+                entry[next].regs[i] = changes[next] >= WIDEN_AFTER ? TOP : joined;
+            }
+            if (changed)
+            {
+                changes[next]++;
+                worklist.push_back(next);
+            }
+        }
+    }
+
+    // with the fixed point reached, one more walk over every block finds the accesses that are always in bounds
+    for (std::uint32_t b = 0; b < blocks.size(); b++)
+    {
+        if (!reached[b])
+            continue;
+        State state = entry[b];
+        for (qword pos = blocks[b].start; pos < blocks[b].end;)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            if (step(pos, instr, state, limit) && !operand_word[pos >> 3])
+            {
+                CPU::instruction_memory.mem_write64(pos, instr | BOUNDS_PROVEN);
+                proven_sites.push_back(pos);
+            }
+            pos += instr_length(instr);
+        }
+    }
+    proven_against = limit;
+}
+
+void Analysis::revalidate()
+{
+    if ((proven_sites.empty() && !segment_proven) || CPU::data_memory.safe_size() >= proven_against)
+        return;
+    drop_proofs();
+}
+
+void Analysis::drop_proofs()
+{
+    if (segment_proven)
+    {
+        CPU::instruction_memory = segment->code;
+        segment_proven = false;
+        proven_against = 0;
+        return;
+    }
+    // every hart's ret can end up here, there's nothing to write once the proofs are gone
+    if (proven_sites.empty())
+        return;
+    for (qword addr : proven_sites)
+        CPU::instruction_memory.mem_write64(addr, CPU::instruction_memory.mem_read64(addr) & ~BOUNDS_PROVEN);
+    proven_sites.clear();
+    proven_against = 0;
+}
+
+void Analysis::own_code()
+{
+    if (segment == nullptr)
+        return;
+    CPU::instruction_memory = segment->code;
+    CPU::instruction_memory.unshare();
+    segment = nullptr;
+    segment_proven = false;
+    proven_against = 0;
+}
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef ENIGMA_CACHE
+#define ENIGMA_CACHE
+
+#include "EnigmaManager.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstdlib>
+
+/*
+A cache on disk of the programs as they run: an image is loaded, optimised and proven once and the code segment
+that comes out of it[see Manager::share_program] is written to a file named after the hash of the image. The next
+process to load the same image maps that file as the segment and starts right away, the pages of the program are
+only read in as they're executed.
+
+An entry is only used if it was written by the same format and the same instruction set[a fingerprint of the
+table in CPU/EnigmaISA.hpp] for an image of the same length and hash, anything else is a miss and the entry is
+written again. Entries are written to a temporary file and renamed over the old one so a reader only ever sees a
+whole entry, a process that still has the old one mapped keeps it. CACHE_FORMAT goes up whenever what's in a
+segment or how the optimiser and the analysis make it changes.
+
+Both copies in an entry are hashed when it's written and checked when it's opened, so a torn or corrupted entry is
+a miss like any other and opening an entry reads all of it once. The plain copy is what runs whenever the proofs
+don't hold, none of its words may claim a proof, and the proven copy may only differ from it in the proofs. What
+can't be checked without proving the program again is that the proofs are right, for those the entries are
+trusted like the images themselves are and the cache directory should be as private as they are. The translated
+programs of the AOT compiler are separate binaries and aren't cached here.
+*/
+
+#define CACHE_FORMAT 3
+
+// the offsets in an entry are multiples of this so it maps on any host page size
+#define CACHE_ALIGN 65536UL
+
+namespace Cache
+{
+    // where the entries are, $ENIGMA_CACHE_DIR, $XDG_CACHE_HOME/enigma or ~/.cache/enigma when it's empty
+    static std::string directory;
+
+    // load the image on this VM through the cache like Manager::load_image, it then runs from the segment this
+    // returns for other VMs to load too. nullptr if the image can't be read or isn't made of whole words
+    inline std::shared_ptr<const Analysis::CodeSegment> load_image(const std::string &path, bool optimize = true);
+
+    // the last load_image on this thread found its entry
+    static thread_local bool hit = false;
+};
+
+struct CacheHeader
+{
+    char magic[8];
+    qword order; // CACHE_ORDER as the writer saw it, entries don't move between hosts of different byte order
+    qword format;
+    qword isa;
+    qword image_hash[2];
+    qword image_length;
+    qword optimized;
+    qword length;           // what mem_pointer was
+    qword code_offset;      // where the plain copy is in the file
+    qword code_size;        // and its bytes
+    qword proven_offset;    // the proven copy, the same as the plain one if nothing was proven
+    qword proven_against;
+    qword stack_size;       // the proofs were made for
+    qword code_hash[2];     // of the code_size bytes of each copy
+    qword proven_hash[2];
+    qword registers[CPU::regr_count];
+};
+
+#define CACHE_ORDER 0x0102030405060708UL
+
+// FNV-1a over 128 bits
+static void cache_hash(const byte *data, std::size_t size, qword out[2])
+{
+    unsigned __int128 hash = ((unsigned __int128)0x6c62272e07bb0142UL << 64) | 0x62b821756295c58dUL;
+    const unsigned __int128 prime = ((unsigned __int128)1 << 88) | 0x13b;
+    for (std::size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= prime;
+    }
+    out[0] = (qword)(hash >> 64);
+    out[1] = (qword)hash;
+}
+
+// everything in the instruction set table that decides what a program means
+static qword cache_isa()
+{
+    static const qword fingerprint = []() {
+        std::vector<byte> bytes;
+        for (const ISA::Op &op : ISA::ops)
+        {
+            bytes.push_back(op.code);
+            for (const char *c = op.name; c != nullptr && *c != '\0'; c++)
+                bytes.push_back(*c);
+            for (ISA::Shape shape : op.shapes)
+                bytes.push_back(shape);
+            bytes.insert(bytes.end(), {op.two_words, op.wide, op.memory});
+        }
+        qword hash[2];
+        cache_hash(bytes.data(), bytes.size(), hash);
+        return hash[0] ^ hash[1];
+    }();
+    return fingerprint;
+}
+
+static std::string cache_directory()
+{
+    if (!Cache::directory.empty())
+        return Cache::directory;
+    if (const char *dir = std::getenv("ENIGMA_CACHE_DIR"))
+        return dir;
+    if (const char *dir = std::getenv("XDG_CACHE_HOME"))
+        return std::string(dir) + "/enigma";
+    const char *home = std::getenv("HOME");
+    return std::string(home != nullptr ? home : "/tmp") + "/.cache/enigma";
+}
+
+static bool cache_write_all(int fd, const byte *data, qword size)
+{
+    while (size != 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// the bytes of the copies hash to what the writer saw, the plain copy has no proofs and the proven one differs from
+// it only in the proofs[see Analysis::strip_reserved]
+static bool cache_verify(Memory code, Memory proven, const CacheHeader &header)
+{
+    const byte *plain = code.mem_span(0, header.code_size), *checked = proven.mem_span(0, header.code_size);
+    if (plain == nullptr || checked == nullptr)
+        return false;
+    qword hash[2];
+    cache_hash(plain, header.code_size, hash);
+    if (hash[0] != header.code_hash[0] || hash[1] != header.code_hash[1])
+        return false;
+    if (checked != plain)
+    {
+        cache_hash(checked, header.code_size, hash);
+        if (hash[0] != header.proven_hash[0] || hash[1] != header.proven_hash[1])
+            return false;
+    }
+    for (qword pos = 0; pos + 8 <= header.code_size; pos += 8)
+    {
+        qword word = 0, with_proof = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            word = (word << 8) | plain[pos + i];
+            with_proof = (with_proof << 8) | checked[pos + i];
+        }
+        if (!ISA::accesses_memory(word) && with_proof != word)
+            return false;
+        if (ISA::accesses_memory(word) && ((word & BOUNDS_PROVEN) || (with_proof & ~BOUNDS_PROVEN) != word))
+            return false;
+    }
+    return true;
+}
+
+// map the entry if it's a good one for the image
+static std::shared_ptr<Analysis::CodeSegment> cache_open(const std::string &file, const CacheHeader &want)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    CacheHeader header;
+    struct stat info;
+    std::shared_ptr<Analysis::CodeSegment> segment;
+    bool good = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && fstat(fd, &info) == 0 &&
+                std::memcmp(header.magic, want.magic, sizeof(header.magic)) == 0 && header.order == want.order &&
+                header.format == want.format && header.isa == want.isa &&
+                header.image_hash[0] == want.image_hash[0] && header.image_hash[1] == want.image_hash[1] &&
+                header.image_length == want.image_length && header.optimized == want.optimized &&
+                header.length <= header.code_size && header.code_offset >= sizeof(header) &&
+                header.code_size <= (qword)info.st_size &&
+                header.code_offset <= (qword)info.st_size - header.code_size &&
+                header.proven_offset <= (qword)info.st_size - header.code_size;
+    if (good)
+    {
+        segment = std::make_shared<Analysis::CodeSegment>();
+        good = segment->code.map_file(fd, header.code_offset, header.code_size);
+        if (good && header.proven_offset == header.code_offset)
+            segment->proven = segment->code;
+        else if (good)
+            good = segment->proven.map_file(fd, header.proven_offset, header.code_size);
+        good = good && cache_verify(segment->code, segment->proven, header);
+        std::copy(header.registers, header.registers + CPU::regr_count, segment->registers);
+        segment->proven_against = header.proven_against;
+        segment->stack_size = header.stack_size;
+        segment->length = header.length;
+    }
+    close(fd);
+    return good ? segment : nullptr;
+}
+
+// write the entry next to where it goes and move it in place, a failure only costs the next start its hit
+static void cache_store(const std::string &dir, const std::string &file, CacheHeader header, const Analysis::CodeSegment &segment)
+{
+    Memory code = segment.code, proven = segment.proven;
+    bool proofs = proven.mem_span(0, 1) != code.mem_span(0, 1);
+    header.code_size = code.current_size();
+    header.code_offset = CACHE_ALIGN;
+    header.proven_offset = proofs ? round_to_pages(CACHE_ALIGN + header.code_size, CACHE_ALIGN) : CACHE_ALIGN;
+    header.proven_against = segment.proven_against;
+    header.stack_size = segment.stack_size;
+    header.length = segment.length;
+    std::copy(segment.registers, segment.registers + CPU::regr_count, header.registers);
+    cache_hash(code.mem_span(0, header.code_size), header.code_size, header.code_hash);
+    cache_hash(proven.mem_span(0, header.code_size), header.code_size, header.proven_hash);
+
+    // one level of parents is made, the rest is up to the host
+    mkdir(dir.substr(0, dir.find_last_of('/')).c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+    std::string temporary = file + ".tmp" + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    std::vector<byte> padding(CACHE_ALIGN - sizeof(header), 0);
+    bool good = cache_write_all(fd, reinterpret_cast<const byte *>(&header), sizeof(header)) &&
+                cache_write_all(fd, padding.data(), padding.size()) &&
+                cache_write_all(fd, code.mem_span(0, header.code_size), header.code_size);
+    if (good && proofs)
+    {
+        padding.assign(header.proven_offset - CACHE_ALIGN - header.code_size, 0);
+        good = cache_write_all(fd, padding.data(), padding.size()) &&
+               cache_write_all(fd, proven.mem_span(0, header.code_size), header.code_size);
+    }
+    good = fsync(fd) == 0 && good;
+    close(fd);
+    if (!good || rename(temporary.c_str(), file.c_str()) != 0)
+        unlink(temporary.c_str());
+}
+
+std::shared_ptr<const Analysis::CodeSegment> Cache::load_image(const std::string &path, bool optimize)
+{
+    hit = false;
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return nullptr;
+    std::vector<byte> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (bytes.size() % 8 != 0)
+        return nullptr;
+
+    CacheHeader want = {};
+    std::memcpy(want.magic, "ENIGMAC", 8);
+    want.order = CACHE_ORDER;
+    want.format = CACHE_FORMAT;
+    want.isa = cache_isa();
+    cache_hash(bytes.data(), bytes.size(), want.image_hash);
+    want.image_length = bytes.size();
+    want.optimized = optimize;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "/%016lx%016lx%s.seg", want.image_hash[0], want.image_hash[1], optimize ? "o" : "");
+    std::string dir = cache_directory(), file = dir + name;
+    std::shared_ptr<const Analysis::CodeSegment> segment = cache_open(file, want);
+    hit = segment != nullptr;
+    if (segment == nullptr)
+    {
+        // the image goes into a fresh instruction memory so the segment only ever holds the image
+        Analysis::drop_proofs();
+        Analysis::segment = nullptr;
+        Analysis::segment_proven = false;
+        CPU::instruction_memory = Memory();
+        CPU::mem_pointer = 0;
+        std::vector<qword> instructions(bytes.size() / 8);
+        for (std::size_t i = 0; i < bytes.size(); i++)
+            instructions[i / 8] = (instructions[i / 8] << 8) | bytes[i];
+        Manager::load_instructions(instructions);
+        if (optimize)
+            Manager::optimize_program();
+        segment = Manager::share_program();
+        cache_store(dir, file, want, *segment);
+    }
+    Manager::load_program(segment);
+    return segment;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef ENIGMA_CHANNELS
+#define ENIGMA_CHANNELS
+
+#include "../CPU/EnigmaHarts.hpp"
+#include <condition_variable>
+#include <memory>
+#include <thread>
+
+/*
+Message channels between the VMs running in the process[every thread is a VM, see CPU/EnigmaHarts.hpp].
+A channel is a bounded ring of slots that any number of VMs can send to and receive from without taking a lock
+[the multi producer multi consumer ring with a sequence number per slot]. Every slot has room for the biggest
+message up front, so a message is copied straight from the sender's data memory into its slot and from the slot
+into the receiver's data memory, nothing is allocated on the way.
+
+A receive on an empty channel or a send to a full one parks the VM's thread until the other side makes progress
+instead of spinning, the lock only ever gets taken by a side that is about to park and by the side waking it up.
+Closing a channel wakes everyone waiting on it, what was sent before can still be received. Destroying one closes it
+for good: the messages still in it are dropped, its memory is freed once the calls using it right now are done and
+its id can be handed out again by a later create. A channel lives until it's destroyed.
+*/
+
+#ifndef MAX_CHANNELS
+#define MAX_CHANNELS 256
+#endif
+
+namespace Channels
+{
+    struct Slot
+    {
+        std::atomic<qword> sequence;
+        qword length;
+    };
+
+    struct Channel
+    {
+        qword mask;        // the number of slots - 1, there is always a power of two of them
+        qword max_message; // in bytes
+        std::unique_ptr<Slot[]> slots;
+        std::unique_ptr<byte[]> payloads; // max_message bytes for every slot
+
+        // the senders and the receivers each get their own cache line
+        alignas(64) std::atomic<qword> head; // the next one to receive
+        alignas(64) std::atomic<qword> tail; // the next one to send
+
+        std::mutex park_lock;
+        std::condition_variable changed;
+        std::atomic<qword> parked{0};
+        std::atomic<bool> closed{false};
+    };
+
+    static std::atomic<Channel *> channels[MAX_CHANNELS]; // indexed by id - 1
+
+    // the calls using each channel right now, destroy waits for them
+    static std::atomic<qword> channel_users[MAX_CHANNELS];
+
+    // returned by the guest side calls when the channel doesn't exist, is closed or the message doesn't fit
+    static const qword FAILED = BIN_MAX;
+
+    // make a channel with at least capacity slots for messages of up to max_message bytes, returns its id or 0
+    inline qword create(qword capacity, qword max_message);
+
+    inline bool close(qword id);
+
+    // close the channel and free it, false if there's no such channel
+    inline bool destroy(qword id);
+
+    // send length bytes at address in the VM's data memory, waits for a slot if block is set
+    // returns 0 once sent, FAILED or, when not blocking, FAILED - 1 if the channel is full
+    inline qword send(qword id, qword address, qword length, bool block);
+
+    // receive the next message to address, at most room bytes of it are copied
+    // returns its length[more than room if it was cut short], FAILED or, when not blocking, FAILED - 1 if empty
+    inline qword receive(qword id, qword address, qword room, bool block);
+};
+
+// the place of a channel that is being destroyed, nothing new can use it and it can't be taken by create yet
+static Channels::Channel *const channel_destroyed = reinterpret_cast<Channels::Channel *>(1);
+
+// the channel for the length of a call, destroy waits until it's done with it
+struct ChannelUse
+{
+    qword index = MAX_CHANNELS;
+    Channels::Channel *channel = nullptr;
+
+    ChannelUse(qword id)
+    {
+        if (id == 0 || id > MAX_CHANNELS)
+            return;
+        index = id - 1;
+        // counted before looking so destroy either sees the count or this sees that it's going
+        Channels::channel_users[index].fetch_add(1);
+        channel = Channels::channels[index].load();
+        if (channel == channel_destroyed)
+            channel = nullptr;
+    }
+
+    ~ChannelUse()
+    {
+        if (index < MAX_CHANNELS)
+            Channels::channel_users[index].fetch_sub(1);
+    }
+};
+
+// a side that made progress wakes the parked ones, the fence orders its slot update before it looks for them
+static void wake_parked(Channels::Channel *channel)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (channel->parked.load(std::memory_order_relaxed) == 0)
+        return;
+    std::lock_guard<std::mutex> guard(channel->park_lock);
+    channel->changed.notify_all();
+}
+
+// park until ready says there is something to do or the channel is closed
+template <typename Ready>
+static void park(Channels::Channel *channel, Ready ready)
+{
+    std::unique_lock<std::mutex> lock(channel->park_lock);
+    channel->parked.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // checked again with the lock held so a wake up between the failed attempt and here isn't lost
+    channel->changed.wait(lock, [&]() { return ready() || channel->closed.load(); });
+    channel->parked.fetch_sub(1);
+}
+
+static bool slot_free(Channels::Channel *channel)
+{
+    qword pos = channel->tail.load(std::memory_order_relaxed);
+    return channel->slots[pos & channel->mask].sequence.load(std::memory_order_acquire) == pos;
+}
+
+static bool slot_full(Channels::Channel *channel)
+{
+    qword pos = channel->head.load(std::memory_order_relaxed);
+    return channel->slots[pos & channel->mask].sequence.load(std::memory_order_acquire) == pos + 1;
+}
+
+qword Channels::create(qword capacity, qword max_message)
+{
+    if (capacity == 0 || capacity > 65536 || max_message == 0 || max_message > CPU::data_memory.upper_limit())
+        return 0;
+    // with a single slot its sequence number can't tell full from empty
+    qword slots = 2;
+    while (slots < capacity)
+        slots <<= 1;
+    Channel *channel = new Channel();
+    channel->mask = slots - 1;
+    channel->max_message = max_message;
+    channel->slots.reset(new Slot[slots]);
+    channel->payloads.reset(new byte[slots * max_message]);
+    for (qword i = 0; i < slots; i++)
+        channel->slots[i].sequence.store(i, std::memory_order_relaxed);
+    channel->head.store(0, std::memory_order_relaxed);
+    channel->tail.store(0, std::memory_order_relaxed);
+    // the first free id, a failed create doesn't use one up
+    for (qword index = 0; index < MAX_CHANNELS; index++)
+    {
+        Channel *expected = nullptr;
+        if (channels[index].load(std::memory_order_relaxed) == nullptr && channels[index].compare_exchange_strong(expected, channel))
+            return index + 1;
+    }
+    delete channel;
+    return 0;
+}
+
+static void close_channel(Channels::Channel *channel)
+{
+    channel->closed.store(true);
+    std::lock_guard<std::mutex> guard(channel->park_lock);
+    channel->changed.notify_all();
+}
+
+bool Channels::close(qword id)
+{
+    ChannelUse use(id);
+    if (use.channel == nullptr)
+        return false;
+    close_channel(use.channel);
+    return true;
+}
+
+bool Channels::destroy(qword id)
+{
+    if (id == 0 || id > MAX_CHANNELS)
+        return false;
+    Channel *channel = channels[id - 1].load();
+    if (channel == nullptr || channel == channel_destroyed || !channels[id - 1].compare_exchange_strong(channel, channel_destroyed))
+        return false;
+    // the parked ones wake up and fail, the rest are in the middle of a copy
+    close_channel(channel);
+    while (channel_users[id - 1].load() != 0)
+        std::this_thread::yield();
+    delete channel;
+    channels[id - 1].store(nullptr);
+    return true;
+}
+
+qword Channels::send(qword id, qword address, qword length, bool block)
+{
+    ChannelUse use(id);
+    Channel *channel = use.channel;
+    if (channel == nullptr || length > channel->max_message)
+        return FAILED;
+    byte *from = length == 0 ? nullptr : CPU::data_memory.mem_span(address, length);
+    if (length != 0 && from == nullptr)
+        return FAILED; // the fault has been raised
+    while (true)
+    {
+        if (channel->closed.load(std::memory_order_relaxed))
+            return FAILED;
+        qword pos = channel->tail.load(std::memory_order_relaxed);
+        Slot &slot = channel->slots[pos & channel->mask];
+        qword sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == pos)
+        {
+            if (!channel->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                continue;
+            if (length != 0)
+                std::memcpy(channel->payloads.get() + (pos & channel->mask) * channel->max_message, from, length);
+            slot.length = length;
+            slot.sequence.store(pos + 1, std::memory_order_release);
+            wake_parked(channel);
+            return 0;
+        }
+        if ((std::int64_t)(sequence - pos) > 0)
+            continue; // another sender took it, try the next one
+        // full
+        if (!block)
+            return FAILED - 1;
+        park(channel, [&]() { return slot_free(channel); });
+    }
+}
+
+qword Channels::receive(qword id, qword address, qword room, bool block)
+{
+    ChannelUse use(id);
+    Channel *channel = use.channel;
+    if (channel == nullptr)
+        return FAILED;
+    byte *to = room == 0 ? nullptr : CPU::data_memory.mem_span(address, room);
+    if (room != 0 && to == nullptr)
+        return FAILED;
+    while (true)
+    {
+        qword pos = channel->head.load(std::memory_order_relaxed);
+        Slot &slot = channel->slots[pos & channel->mask];
+        qword sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == pos + 1)
+        {
+            if (!channel->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                continue;
+            qword length = slot.length;
+            qword copied = length < room ? length : room;
+            if (copied != 0)
+                std::memcpy(to, channel->payloads.get() + (pos & channel->mask) * channel->max_message, copied);
+            slot.sequence.store(pos + channel->mask + 1, std::memory_order_release);
+            wake_parked(channel);
+            return length;
+        }
+        if ((std::int64_t)(sequence - (pos + 1)) > 0)
+            continue;
+        // empty, a closed channel is done once it has been drained
+        if (channel->closed.load())
+            return FAILED;
+        if (!block)
+            return FAILED - 1;
+        park(channel, [&]() { return slot_full(channel); });
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef ENIGMA_COVERAGE
+#define ENIGMA_COVERAGE
+
+#include "EnigmaAnalysis.hpp"
+#include <ostream>
+
+/*
+Basic block coverage: which parts of the program a run reached and how often. The blocks are the ones the
+load-time analysis finds, the covered loop counts a block once when it is entered and then runs its instructions
+like the plain loop does, so coverage costs a lookup per block and nothing per instruction[the same as metering].
+Where the analysis gave up on the program, the instructions run one at a time and are only counted as untracked.
+
+The counts are written as JSON keyed by the pc range of every block or as an lcov tracefile where every
+instruction is a line, numbered by its address / 8 + 1 so a listing with one instruction per line lines up.
+The harts the program spawns run in the plain loop and aren't counted.
+*/
+
+namespace Coverage
+{
+    // the times each block was entered, indexed like Analysis::blocks
+    static thread_local std::vector<qword> counts;
+
+    // instructions that ran outside every known block
+    static thread_local qword untracked = 0;
+
+    // zero the counts for the blocks the analysis found
+    inline void reset();
+
+    // the covered dispatch loop, runs until the program halts or faults
+    inline CPU::Trap run();
+
+    // {"blocks": [{"start": pc, "end": pc, "entries": n}, ...], "covered": blocks entered, "total": blocks, "untracked": n}
+    inline void write_json(std::ostream &out);
+
+    // an lcov tracefile for the source name, every instruction of a block gets the block's count
+    inline void write_lcov(std::ostream &out, const std::string &source);
+};
+
+void Coverage::reset()
+{
+    counts.assign(Analysis::blocks.size(), 0);
+    untracked = 0;
+}
+
+CPU::Trap Coverage::run()
+{
+    CPU::begin_run();
+    while (CPU::running == true)
+    {
+        qword pc = CPU::_registers[CPU::pc];
+        std::uint32_t index = (pc & 7) == 0 && (pc >> 3) < Analysis::block_index.size() ? Analysis::block_index[pc >> 3] : Analysis::NO_BLOCK;
+        qword count = 1;
+        if (index == Analysis::NO_BLOCK || index >= counts.size())
+            untracked++;
+        else
+        {
+            counts[index]++;
+            count = Analysis::blocks[index].count;
+        }
+        // only the last instruction of a block can transfer control so running count instructions stays in it
+        for (qword i = 0; i < count && CPU::running == true; i++)
+        {
+            CPU::fetch();
+            CPU::decode();
+            CPU::execute();
+            CPU::_registers[CPU::pc] += 8;
+            CPU::retired++;
+        }
+    }
+    return CPU::end_run();
+}
+
+void Coverage::write_json(std::ostream &out)
+{
+    qword covered = 0;
+    out << "{\"blocks\": [";
+    for (std::size_t i = 0; i < Analysis::blocks.size(); i++)
+    {
+        qword entries = i < counts.size() ? counts[i] : 0;
+        covered += entries != 0;
+        out << (i ? ", " : "") << "{\"start\": " << Analysis::blocks[i].start << ", \"end\": " << Analysis::blocks[i].end
+            << ", \"entries\": " << entries << "}";
+    }
+    out << "], \"covered\": " << covered << ", \"total\": " << Analysis::blocks.size() << ", \"untracked\": " << untracked << "}\n";
+}
+
+void Coverage::write_lcov(std::ostream &out, const std::string &source)
+{
+    std::vector<std::size_t> order(Analysis::blocks.size());
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [](std::size_t a, std::size_t b) { return Analysis::blocks[a].start < Analysis::blocks[b].start; });
+
+    qword lines = 0, hit = 0;
+    out << "TN:\nSF:" << source << "\n";
+    for (std::size_t i : order)
+    {
+        const Analysis::Block &block = Analysis::blocks[i];
+        qword entries = i < counts.size() ? counts[i] : 0;
+        for (qword pos = block.start; pos < block.end; pos += Analysis::instr_length(CPU::instruction_memory.mem_read64(pos)))
+        {
+            out << "DA:" << pos / 8 + 1 << "," << entries << "\n";
+            lines++;
+            hit += entries != 0;
+        }
+    }
+    out << "LF:" << lines << "\nLH:" << hit << "\nend_of_record\n";
+}
+
+#endif
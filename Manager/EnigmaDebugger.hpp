@@ -0,0 +1,525 @@
+#ifndef ENIGMA_DEBUGGER
+#define ENIGMA_DEBUGGER
+
+#include "EnigmaManager.hpp"
+#include <map>
+#include <charconv>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/*
+The debugger drives the loaded program on this thread: breakpoints, single steps and a look at the registers and
+both memories, either from the host or from a gdb remote protocol client over a local socket[see serve_gdb].
+
+A breakpoint is the BREAK opcode written over the instruction while the program runs, the dispatch loop has no
+idea it's being debugged and runs at full speed everywhere else. The originals go back in whenever the program
+stops, so while it's stopped the instruction memory reads and can be written just like the program has it, and
+the analysis and the optimizer never see a patched word. A breakpoint goes on the first word of an instruction,
+the instructions are found walking the code from its start.
+
+The harts the program spawns share its instruction memory but know nothing about the breakpoints, so they're only
+in while the program runs on its first hart alone: the first spawn takes them out before the new hart starts and
+they aren't put back in while any of its harts are still running. Breakpoints and single steps only ever stop the
+first hart, the others keep running while it's stopped.
+
+The bounds proofs are made when the program first runs, for the code and the registers it has then. Writing the
+code or a register from the debugger drops them and they're made again for what's there on the next run, the
+written words get the same treatment as a loaded program[see Analysis::strip_reserved]. The code can't be written
+while harts the program spawned are running. A host that changes the registers goes through set_register too.
+*/
+
+namespace Debugger
+{
+    // the gdb stub sees both memories in one address space, the data memory starts here
+    static const qword DATA_SPACE = 1UL << 63;
+
+    // the breakpoint addresses and the words they cover while the program runs
+    static thread_local std::map<qword, qword> breakpoints;
+    static thread_local bool started = false;         // the program has been prepared like start_execution does
+    static thread_local qword stopped_at = ~0UL;      // the breakpoint the program is stopped on
+    static thread_local bool patched = false;         // the breakpoints are in the code right now
+
+    // returns false if there is no instruction at the address[or it is already set/isn't set]
+    inline bool set_breakpoint(qword address);
+    inline bool clear_breakpoint(qword address);
+    inline void clear_breakpoints();
+
+    // run from pc until a breakpoint, a halt or a fault, the breakpoint the program is stopped on doesn't stop it again
+    inline CPU::Trap resume();
+
+    // run the single instruction at pc, the trap is BREAKPOINT unless it halted or faulted
+    inline CPU::Trap step();
+
+    // the instruction at the address as text, empty if there is none
+    inline std::string disassemble(qword address);
+
+    // the bytes at the address, in the data memory from DATA_SPACE up, false if they aren't all there
+    inline bool read_memory(qword address, qword length, std::vector<byte> &out);
+    inline bool write_memory(qword address, const std::vector<byte> &in);
+
+    // change a register of the stopped program, false if there's no such register
+    inline bool set_register(qword reg, qword value);
+
+    // serve one gdb client on 127.0.0.1:port until it detaches or kills the program
+    // returns false if the port can't be listened on, an interrupt from the client isn't seen until the program stops
+    inline bool serve_gdb(std::uint16_t port);
+};
+
+static bool debug_in_code(qword address, qword length)
+{
+    qword size = CPU::instruction_memory.safe_size();
+    return address < size && size - address >= length;
+}
+
+// prepare the program the first time it's run, the proofs stay dropped while harts run[see CPU/EnigmaHarts.hpp]
+static void debug_start()
+{
+    if (Debugger::started)
+        return;
+    CPU::return_stack.clear();
+    if (!Harts::others_running())
+        Analysis::prove_bounds();
+    Debugger::started = true;
+}
+
+// the code or the registers changed under the proofs, they're made again for the new ones on the next run
+static void debug_invalidate()
+{
+    if (!Harts::others_running())
+        Analysis::drop_proofs();
+    Debugger::started = false;
+}
+
+static void debug_unpatch();
+
+// put the breakpoints in, the proof bit stays with the word so drop_proofs can still strip it
+static void debug_patch()
+{
+    if (Debugger::breakpoints.empty() || Harts::others_running())
+        return;
+    Analysis::own_code();
+    Debugger::patched = true;
+    Harts::before_spawn = debug_unpatch;
+    for (auto &site : Debugger::breakpoints)
+    {
+        site.second = CPU::instruction_memory.mem_read64(site.first);
+        CPU::instruction_memory.mem_write64(site.first, ISA::encode(CPU::BREAK, 0, 0, 0) | (site.second & BOUNDS_PROVEN));
+    }
+}
+
+// take them out again, keeping whatever happened to the proof bit while they were in
+static void debug_unpatch()
+{
+    if (!Debugger::patched)
+        return;
+    Debugger::patched = false;
+    Harts::before_spawn = nullptr;
+    for (auto &site : Debugger::breakpoints)
+    {
+        qword patched = CPU::instruction_memory.mem_read64(site.first);
+        CPU::instruction_memory.mem_write64(site.first, (site.second & ~BOUNDS_PROVEN) | (patched & BOUNDS_PROVEN));
+    }
+}
+
+// the end of a run that won't be resumed, the same as start_execution
+static CPU::Trap debug_stop(CPU::Trap trap)
+{
+    if (trap.status == CPU::BREAKPOINT)
+    {
+        Debugger::stopped_at = CPU::_registers[CPU::pc];
+        return trap;
+    }
+    Debugger::stopped_at = ~0UL;
+    Debugger::started = false;
+    Harts::join_all();
+    Replay::flush();
+    return trap;
+}
+
+bool Debugger::set_breakpoint(qword address)
+{
+    if (address % 8 != 0 || !debug_in_code(address, 8))
+        return false;
+    // not the second word of an instruction
+    qword pos = 0;
+    while (pos < address)
+        pos += ISA::length(CPU::instruction_memory.mem_read64(pos));
+    if (pos != address)
+        return false;
+    return breakpoints.emplace(address, 0).second;
+}
+
+bool Debugger::clear_breakpoint(qword address)
+{
+    return breakpoints.erase(address) != 0;
+}
+
+void Debugger::clear_breakpoints()
+{
+    breakpoints.clear();
+}
+
+CPU::Trap Debugger::step()
+{
+    debug_start();
+    CPU::begin_run();
+    CPU::fetch();
+    CPU::decode();
+    CPU::execute();
+    CPU::_registers[CPU::pc] += 8;
+    CPU::retired++;
+    if (CPU::running)
+        CPU::trap = {CPU::BREAKPOINT, NO_FAULT, CPU::_registers[CPU::pc], 0};
+    return debug_stop(CPU::end_run());
+}
+
+CPU::Trap Debugger::resume()
+{
+    debug_start();
+    if (stopped_at == CPU::_registers[CPU::pc] && breakpoints.count(stopped_at) != 0)
+    {
+        // run the instruction under the breakpoint before putting it back
+        CPU::Trap trap = step();
+        if (trap.status != CPU::BREAKPOINT || breakpoints.count(CPU::_registers[CPU::pc]) != 0)
+            return trap;
+    }
+    debug_patch();
+    CPU::Trap trap = CPU::run();
+    debug_unpatch();
+    return debug_stop(trap);
+}
+
+std::string Debugger::disassemble(qword address)
+{
+    if (address % 8 != 0 || !debug_in_code(address, 8))
+        return "";
+    qword word = CPU::instruction_memory.mem_read64(address);
+    qword operand = 0;
+    if (ISA::length(word) == 16 && debug_in_code(address + 8, 8))
+        operand = CPU::instruction_memory.mem_read64(address + 8);
+    return ISA::disassemble(word, operand);
+}
+
+bool Debugger::read_memory(qword address, qword length, std::vector<byte> &out)
+{
+    out.clear();
+    if (address & DATA_SPACE)
+    {
+        Span<const byte> view = Manager::data_view(address & ~DATA_SPACE, length);
+        if (view.size() != length)
+            return false;
+        out.assign(view.begin(), view.end());
+        return true;
+    }
+    if (!debug_in_code(address, length))
+        return false;
+    for (qword i = 0; i < length; i++)
+        out.push_back(CPU::instruction_memory.mem_read8(address + i));
+    return true;
+}
+
+bool Debugger::write_memory(qword address, const std::vector<byte> &in)
+{
+    if (address & DATA_SPACE)
+    {
+        Span<byte> span = Manager::data_span(address & ~DATA_SPACE, in.size());
+        if (span.size() != in.size())
+            return false;
+        std::copy(in.begin(), in.end(), span.begin());
+        return true;
+    }
+    if (!debug_in_code(address, in.size()) || Harts::others_running())
+        return false;
+    debug_invalidate();
+    Analysis::own_code();
+    for (qword i = 0; i < in.size(); i++)
+        CPU::instruction_memory.mem_write8(address + i, in[i]);
+    Analysis::strip_reserved(address, (address + in.size() + 7) & ~7UL);
+    return true;
+}
+
+bool Debugger::set_register(qword reg, qword value)
+{
+    if (reg >= CPU::regr_count)
+        return false;
+    if (CPU::_registers[reg] != value)
+        debug_invalidate();
+    CPU::_registers[reg] = value;
+    return true;
+}
+
+// the gdb remote protocol: every packet is $data#checksum and is acknowledged with +
+
+static const char *gdb_target_xml =
+    "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target><feature name=\"org.enigma.core\">"
+    "<reg name=\"ar\" bitsize=\"64\"/><reg name=\"br\" bitsize=\"64\"/><reg name=\"cr\" bitsize=\"64\"/>"
+    "<reg name=\"dr\" bitsize=\"64\"/><reg name=\"er1\" bitsize=\"64\"/><reg name=\"er2\" bitsize=\"64\"/>"
+    "<reg name=\"er3\" bitsize=\"64\"/><reg name=\"er4\" bitsize=\"64\"/><reg name=\"sp\" bitsize=\"64\"/>"
+    "<reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\"/></feature></target>";
+
+static std::string gdb_hex(const std::vector<byte> &bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (byte b : bytes)
+    {
+        out += digits[b >> 4];
+        out += digits[b & 15];
+    }
+    return out;
+}
+
+// the packets come off a socket, anything that isn't all hex digits is an error for the client and not the host
+static bool gdb_number(const std::string &text, qword &value)
+{
+    const char *end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value, 16);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+static bool gdb_unhex(const std::string &text, std::vector<byte> &out)
+{
+    out.clear();
+    if (text.size() % 2 != 0)
+        return false;
+    for (std::size_t i = 0; i < text.size(); i += 2)
+    {
+        qword value;
+        if (!gdb_number(text.substr(i, 2), value))
+            return false;
+        out.push_back(value);
+    }
+    return true;
+}
+
+// registers go over the wire big endian like the words in the memories
+static std::string gdb_register(qword value)
+{
+    std::vector<byte> bytes(8);
+    for (int i = 7; i >= 0; i--, value >>= 8)
+        bytes[i] = value & GET_BYTE;
+    return gdb_hex(bytes);
+}
+
+static bool gdb_parse_register(const std::string &text, qword &value)
+{
+    std::vector<byte> bytes;
+    if (!gdb_unhex(text, bytes) || bytes.size() > 8)
+        return false;
+    value = 0;
+    for (byte b : bytes)
+        value = (value << 8) | b;
+    return true;
+}
+
+static bool gdb_send(int fd, const std::string &data)
+{
+    byte sum = 0;
+    for (char c : data)
+        sum += c;
+    std::vector<byte> checksum = {sum};
+    std::string packet = "$" + data + "#" + gdb_hex(checksum);
+    return ::send(fd, packet.data(), packet.size(), 0) == (ssize_t)packet.size();
+}
+
+// the next packet, acks and interrupts between packets are skipped
+static bool gdb_receive(int fd, std::string &packet)
+{
+    char c;
+    do
+    {
+        if (::recv(fd, &c, 1, 0) != 1)
+            return false;
+    } while (c != '$');
+    packet.clear();
+    while (true)
+    {
+        if (::recv(fd, &c, 1, 0) != 1)
+            return false;
+        if (c == '#')
+            break;
+        packet += c;
+    }
+    char checksum[2];
+    if (::recv(fd, checksum, 2, MSG_WAITALL) != 2)
+        return false;
+    return ::send(fd, "+", 1, 0) == 1;
+}
+
+static std::string gdb_stop_reply(const CPU::Trap &trap)
+{
+    std::vector<byte> code;
+    switch (trap.status)
+    {
+    case CPU::HALTED:
+        code = {(byte)(CPU::_registers[CPU::ar] & GET_BYTE)};
+        return "W" + gdb_hex(code);
+    case CPU::FAULTED:
+        return trap.fault == DIVIDE_BY_ZERO ? "S08" : "S0b"; // SIGFPE and SIGSEGV
+    default:
+        return "S05"; // SIGTRAP
+    }
+}
+
+// answer one packet, returns false once the client is done with the program, a malformed packet gets E01
+static bool gdb_handle(int fd, const std::string &packet, std::string &last_stop)
+{
+    if (packet.empty())
+        return gdb_send(fd, "");
+    std::string args = packet.substr(1);
+    switch (packet[0])
+    {
+    case '?':
+        return gdb_send(fd, last_stop);
+    case 'g':
+    {
+        std::string out;
+        for (qword i = 0; i < CPU::regr_count; i++)
+            out += gdb_register(CPU::_registers[i]);
+        return gdb_send(fd, out);
+    }
+    case 'G':
+    {
+        // all of them or none
+        std::vector<qword> values;
+        for (qword i = 0, value; i < CPU::regr_count && (i + 1) * 16 <= args.size(); i++)
+        {
+            if (!gdb_parse_register(args.substr(i * 16, 16), value))
+                return gdb_send(fd, "E01");
+            values.push_back(value);
+        }
+        for (qword i = 0; i < values.size(); i++)
+            Debugger::set_register(i, values[i]);
+        return gdb_send(fd, "OK");
+    }
+    case 'p':
+    {
+        qword i;
+        return gdb_send(fd, gdb_number(args, i) && i < CPU::regr_count ? gdb_register(CPU::_registers[i]) : "E01");
+    }
+    case 'P':
+    {
+        std::size_t eq = args.find('=');
+        qword i, value;
+        if (eq == std::string::npos || !gdb_number(args.substr(0, eq), i) || !gdb_parse_register(args.substr(eq + 1), value) ||
+            !Debugger::set_register(i, value))
+            return gdb_send(fd, "E01");
+        return gdb_send(fd, "OK");
+    }
+    case 'm':
+    {
+        std::size_t comma = args.find(',');
+        std::vector<byte> bytes;
+        qword address, length;
+        if (comma == std::string::npos || !gdb_number(args.substr(0, comma), address) ||
+            !gdb_number(args.substr(comma + 1), length) || !Debugger::read_memory(address, length, bytes))
+            return gdb_send(fd, "E01");
+        return gdb_send(fd, gdb_hex(bytes));
+    }
+    case 'M':
+    {
+        std::size_t comma = args.find(','), colon = args.find(':');
+        std::vector<byte> bytes;
+        qword address;
+        if (comma == std::string::npos || colon == std::string::npos || !gdb_number(args.substr(0, comma), address) ||
+            !gdb_unhex(args.substr(colon + 1), bytes) || !Debugger::write_memory(address, bytes))
+            return gdb_send(fd, "E01");
+        return gdb_send(fd, "OK");
+    }
+    case 'c':
+    case 's':
+    {
+        if (!args.empty())
+        {
+            qword address;
+            if (!gdb_number(args, address))
+                return gdb_send(fd, "E01");
+            Debugger::set_register(CPU::pc, address);
+        }
+        CPU::Trap trap = packet[0] == 'c' ? Debugger::resume() : Debugger::step();
+        last_stop = gdb_stop_reply(trap);
+        // once it exited there's no program left to debug, after a fault it can still be looked at
+        return gdb_send(fd, last_stop) && trap.status != CPU::HALTED;
+    }
+    case 'Z':
+    case 'z':
+    {
+        // only software breakpoints, gdb asks for the others by number and an empty reply says there are none
+        if (args.empty() || args[0] != '0')
+            return gdb_send(fd, "");
+        // Z0,addr,kind
+        std::size_t comma = args.find(',', 2);
+        qword address;
+        if (args.size() < 2 || args[1] != ',' || !gdb_number(args.substr(2, comma == std::string::npos ? comma : comma - 2), address))
+            return gdb_send(fd, "E01");
+        bool done = packet[0] == 'Z' ? Debugger::set_breakpoint(address) || Debugger::breakpoints.count(address) != 0
+                                     : (Debugger::clear_breakpoint(address), true);
+        return gdb_send(fd, done ? "OK" : "E01");
+    }
+    case 'H':
+        return gdb_send(fd, "OK");
+    case 'k':
+        return false;
+    case 'D':
+        gdb_send(fd, "OK");
+        return false;
+    case 'q':
+        if (packet.rfind("qSupported", 0) == 0)
+            return gdb_send(fd, "PacketSize=4000;qXfer:features:read+");
+        if (packet == "qAttached")
+            return gdb_send(fd, "1");
+        if (packet == "qC")
+            return gdb_send(fd, "QC1");
+        if (packet == "qfThreadInfo")
+            return gdb_send(fd, "m1");
+        if (packet == "qsThreadInfo")
+            return gdb_send(fd, "l");
+        if (packet.rfind("qXfer:features:read:target.xml:", 0) == 0)
+        {
+            std::string range = packet.substr(std::string("qXfer:features:read:target.xml:").size());
+            std::size_t comma = range.find(',');
+            qword offset, length;
+            if (comma == std::string::npos || !gdb_number(range.substr(0, comma), offset) || !gdb_number(range.substr(comma + 1), length))
+                return gdb_send(fd, "E01");
+            std::string xml = gdb_target_xml;
+            if (offset >= xml.size())
+                return gdb_send(fd, "l");
+            std::string chunk = xml.substr(offset, length);
+            return gdb_send(fd, (offset + chunk.size() < xml.size() ? "m" : "l") + chunk);
+        }
+        return gdb_send(fd, "");
+    default:
+        return gdb_send(fd, "");
+    }
+}
+
+bool Debugger::serve_gdb(std::uint16_t port)
+{
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        return false;
+    int on = 1;
+    ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 1) != 0)
+    {
+        ::close(listener);
+        return false;
+    }
+    int fd = ::accept(listener, nullptr, nullptr);
+    ::close(listener);
+    if (fd < 0)
+        return false;
+    std::string packet, last_stop = "S05";
+    while (gdb_receive(fd, packet) && gdb_handle(fd, packet, last_stop))
+        ;
+    ::close(fd);
+    return true;
+}
+
+#endif
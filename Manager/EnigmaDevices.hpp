@@ -0,0 +1,137 @@
+#ifndef ENIGMA_DEVICES
+#define ENIGMA_DEVICES
+
+#include "../CPU/EnigmaCPU.hpp"
+#include "EnigmaReplay.hpp"
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+/*
+The standard devices a host can map into the data memory of its VM, the guest polls them with plain loads and
+stores instead of a syscall per access. They sit at MMIO_BASE plus the offsets in CPU::MemMappedRegrs, so a load of
+a byte from (1 << 60) | (MMIO_BASE + CPU::KEYD) reads a character. Map them before the program starts, the bus
+isn't locked against harts looking devices up while one is being mapped.
+
+The console input and the timer are nondeterministic so they go through the recorder[see EnigmaReplay.hpp].
+The harts of a VM share its devices, the block device takes a lock around its commands but nothing stops two harts
+from racing on its registers, just like on real hardware.
+*/
+
+namespace Devices
+{
+    enum BlockCommand : qword
+    {
+        BLOCK_READ = 1,  // the sector into the buffer
+        BLOCK_WRITE = 2, // the buffer into the sector
+    };
+
+    static const qword SECTOR_SIZE = 512;
+
+    // each returns false if the device's addresses are already taken
+    inline bool attach_console();
+    inline bool attach_timer();
+
+    // a disk kept in the file at path, which is made if it doesn't exist
+    inline bool attach_block(const std::string &path);
+};
+
+struct BlockDisk
+{
+    std::fstream file;
+    std::mutex lock;
+    qword sector = 0;
+    qword status = 0;
+    byte buffer[Devices::SECTOR_SIZE] = {};
+};
+
+static void block_command(BlockDisk &disk, qword command)
+{
+    std::lock_guard<std::mutex> guard(disk.lock);
+    disk.file.clear();
+    disk.status = 1;
+    if (command == Devices::BLOCK_READ)
+    {
+        // past the end of the file the disk reads as zeroes
+        std::fill(disk.buffer, disk.buffer + Devices::SECTOR_SIZE, 0);
+        disk.file.seekg(disk.sector * Devices::SECTOR_SIZE);
+        disk.file.read(reinterpret_cast<char *>(disk.buffer), Devices::SECTOR_SIZE);
+        disk.status = disk.file.bad() ? 1 : 0;
+    }
+    else if (command == Devices::BLOCK_WRITE)
+    {
+        disk.file.seekp(disk.sector * Devices::SECTOR_SIZE);
+        disk.file.write(reinterpret_cast<const char *>(disk.buffer), Devices::SECTOR_SIZE);
+        disk.file.flush();
+        disk.status = disk.file ? 0 : 1;
+    }
+}
+
+bool Devices::attach_console()
+{
+    Device console;
+    console.base = MMIO_BASE + CPU::KEYS;
+    console.length = 2;
+    console.buffer = nullptr;
+    console.read = [](qword offset, byte) -> qword {
+        if (offset == CPU::KEYS)
+            return Replay::value([]() { return (qword)(std::cin.peek() != EOF); });
+        return Replay::value([]() { return (qword)(std::cin.get() & GET_BYTE); });
+    };
+    console.write = [](qword offset, byte, qword value) {
+        if (offset == CPU::KEYD)
+            std::cout.put(value & GET_BYTE).flush();
+    };
+    return CPU::data_memory.map_device(console);
+}
+
+bool Devices::attach_timer()
+{
+    auto start = std::chrono::steady_clock::now();
+    Device timer;
+    timer.base = MMIO_BASE + CPU::TIME;
+    timer.length = 8;
+    timer.buffer = nullptr;
+    timer.read = [start](qword, byte) -> qword {
+        return Replay::value([start]() {
+            return (qword)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        });
+    };
+    return CPU::data_memory.map_device(timer);
+}
+
+bool Devices::attach_block(const std::string &path)
+{
+    auto disk = std::make_shared<BlockDisk>();
+    disk->file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!disk->file)
+    {
+        // fstream won't make a file when opened for reading as well
+        std::ofstream(path, std::ios::binary);
+        disk->file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        if (!disk->file)
+            return false;
+    }
+    Device control;
+    control.base = MMIO_BASE + CPU::BLOCK_SECTOR;
+    control.length = 16;
+    control.buffer = nullptr;
+    control.read = [disk](qword offset, byte) -> qword {
+        return offset < 8 ? disk->sector : disk->status;
+    };
+    control.write = [disk](qword offset, byte, qword value) {
+        if (offset < 8)
+            disk->sector = value;
+        else
+            block_command(*disk, value);
+    };
+    control.owner = disk;
+    Device sector;
+    sector.base = MMIO_BASE + CPU::BLOCK_BUFFER;
+    sector.length = SECTOR_SIZE;
+    sector.buffer = disk->buffer;
+    sector.owner = disk;
+    return CPU::data_memory.map_device(control) && CPU::data_memory.map_device(sector);
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef ENIGMA_HEAP
+#define ENIGMA_HEAP
+
+#include "../CPU/EnigmaHarts.hpp"
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+
+/*
+The guest heap behind the malloc, free and realloc syscalls. It hands out blocks of the data memory from the
+region past whatever the program had when the heap first grew, and every bit of its bookkeeping lives in the host
+so a guest writing past its block can only ever break its own data, never the heap.
+
+Small requests are rounded up to one of the size classes[4 of them for every power of two from 16 bytes to
+HEAP_MAX_SMALL] and served from slabs of HEAP_SLAB_SIZE bytes that only hold blocks of one class. Every hart keeps
+a cache of free blocks per class and only takes the arena's lock to refill it or to hand back half of it when it
+gets too big, so most mallocs and frees are a push or a pop on a vector. The class of a block is found from its
+slab on free so the guest doesn't have to pass the size back. Bigger requests get a run of whole HEAP_PAGE pages
+of their own, freed runs are merged with their neighbours and reused first fit.
+
+The heap grows the data memory geometrically when it runs out, which can't be done while other harts run[see
+CPU/EnigmaHarts.hpp], malloc returns 0 then. Slabs are never given back. Every slab has a bit for each of its blocks
+that is set while the block is handed out, so freeing a block twice or one that was never handed out faults. The
+bits are kept in maps of HEAP_SLABS_PER_MAP slabs made when the first of their slabs is.
+*/
+
+#ifndef HEAP_SLAB_SIZE
+#define HEAP_SLAB_SIZE 16384
+#endif
+
+#ifndef HEAP_MAX_SMALL
+#define HEAP_MAX_SMALL 4096
+#endif
+
+#define HEAP_PAGE 4096
+
+// the most blocks of a class a hart keeps before it hands half of them back
+#define HEAP_CACHE_LIMIT 64
+
+// the most slabs there can ever be, the data memory can't grow past its reservation[see memory/EnigmaPages.hpp]
+#define HEAP_MAX_SLABS (MEMORY_RESERVE / HEAP_SLAB_SIZE)
+
+#define HEAP_SLABS_PER_MAP 1024
+
+// the words of a slab's bits, enough for the blocks of the smallest class
+#define HEAP_USED_WORDS ((HEAP_SLAB_SIZE / 16 + 63) / 64)
+
+// which blocks of HEAP_SLABS_PER_MAP slabs are handed out
+struct HeapUsed
+{
+    std::atomic<qword> bits[HEAP_SLABS_PER_MAP][HEAP_USED_WORDS];
+};
+
+struct HeapArena
+{
+    std::mutex lock;
+    std::vector<std::vector<qword>> blocks; // the free blocks of every class that no hart has in its cache
+    std::map<qword, qword> spans;           // free runs of the heap region, start -> length
+    std::unordered_map<qword, qword> large; // the runs handed out, start -> length
+    std::unique_ptr<std::atomic<byte>[]> slab_class{new std::atomic<byte>[HEAP_MAX_SLABS]()}; // class + 1 of the slab, 0 if it isn't one
+    std::unique_ptr<std::atomic<HeapUsed *>[]> used{new std::atomic<HeapUsed *>[HEAP_MAX_SLABS / HEAP_SLABS_PER_MAP + 1]()};
+    qword grown = 0;                        // the bytes the heap added to the data memory
+
+    ~HeapArena()
+    {
+        for (qword map = 0; map < HEAP_MAX_SLABS / HEAP_SLABS_PER_MAP + 1; map++)
+            delete used[map].load();
+    }
+};
+
+namespace Heap
+{
+    // a block of at least size bytes, 0 if the heap can't grow that far
+    inline qword allocate(qword size);
+
+    // hand back a block, 0 is ignored, returns false for anything that isn't a block
+    inline bool release(qword address);
+
+    // move the block to one of size bytes keeping what fits, 0 like allocate does[the old block stays then]
+    // address 0 is an allocate, size 0 a release
+    inline qword reallocate(qword address, qword size);
+
+    // the bytes of a block, 0 if it isn't one
+    inline qword block_size(qword address);
+};
+
+// the size classes, 16 32 48 64 80 96 112 128 160 192 224 256 320 ... HEAP_MAX_SMALL
+static const std::vector<qword> &heap_classes()
+{
+    static const std::vector<qword> classes = []() {
+        std::vector<qword> sizes = {16, 32, 48};
+        for (qword base = 64; base < HEAP_MAX_SMALL; base *= 2)
+        {
+            for (qword quarter = 0; quarter < 4; quarter++)
+                sizes.push_back(base + quarter * base / 4);
+        }
+        sizes.push_back(HEAP_MAX_SMALL);
+        return sizes;
+    }();
+    return classes;
+}
+
+static std::size_t heap_class_of(qword size)
+{
+    const std::vector<qword> &classes = heap_classes();
+    return std::lower_bound(classes.begin(), classes.end(), size) - classes.begin();
+}
+
+// the blocks of every class a hart has on hand, handed back when the hart's thread ends
+struct HeapCache
+{
+    std::shared_ptr<HeapArena> arena;
+    std::vector<std::vector<qword>> blocks;
+
+    void flush()
+    {
+        if (arena == nullptr)
+            return;
+        std::lock_guard<std::mutex> guard(arena->lock);
+        for (std::size_t c = 0; c < blocks.size(); c++)
+            arena->blocks[c].insert(arena->blocks[c].end(), blocks[c].begin(), blocks[c].end());
+        blocks.clear();
+    }
+
+    ~HeapCache() { flush(); }
+};
+
+static thread_local HeapCache heap_cache;
+
+static qword round_up(qword value, qword to)
+{
+    return (value + to - 1) / to * to;
+}
+
+static void heap_free_span(HeapArena &arena, qword start, qword length)
+{
+    if (length == 0)
+        return;
+    auto next = arena.spans.lower_bound(start);
+    if (next != arena.spans.end() && start + length == next->first)
+    {
+        length += next->second;
+        next = arena.spans.erase(next);
+    }
+    if (next != arena.spans.begin())
+    {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == start)
+        {
+            previous->second += length;
+            return;
+        }
+    }
+    arena.spans.emplace(start, length);
+}
+
+// a run of length bytes starting at a multiple of align, with the arena locked, 0 if there is no room for it
+static qword heap_take_span(HeapArena &arena, qword length, qword align)
+{
+    for (auto it = arena.spans.begin(); it != arena.spans.end(); ++it)
+    {
+        qword start = round_up(it->first, align);
+        if (start + length > it->first + it->second)
+            continue;
+        qword span_start = it->first, span_end = it->first + it->second;
+        arena.spans.erase(it);
+        heap_free_span(arena, span_start, start - span_start);
+        heap_free_span(arena, start + length, span_end - start - length);
+        return start;
+    }
+
+    // grow by at least as much as the heap already has so growing stays rare
+    if (Harts::others_running())
+        return 0;
+    qword size = CPU::data_memory.current_size();
+    qword start = round_up(size, align);
+    qword limit = CPU::data_memory.upper_limit();
+    if (start + length > limit || start + length < start)
+        return 0;
+    qword grow = std::max(start + length - size, std::min(arena.grown, limit - size));
+    CPU::data_memory.add_size(grow);
+    if (CPU::data_memory.current_size() != size + grow)
+        return 0;
+    arena.grown += grow;
+    heap_free_span(arena, size, start - size);
+    heap_free_span(arena, start + length, size + grow - start - length);
+    return start;
+}
+
+// the word with the block's bit in it, nullptr if no slab of its map was ever made
+static std::atomic<qword> *heap_used_word(HeapArena &arena, qword address, qword size, qword &bit)
+{
+    qword slab = address / HEAP_SLAB_SIZE;
+    HeapUsed *map = arena.used[slab / HEAP_SLABS_PER_MAP].load(std::memory_order_acquire);
+    if (map == nullptr)
+        return nullptr;
+    qword index = (address - slab * HEAP_SLAB_SIZE) / size;
+    bit = 1UL << (index % 64);
+    return &map->bits[slab % HEAP_SLABS_PER_MAP][index / 64];
+}
+
+static HeapArena &heap_arena()
+{
+    if (CPU::heap == nullptr)
+    {
+        CPU::heap = std::make_shared<HeapArena>();
+        CPU::heap->blocks.resize(heap_classes().size());
+    }
+    if (heap_cache.arena != CPU::heap)
+    {
+        heap_cache.flush();
+        heap_cache.arena = CPU::heap;
+        heap_cache.blocks.assign(heap_classes().size(), {});
+    }
+    return *CPU::heap;
+}
+
+// fill the hart's cache of the class from the arena, carving a new slab if the arena has none
+static bool heap_refill(HeapArena &arena, std::size_t c)
+{
+    qword size = heap_classes()[c];
+    std::vector<qword> &cache = heap_cache.blocks[c];
+    std::lock_guard<std::mutex> guard(arena.lock);
+    std::vector<qword> &free = arena.blocks[c];
+    if (free.empty())
+    {
+        qword slab = heap_take_span(arena, HEAP_SLAB_SIZE, HEAP_SLAB_SIZE);
+        if (slab == 0 || slab / HEAP_SLAB_SIZE >= HEAP_MAX_SLABS)
+            return false;
+        arena.slab_class[slab / HEAP_SLAB_SIZE] = (byte)(c + 1);
+        std::atomic<HeapUsed *> &map = arena.used[slab / HEAP_SLAB_SIZE / HEAP_SLABS_PER_MAP];
+        if (map.load(std::memory_order_relaxed) == nullptr)
+            map.store(new HeapUsed(), std::memory_order_release);
+        // in reverse so the blocks are handed out from the start of the slab
+        for (qword block = slab + (HEAP_SLAB_SIZE / size - 1) * size;; block -= size)
+        {
+            free.push_back(block);
+            if (block == slab)
+                break;
+        }
+    }
+    qword take = std::min<qword>(free.size(), std::max<qword>(1, HEAP_CACHE_LIMIT / 2));
+    cache.insert(cache.end(), free.end() - take, free.end());
+    free.resize(free.size() - take);
+    return true;
+}
+
+qword Heap::allocate(qword size)
+{
+    HeapArena &arena = heap_arena();
+    if (size <= HEAP_MAX_SMALL)
+    {
+        std::size_t c = heap_class_of(size == 0 ? 1 : size);
+        std::vector<qword> &cache = heap_cache.blocks[c];
+        if (cache.empty() && !heap_refill(arena, c))
+            return 0;
+        qword block = cache.back();
+        cache.pop_back();
+        qword bit = 0;
+        std::atomic<qword> *used = heap_used_word(arena, block, heap_classes()[c], bit);
+        // every block is carved out of a slab that has its map, one without can't be handed out
+        if (used == nullptr)
+            return 0;
+        used->fetch_or(bit, std::memory_order_relaxed);
+        return block;
+    }
+    if (size > CPU::data_memory.upper_limit())
+        return 0;
+    qword length = round_up(size, HEAP_PAGE);
+    std::lock_guard<std::mutex> guard(arena.lock);
+    qword start = heap_take_span(arena, length, HEAP_PAGE);
+    if (start != 0)
+        arena.large.emplace(start, length);
+    return start;
+}
+
+qword Heap::block_size(qword address)
+{
+    if (CPU::heap == nullptr || address == 0)
+        return 0;
+    HeapArena &arena = heap_arena();
+    qword slab = address / HEAP_SLAB_SIZE;
+    byte c = slab < HEAP_MAX_SLABS ? arena.slab_class[slab].load(std::memory_order_relaxed) : 0;
+    if (c != 0)
+    {
+        qword size = heap_classes()[c - 1], bit;
+        if ((address - slab * HEAP_SLAB_SIZE) % size != 0 || address - slab * HEAP_SLAB_SIZE + size > HEAP_SLAB_SIZE)
+            return 0;
+        std::atomic<qword> *used = heap_used_word(arena, address, size, bit);
+        return used != nullptr && (used->load(std::memory_order_relaxed) & bit) ? size : 0;
+    }
+    std::lock_guard<std::mutex> guard(arena.lock);
+    auto run = arena.large.find(address);
+    return run == arena.large.end() ? 0 : run->second;
+}
+
+bool Heap::release(qword address)
+{
+    if (address == 0)
+        return true;
+    qword size = block_size(address);
+    if (size == 0)
+        return false;
+    HeapArena &arena = heap_arena();
+    if (size <= HEAP_MAX_SMALL)
+    {
+        // two harts freeing the same block at once, only one of them gets to
+        qword bit = 0;
+        std::atomic<qword> *used = heap_used_word(arena, address, size, bit);
+        if (used == nullptr || (used->fetch_and(~bit, std::memory_order_relaxed) & bit) == 0)
+            return false;
+        std::size_t c = heap_class_of(size);
+        std::vector<qword> &cache = heap_cache.blocks[c];
+        cache.push_back(address);
+        if (cache.size() > HEAP_CACHE_LIMIT)
+        {
+            std::lock_guard<std::mutex> guard(arena.lock);
+            arena.blocks[c].insert(arena.blocks[c].end(), cache.begin() + HEAP_CACHE_LIMIT / 2, cache.end());
+            cache.resize(HEAP_CACHE_LIMIT / 2);
+        }
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(arena.lock);
+    if (arena.large.erase(address) == 0)
+        return false;
+    heap_free_span(arena, address, size);
+    return true;
+}
+
+qword Heap::reallocate(qword address, qword size)
+{
+    if (address == 0)
+        return allocate(size);
+    qword old_size = block_size(address);
+    if (old_size == 0)
+        return 0;
+    if (size == 0)
+    {
+        release(address);
+        return 0;
+    }
+    // still the same class or run, nothing to move
+    if (size <= old_size && (old_size > HEAP_MAX_SMALL ? round_up(size, HEAP_PAGE) == old_size : heap_classes()[heap_class_of(size)] == old_size))
+        return address;
+    qword moved = allocate(size);
+    if (moved == 0)
+        return 0;
+    qword keep = std::min(size, old_size);
+    byte *from = CPU::data_memory.mem_span(address, keep);
+    byte *to = CPU::data_memory.mem_span(moved, keep);
+    if (from != nullptr && to != nullptr)
+        std::memmove(to, from, keep);
+    release(address);
+    return moved;
+}
+
+#endif
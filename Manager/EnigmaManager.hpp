@@ -2,6 +2,7 @@
 #define ENIGMA_MANAGER
 
 #include "../memory/EnigmaMemory.hpp"
+#include <fstream>
 /*
 This is like an OS that will maintain the Enigma VM, it's execution, program loading and program execution
 */
@@ -13,6 +14,11 @@ namespace Manager
     // load the instructions into instruction memory
     inline void load_instructions(std::vector<qword> &instructions);
 
+    // an image is the program as it sits in the instruction memory, 8 byte big endian words
+    // load_image returns false if the file can't be read or isn't made of whole words
+    inline bool load_image(const std::string &path);
+    inline bool save_image(const std::string &path);
+
     // load the data(8-bit)
     inline void load_data8(std::vector<qword> &data);
     inline void load_data8(qword data);
@@ -29,167 +35,320 @@ namespace Manager
     inline void load_data64(std::vector<qword> &data);
     inline void load_data64(qword data);
 
+    // bulk loads: the whole run goes in at the data cursor in one go after a single check, the memory grows if it
+    // has to, returns false if it can't grow that far[see Memory::upper_limit]
+    inline bool load_data8(Span<const byte> data);
+    inline bool load_data16(Span<const word> data);
+    inline bool load_data32(Span<const dword> data);
+    inline bool load_data64(Span<const qword> data);
+
+    // the bytes [address, address + length) of the data memory in place, empty if they aren't all there
+    // good until the data memory is next resized[shrinking past them or growing past its reservation moves or
+    // drops them, see memory/EnigmaPages.hpp], the guest's words in them are big endian
+    inline Span<const byte> data_view(qword address, qword length);
+    inline Span<byte> data_span(qword address, qword length);
+
+    // copy the guest's values at address out in one go, returns false if they aren't all there
+    template <typename T>
+    inline bool read_data(qword address, Span<T> out);
+
+    // the syscall in ar, through the table the host can bind its own functions into[see EnigmaNatives.hpp]
     inline void handlesyscalls();
 
-    inline void start_execution();
+    // run the peephole optimizer on the loaded program, returns the number of instructions removed
+    inline qword optimize_program();
 };
 
 #include "EnigmaSyscalls.hpp"
+#include "EnigmaNatives.hpp"
+#include "EnigmaMetering.hpp"
+#include "EnigmaCoverage.hpp"
+#include "EnigmaStream.hpp"
+#include "EnigmaOptimizer.hpp"
+#include "EnigmaDevices.hpp"
+
+// these need the CPU to be defined first
+namespace Manager
+{
+    // run the program until it halts or faults, a fault doesn't take the host down with it
+    // the harts it spawned are waited for before this returns, the trap is the first hart's
+    inline CPU::Trap start_execution();
+
+    // run with gas metering, the program stops with OUT_OF_GAS once the budget is used up
+    inline CPU::Trap start_metered_execution(qword budget);
+
+    // run counting the blocks entered, the counts are in Coverage::counts when it returns[see EnigmaCoverage.hpp]
+    inline CPU::Trap start_covered_execution();
+
+    // load the image from fd[a file or a pipe, closed once it's read] like load_image but while the program
+    // runs, start_streamed_execution starts it as soon as its first instruction is in[see EnigmaStream.hpp]
+    inline void stream_image(int fd);
+    inline CPU::Trap start_streamed_execution();
+
+    // the loaded program as a segment any number of VMs can run without a copy of their own, with the proofs made
+    // for the registers and the data memory as they are now[see EnigmaAnalysis.hpp]. Share it right before it
+    // would start, the VM that shares it keeps its own program
+    inline std::shared_ptr<const Analysis::CodeSegment> share_program();
+
+    // run the segment's program on this VM in place of its own
+    inline void load_program(std::shared_ptr<const Analysis::CodeSegment> segment);
+};
 
 void Manager::load_instructions(std::vector<qword> &instructions)
 {
-    if (instructions.size() > 1024)
-    {
-        // first make sure that all of the instructions can be taken
-        CPU::instruction_memory.pointer_limit_increase(instructions.size() - 1024);
-        CPU::instruction_memory.resize(instructions.size());
-    }
+    Analysis::own_code();
+    // first make sure that all of the instructions can be taken, the sizes are in bytes
+    qword needed = CPU::mem_pointer + instructions.size() * 8;
+    if (needed > CPU::instruction_memory.current_size())
+        CPU::instruction_memory.add_size(needed - CPU::instruction_memory.current_size());
     qword mem_addr = CPU::mem_pointer;
     for (auto x : instructions)
     {
         CPU::instruction_memory.mem_write64(mem_addr, x);
         mem_addr += 8;
     }
+    // the proof bits are the analysis' to set[see EnigmaAnalysis.hpp]
+    Analysis::strip_reserved(CPU::mem_pointer, mem_addr);
     CPU::mem_pointer = mem_addr;
 }
 
+bool Manager::load_image(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (bytes.size() % 8 != 0)
+        return false;
+    std::vector<qword> instructions(bytes.size() / 8);
+    for (std::size_t i = 0; i < bytes.size(); i++)
+        instructions[i / 8] = (instructions[i / 8] << 8) | (byte)bytes[i];
+    load_instructions(instructions);
+    return true;
+}
+
+bool Manager::save_image(const std::string &path)
+{
+    std::ofstream file(path, std::ios::binary);
+    for (qword pos = 0; pos < CPU::mem_pointer; pos++)
+        file.put(CPU::instruction_memory.mem_read8(pos));
+    return (bool)file;
+}
+
+// make room for length more bytes at the data cursor
+static bool reserve_data(qword length)
+{
+    qword end = start_data_mem + length;
+    if (end < start_data_mem || end > CPU::data_memory.upper_limit())
+        return false;
+    if (end > CPU::data_memory.current_size())
+        CPU::data_memory.add_size(end - CPU::data_memory.current_size());
+    return true;
+}
+
+template <typename T>
+static bool load_data_block(Span<const T> data)
+{
+    qword length = data.size() * sizeof(T);
+    if (!reserve_data(length))
+        return false;
+    if (length != 0)
+        copy_to_guest(CPU::data_memory.mem_span(start_data_mem, length), data.data(), data.size());
+    start_data_mem += length;
+    return true;
+}
+
+// the element loaders take every value in a qword, they only keep the low bits of each
+template <typename T>
+static void load_data_narrowed(std::vector<qword> &data)
+{
+    std::vector<T> narrowed(data.begin(), data.end());
+    if (!load_data_block(Span<const T>(narrowed.data(), narrowed.size())))
+        raise_fault(LIMIT_EXCEEDED, start_data_mem + narrowed.size() * sizeof(T));
+}
+
 void Manager::load_data8(std::vector<qword> &data)
 {
-    if (data.size() + 255 > 1024)
-    {
-        CPU::data_memory.pointer_limit_increase(data.size() - 1024 - 255);
-        CPU::data_memory.resize(data.size() - 1024 - 255);
-    }
-    qword mem_addr = start_data_mem;
-    for (auto x : data)
-    {
-        CPU::data_memory.mem_write8(mem_addr, x);
-        mem_addr++;
-    }
-    start_data_mem = mem_addr;
+    load_data_narrowed<byte>(data);
 }
 
 void Manager::load_data16(std::vector<qword> &data)
 {
-    if (data.size() + 255 > 1024)
-    {
-        CPU::data_memory.pointer_limit_increase(data.size() - 1024 - 255);
-        CPU::data_memory.resize(data.size() - 1024 - 255);
-    }
-    qword mem_addr = start_data_mem;
-    for (auto x : data)
-    {
-        CPU::data_memory.mem_write16(mem_addr, x);
-        mem_addr += 2;
-    }
-    start_data_mem = mem_addr;
+    load_data_narrowed<word>(data);
 }
 
 void Manager::load_data32(std::vector<qword> &data)
 {
-    if (data.size() + 255 > 1024)
-    {
-        CPU::data_memory.pointer_limit_increase(data.size() - 1024 - 255);
-        CPU::data_memory.resize(data.size() - 1024 - 255);
-    }
-    qword mem_addr = start_data_mem;
-    for (auto x : data)
-    {
-        CPU::data_memory.mem_write32(mem_addr, x);
-        mem_addr += 4;
-    }
-    start_data_mem = mem_addr;
+    load_data_narrowed<dword>(data);
 }
 
 void Manager::load_data64(std::vector<qword> &data)
 {
-    if (data.size() + 255 > 1024)
-    {
-        CPU::data_memory.pointer_limit_increase(data.size() - 1024 - 255);
-        CPU::data_memory.resize(data.size() - 1024 - 255);
-    }
-    qword mem_addr = start_data_mem;
-    for (auto x : data)
-    {
-        CPU::data_memory.mem_write64(mem_addr, x);
-        mem_addr += 8;
-    }
-    start_data_mem = mem_addr;
+    load_data_narrowed<qword>(data);
+}
+
+bool Manager::load_data8(Span<const byte> data)
+{
+    return load_data_block(data);
+}
+
+bool Manager::load_data16(Span<const word> data)
+{
+    return load_data_block(data);
+}
+
+bool Manager::load_data32(Span<const dword> data)
+{
+    return load_data_block(data);
+}
+
+bool Manager::load_data64(Span<const qword> data)
+{
+    return load_data_block(data);
+}
+
+Span<byte> Manager::data_span(qword address, qword length)
+{
+    if (length == 0 || address >= CPU::data_memory.safe_size() || CPU::data_memory.safe_size() - address < length)
+        return Span<byte>();
+    return Span<byte>(CPU::data_memory.mem_span(address, length), length);
+}
+
+Span<const byte> Manager::data_view(qword address, qword length)
+{
+    return data_span(address, length);
+}
+
+template <typename T>
+bool Manager::read_data(qword address, Span<T> out)
+{
+    Span<const byte> from = data_view(address, out.size() * sizeof(T));
+    if (from.empty() && !out.empty())
+        return false;
+    copy_from_guest(out.data(), from.data(), out.size());
+    return true;
 }
 
 void Manager::handlesyscalls()
 {
-    switch (CPU::_registers[CPU::ar])
-    {
-    case 0:
-        Syscalls::sysMemIncrease();
-        break;
-    case 1:
-        Syscalls::sysUpperLimitIncrease();
-        break;
-    case 2:
-        Syscalls::sysIncrPointerLim();
-        break;
-    case 3:
-    case 4:
-    case 5:
-    case 6:
-    case 7:
-    case 8:
-    case 9:
-    case 10:
-        break;
-    case 11:
-        Syscalls::sysExit();
-        break;
-    case 12:
-        Syscalls::sysReadNum();
-        break;
-    case 13:
-        Syscalls::sysReadChar();
-        break;
-    case 14:
-        Syscalls::sysReadFloat();
-        break;
-    case 15:
-        Syscalls::sysWriteNum();
-        break;
-    case 16:
-        Syscalls::sysWriteChar();
-        break;
-    case 17:
-        Syscalls::sysWriteFloat();
-        break;
-    }
+    Natives::dispatch();
+}
+
+qword Manager::optimize_program()
+{
+    return Optimizer::optimize();
+}
+
+std::shared_ptr<const Analysis::CodeSegment> Manager::share_program()
+{
+    if (Analysis::segment != nullptr)
+        return Analysis::segment;
+    auto segment = std::make_shared<Analysis::CodeSegment>();
+    CPU::return_stack.clear();
+    Analysis::prove_bounds();
+    bool proofs = !Analysis::proven_sites.empty();
+    if (proofs)
+        segment->proven = CPU::instruction_memory.frozen_copy();
+    std::copy(CPU::_registers, CPU::_registers + CPU::regr_count, segment->registers);
+    segment->proven_against = Analysis::proven_against;
+    segment->stack_size = CPU::stack_memory.size();
+    Analysis::drop_proofs();
+    segment->code = CPU::instruction_memory.frozen_copy();
+    // without any proofs both are the same bytes
+    if (!proofs)
+        segment->proven = segment->code;
+    segment->length = CPU::mem_pointer;
+    return segment;
+}
+
+void Manager::load_program(std::shared_ptr<const Analysis::CodeSegment> segment)
+{
+    Analysis::drop_proofs();
+    // the graph of the old program, the segment's is only built for the runs that need it
+    Analysis::blocks.clear();
+    Analysis::blocks.shrink_to_fit();
+    Analysis::block_index.clear();
+    Analysis::block_index.shrink_to_fit();
+    Analysis::segment = segment;
+    Analysis::segment_proven = false;
+    CPU::instruction_memory = segment->code;
+    CPU::mem_pointer = segment->length;
+}
+
+CPU::Trap Manager::start_execution()
+{
+    CPU::return_stack.clear();
+    Analysis::prove_bounds();
+    CPU::Trap trap = CPU::run();
+    Harts::join_all();
+    Replay::flush();
+    return trap;
+}
+
+CPU::Trap Manager::start_metered_execution(qword budget)
+{
+    CPU::return_stack.clear();
+    Analysis::prove_bounds();
+    if (Analysis::segment != nullptr)
+        Analysis::build_cfg(CPU::_registers[CPU::pc]);
+    Metering::price_blocks();
+    Metering::gas = budget;
+    CPU::Trap trap = Metering::run();
+    Replay::flush();
+    return trap;
+}
+
+CPU::Trap Manager::start_covered_execution()
+{
+    CPU::return_stack.clear();
+    Analysis::prove_bounds();
+    if (Analysis::segment != nullptr)
+        Analysis::build_cfg(CPU::_registers[CPU::pc]);
+    Coverage::reset();
+    CPU::Trap trap = Coverage::run();
+    Harts::join_all();
+    Replay::flush();
+    return trap;
+}
+
+void Manager::stream_image(int fd)
+{
+    Stream::open(fd);
 }
 
-void Manager::start_execution()
+CPU::Trap Manager::start_streamed_execution()
 {
-    CPU::run();
+    CPU::return_stack.clear();
+    // the proofs need the whole program, whatever was proven before doesn't hold with the new code
+    Analysis::drop_proofs();
+    CPU::Trap trap = Stream::run();
+    Harts::join_all();
+    Replay::flush();
+    return trap;
 }
 
 void Manager::load_data8(qword data)
 {
-    CPU::data_memory.mem_write8(CPU::mem_pointer, data & 255);
-    CPU::mem_pointer++;
+    CPU::data_memory.mem_write8(start_data_mem, data & 255);
+    start_data_mem++;
 }
 
 void Manager::load_data16(qword data)
 {
-    CPU::data_memory.mem_write16(CPU::mem_pointer, data & 65535);
-    CPU::mem_pointer += 2;
+    CPU::data_memory.mem_write16(start_data_mem, data & 65535);
+    start_data_mem += 2;
 }
 
 void Manager::load_data32(qword data)
 {
-    CPU::data_memory.mem_write32(CPU::mem_pointer, data & 4294967295);
-    CPU::mem_pointer += 4;
+    CPU::data_memory.mem_write32(start_data_mem, data & 4294967295);
+    start_data_mem += 4;
 }
 
 void Manager::load_data64(qword data)
 {
-    CPU::data_memory.mem_write64(CPU::mem_pointer, data);
-    CPU::mem_pointer += 8;
+    CPU::data_memory.mem_write64(start_data_mem, data);
+    start_data_mem += 8;
 }
 
 #endif
\ No newline at end of file
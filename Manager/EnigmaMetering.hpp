@@ -0,0 +1,115 @@
+#ifndef ENIGMA_METERING
+#define ENIGMA_METERING
+
+#include "EnigmaAnalysis.hpp"
+
+/*
+Gas metering for billing the guest by the instructions it executes.
+Every opcode has a cost in the cost table, instructions that access the data memory and syscalls cost extra.
+The costs of a block's instructions are summed at load time and the whole block is charged once when it is entered,
+so the metered loop only pays for metering at block boundaries.
+A block is always charged in full before any of its instructions run, the gas left when the run stops depends on
+nothing but the program and its inputs.
+*/
+
+namespace Metering
+{
+    // the cost of each opcode, the opcodes that are not used yet cost 1 as well
+    static qword cost_table[64] = {
+        0, 1, 1, 3, 8, 1, 1, 1, // NOP ADD SUB MUL DIV INC DEC NEG
+        1, 1, 1, 1, 1, 1, 1, 1, // AND NOT OR XOR LSHIFT RSHIFT MOV MOVZX
+        1, 1, 1, 1, 1, 1, 1, 1, // MOVSX STORE LOAD LEA PUSH POP PUSH_REG POP_REG
+        1, 1, 1, 1, 1, 1, 1, 1, // CMP JMP JZ JNZ JN JNN JE JNE
+        1, 1, 1, 1, 1, 1, 1, 1, // JG JGE JS JSE MOVZ MOVNZ MOVE MOVNE
+        1, 1, 1, 1, 1, 1, 1, 1, // MOVG MOVGE MOVS MOVSE SAVE HALT SYSCALL CALL
+        1, 3, 3, 3, 2, 1, 1, 0, // RET CAS FETCH_ADD XCHG FENCE RDCYCLE RDTIME BREAK
+        1, 1, 1, 1, 1, 1, 1, 1,
+    };
+    static qword memory_form_cost = 2;    // extra for every instruction that accesses the data memory
+    static qword syscall_cost = 20;       // extra for every syscall
+
+    static thread_local qword gas = 0; // what's left of the budget of the VM on this thread
+
+    // the cost of a single instruction
+    inline qword instr_cost(qword instr);
+
+    // sum the cost of every block found by the analysis
+    inline void price_blocks();
+
+    // the metered dispatch loop, runs until the program halts, faults or the gas runs out
+    // the program can't spawn harts while it runs metered[see CPU/EnigmaHarts.hpp]
+    // on OUT_OF_GAS the pc is left at the block that couldn't be paid for so the run can be resumed with more gas
+    inline CPU::Trap run();
+};
+
+qword Metering::instr_cost(qword instr)
+{
+    qword cost = cost_table[instr >> 58];
+    if (Analysis::accesses_memory(instr))
+        cost += memory_form_cost;
+    if ((instr >> 58) == CPU::SYSCALL)
+        cost += syscall_cost;
+    return cost;
+}
+
+void Metering::price_blocks()
+{
+    for (auto &block : Analysis::blocks)
+    {
+        block.cost = 0;
+        for (qword pos = block.start; pos < block.end;)
+        {
+            qword instr = CPU::instruction_memory.mem_read64(pos);
+            block.cost += instr_cost(instr);
+            pos += Analysis::instr_length(instr);
+        }
+    }
+}
+
+CPU::Trap Metering::run()
+{
+    Harts::metered = true;
+    CPU::begin_run();
+    while (CPU::running == true)
+    {
+        qword pc = CPU::_registers[CPU::pc];
+        std::uint32_t index = (pc & 7) == 0 && (pc >> 3) < Analysis::block_index.size() ? Analysis::block_index[pc >> 3] : Analysis::NO_BLOCK;
+        if (index == Analysis::NO_BLOCK)
+        {
+            // not the start of a known block[the analysis gave up on the program], charge the instruction alone
+            CPU::fetch();
+            qword cost = instr_cost(CPU::instr);
+            if (gas < cost)
+            {
+                CPU::trap.status = CPU::OUT_OF_GAS;
+                break;
+            }
+            gas -= cost;
+            CPU::decode();
+            CPU::execute();
+            CPU::_registers[CPU::pc] += 8;
+            CPU::retired++;
+            continue;
+        }
+        const Analysis::Block &block = Analysis::blocks[index];
+        if (gas < block.cost)
+        {
+            CPU::trap.status = CPU::OUT_OF_GAS;
+            break;
+        }
+        gas -= block.cost;
+        // only the last instruction of a block can transfer control so running count instructions stays in it
+        for (qword i = 0; i < block.count && CPU::running == true; i++)
+        {
+            CPU::fetch();
+            CPU::decode();
+            CPU::execute();
+            CPU::_registers[CPU::pc] += 8;
+            CPU::retired++;
+        }
+    }
+    Harts::metered = false;
+    return CPU::end_run();
+}
+
+#endif
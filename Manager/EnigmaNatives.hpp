@@ -0,0 +1,127 @@
+#ifndef ENIGMA_NATIVES
+#define ENIGMA_NATIVES
+
+#include "EnigmaSyscalls.hpp"
+#include "../memory/EnigmaSpan.hpp"
+#include <functional>
+
+/*
+The syscall table. Every syscall number indexes a flat table of host functions, so a syscall costs the guest an
+indirect call and the host that embeds the VM can bind its own functions to the free numbers[or replace the
+built in ones] without touching this file. Bind them before the program starts, the table is shared by every VM
+in the process and isn't locked.
+
+A host function gets a Call with typed access to the registers and views of the guest's data memory. A view is
+checked against the memory once when it is made and is then just a pointer and a length, so a native kernel
+works on the guest's data in place. The guest stores its words big endian[see memory/EnigmaMemory.hpp], the
+views are bytes and a kernel working on wider values converts them itself[copy_from_guest does a whole run].
+A host function can be anything callable, a lambda can carry the host's own state along.
+
+A native only gets to set the general registers. The stack pointer and the pc are the VM's: the analysis proves the
+pushes and pops after a syscall against the sp it had before[see EnigmaAnalysis.hpp] and expects it to come back
+to the next instruction, setting either of them faults.
+*/
+
+#ifndef MAX_SYSCALLS
+#define MAX_SYSCALLS 256
+#endif
+
+namespace Natives
+{
+    // a view of the guest's bytes, the one Span the rest of the VM uses[see memory/EnigmaSpan.hpp]
+    typedef Span<byte> Bytes;
+
+    struct Call
+    {
+        qword number; // what was in ar
+
+        template <typename T = qword>
+        T arg(CPU::Register reg) const { return static_cast<T>(CPU::_registers[reg]); }
+
+        // ar to er4, anything else faults
+        template <typename T>
+        void set(CPU::Register reg, T value)
+        {
+            if (reg > CPU::er4)
+            {
+                raise_fault(BAD_OPERAND, reg);
+                return;
+            }
+            CPU::_registers[reg] = static_cast<qword>(value);
+        }
+
+        // the result goes to ar like it does for the built in syscalls
+        template <typename T>
+        void ret(T value) { set(CPU::ar, value); }
+
+        // the length bytes at the mapped address[see map_mem], empty after raising the fault if they aren't all there
+        // the view is good until the data memory is next resized, growing past its reservation moves it
+        Bytes bytes(qword address, qword length);
+    };
+
+    typedef std::function<void(Call &call)> Native;
+
+    // bind fn to the syscall number, nullptr unbinds it, returns false if the number is past the table
+    inline bool bind(qword number, Native fn);
+
+    // run the syscall in ar, the numbers nothing is bound to do nothing
+    inline void dispatch();
+};
+
+// the built in syscalls don't need the call
+template <void (*F)()>
+static void builtin(Natives::Call &)
+{
+    F();
+}
+
+static Natives::Native syscall_table[MAX_SYSCALLS] = {
+    builtin<Syscalls::sysMemIncrease>,         // 0
+    builtin<Syscalls::sysUpperLimitIncrease>,  // 1
+    builtin<Syscalls::sysIncrPointerLim>,      // 2
+    builtin<Syscalls::sysMalloc>,              // 3
+    builtin<Syscalls::sysFree>,                // 4
+    builtin<Syscalls::sysRealloc>,             // 5
+    nullptr, nullptr, nullptr, nullptr, nullptr,
+    builtin<Syscalls::sysExit>,                // 11
+    builtin<Syscalls::sysReadNum>,             // 12
+    builtin<Syscalls::sysReadChar>,            // 13
+    builtin<Syscalls::sysReadFloat>,           // 14
+    builtin<Syscalls::sysWriteNum>,            // 15
+    builtin<Syscalls::sysWriteChar>,           // 16
+    builtin<Syscalls::sysWriteFloat>,          // 17
+    builtin<Syscalls::sysSpawn>,               // 18
+    builtin<Syscalls::sysJoin>,                // 19
+    builtin<Syscalls::sysChannelCreate>,       // 20
+    builtin<Syscalls::sysChannelSend>,         // 21
+    builtin<Syscalls::sysChannelReceive>,      // 22
+    builtin<Syscalls::sysChannelTryReceive>,   // 23
+    builtin<Syscalls::sysChannelClose>,        // 24
+};
+
+Natives::Bytes Natives::Call::bytes(qword address, qword length)
+{
+    if (length == 0)
+        return Bytes();
+    byte *data = CPU::data_memory.mem_span(map_mem(address).second, length);
+    return data == nullptr ? Bytes() : Bytes(data, length);
+}
+
+bool Natives::bind(qword number, Native fn)
+{
+    if (number >= MAX_SYSCALLS)
+        return false;
+    syscall_table[number] = std::move(fn);
+    return true;
+}
+
+void Natives::dispatch()
+{
+    qword number = CPU::_registers[CPU::ar];
+    if (number >= MAX_SYSCALLS || syscall_table[number] == nullptr)
+        return;
+    Call call{number};
+    syscall_table[number](call);
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef ENIGMA_NUMA
+#define ENIGMA_NUMA
+
+#include "EnigmaManager.hpp"
+#include <sched.h>
+#include <fstream>
+
+/*
+NUMA placement of the VMs running in the process[every thread is a VM, see CPU/EnigmaHarts.hpp]. Placing a VM on a
+node pins its thread to the node's cpus, makes the node the preferred one for everything the thread allocates from
+then on and binds its memories to it, moving the pages they already have. The harts it spawns afterwards inherit
+all of that from its thread so a VM and its harts stay on one node. The host places every VM thread it starts,
+either on a node of its own choosing or on the one with the fewest VMs placed on it right now, which spreads the
+VMs evenly and keeps them where they are[nothing moves a VM once it is placed].
+
+With ENIGMA_LIBNUMA defined[and -lnuma] the topology and the pinning come from libnuma, otherwise from sysfs and
+the raw syscalls. On a host without NUMA there is a single node 0 and placing only pins the thread.
+*/
+
+#ifndef MAX_NUMA_NODES
+#define MAX_NUMA_NODES 64
+#endif
+
+#ifdef ENIGMA_LIBNUMA
+#include <numa.h>
+#endif
+
+namespace Numa
+{
+    // the nodes of the host, numbered from 0
+    inline int nodes();
+
+    // the node the VM on this thread is placed on, -1 if it isn't placed
+    inline int node();
+
+    // place the VM on this thread on the node, false if there's no such node or the thread can't be pinned to it
+    inline bool place(int node);
+
+    // place the VM on this thread on the node with the fewest VMs, returns the node or -1
+    inline int place();
+
+    // the VMs placed on every node right now, a VM is counted until its thread ends
+    inline std::vector<qword> instances();
+};
+
+static std::atomic<qword> numa_instances[MAX_NUMA_NODES];
+
+// where the VM on this thread is placed, taken off the count when the thread ends
+struct NumaPlacement
+{
+    int node = -1;
+
+    void move(int to)
+    {
+        if (node >= 0)
+            numa_instances[node]--;
+        node = to;
+        numa_instances[node]++;
+    }
+
+    ~NumaPlacement()
+    {
+        if (node >= 0)
+            numa_instances[node]--;
+    }
+};
+
+static thread_local NumaPlacement numa_placement;
+
+// the cpus of a node, "0-3,8,10-11" in sysfs
+static std::vector<int> numa_cpus(int node)
+{
+    std::vector<int> cpus;
+    std::ifstream list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string range;
+    while (std::getline(list, range, ','))
+    {
+        int first = 0, last = 0;
+        std::size_t dash = range.find('-');
+        try
+        {
+            first = std::stoi(range);
+            last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        }
+        catch (const std::exception &)
+        {
+            continue;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+int Numa::nodes()
+{
+#ifdef ENIGMA_LIBNUMA
+    if (numa_available() < 0)
+        return 1;
+    return std::min(numa_max_node() + 1, MAX_NUMA_NODES);
+#else
+    static const int count = []() {
+        int last = 0;
+        for (int node = 1; node < MAX_NUMA_NODES; node++)
+        {
+            if (std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+                last = node;
+        }
+        return last + 1;
+    }();
+    return count;
+#endif
+}
+
+int Numa::node()
+{
+    return numa_placement.node;
+}
+
+bool Numa::place(int node)
+{
+    if (node < 0 || node >= nodes())
+        return false;
+#ifdef ENIGMA_LIBNUMA
+    if (numa_available() >= 0)
+    {
+        if (numa_run_on_node(node) != 0)
+            return false;
+        numa_set_preferred(node);
+    }
+#else
+    std::vector<int> cpus = numa_cpus(node);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    // a node without cpus of its own[or no sysfs to tell] leaves the thread where it is
+    if (!cpus.empty() && sched_setaffinity(0, sizeof(set), &set) != 0)
+        return false;
+#ifdef SYS_set_mempolicy
+    // MPOL_PREFERRED
+    unsigned long mask = 1UL << node;
+    syscall(SYS_set_mempolicy, 1, &mask, 65);
+#endif
+#endif
+    // the memories may have been made on another node before the VM was placed
+    CPU::instruction_memory.prefer_node(node);
+    CPU::data_memory.prefer_node(node);
+    numa_placement.move(node);
+    return true;
+}
+
+int Numa::place()
+{
+    int count = nodes();
+    // leaving this node takes it off the count, it shouldn't count against staying
+    int best = -1;
+    qword fewest = ~0UL;
+    for (int node = 0; node < count; node++)
+    {
+        qword placed = numa_instances[node].load() - (node == numa_placement.node);
+        if (placed < fewest)
+        {
+            best = node;
+            fewest = placed;
+        }
+    }
+    return best >= 0 && place(best) ? best : -1;
+}
+
+std::vector<qword> Numa::instances()
+{
+    std::vector<qword> counts(nodes());
+    for (std::size_t node = 0; node < counts.size(); node++)
+        counts[node] = numa_instances[node].load();
+    return counts;
+}
+
+#endif
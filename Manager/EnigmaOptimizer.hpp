@@ -0,0 +1,354 @@
+#ifndef ENIGMA_OPTIMIZER
+#define ENIGMA_OPTIMIZER
+
+#include "EnigmaAnalysis.hpp"
+
+/*
+A peephole optimizer that runs on the loaded program before it is executed.
+It removes the instructions that have no effect[nop, mov r r, add 0, mul 1 and the like], folds constants loaded
+into a register with the arithmetic that follows, turns multiplications and divisions by a power of two into shifts
+and turns lea followed by mov reg ar into a single mov when ar is overwritten right after.
+The remaining instructions are then packed together and every jump and call target is relocated.
+
+Two instructions are only ever merged when nothing can jump to the second one, so what the program computes
+doesn't change. Programs that can't be decoded in a single pass[jumping into the middle of an instruction or
+outside of the loaded code] are left alone. So is a program that may make up code addresses by itself instead of
+getting them from jumps and call, those can't be relocated: one with code the control flow graph doesn't reach
+from the entry[a hart's entry or a return address pushed by hand lead there], one that pushes by hand and returns
+and one with a syscall that can be a spawn[unless ar gets a constant other than 18 before it in its block].
+*/
+
+namespace Optimizer
+{
+    struct Insn
+    {
+        qword word;
+        qword operand; // the second word of a two word instruction
+        qword length;  // 8 or 16
+        bool leader;   // control can get here other than by falling through so nothing is merged into it
+        bool removed;
+    };
+
+    static thread_local qword removed = 0; // instructions removed by the last run
+
+    // optimize the program in the instruction memory and return the number of instructions removed
+    inline qword optimize();
+};
+
+// jumps and call take the address of an instruction in their second word
+static bool has_target(qword word)
+{
+    return ISA::shape(word) == ISA::TARGET;
+}
+
+static bool is_mov(std::uint8_t op)
+{
+    return op == CPU::MOV || op == CPU::MOVZX || op == CPU::MOVSX || (op >= CPU::MOVZ && op <= CPU::MOVSE);
+}
+
+// instructions that never change anything
+static bool no_effect(qword word)
+{
+    std::uint8_t op = ISA::opcode(word);
+    std::uint8_t format = ISA::format(word);
+    qword imm = ISA::imm(word);
+    if (op == CPU::NOP)
+        return true;
+    if (is_mov(op) && (format == 0 || format == 2))
+        return ISA::first(word) == ISA::last(word);
+    if ((op == CPU::ADD || op == CPU::SUB) && (format == 1 || format == 2))
+        return imm == 0;
+    if ((op == CPU::MUL || op == CPU::DIV) && (format == 1 || format == 2))
+        return imm == 1;
+    if ((op == CPU::LSHIFT || op == CPU::RSHIFT) && (format & 1) == 1)
+        return imm == 0;
+    return false;
+}
+
+// does the instruction put a constant in a register, only ar to dr since that's all the arithmetic can reach
+static bool is_const_load(qword word, qword &reg, qword &value)
+{
+    std::uint8_t op = ISA::opcode(word);
+    if (op == CPU::LOAD)
+    {
+        reg = ISA::last(word);
+        value = ISA::load_imm(word);
+        return true;
+    }
+    if (op == CPU::MOV && ISA::format(word) == 1 && ISA::last(word) < 4)
+    {
+        reg = ISA::last(word);
+        value = ISA::imm(word);
+        return true;
+    }
+    return false;
+}
+
+// the instruction that puts exactly value in reg, if there is one
+static bool encode_const(qword reg, qword value, qword &word)
+{
+    if (value <= 0x1FFFFFFFFFFFFF)
+    {
+        word = ISA::encode(CPU::MOV, 1, value, reg);
+        return true;
+    }
+    // load always gets the low bits of its own opcode in bits 55 to 57 of its value
+    if (reg < 4 && (value >> 55) == 2)
+    {
+        word = ((qword)CPU::LOAD << 58) | ((value & 0x7FFFFFFFFFFFFF) << 3) | reg;
+        return true;
+    }
+    return false;
+}
+
+// apply the arithmetic instruction to a known value of reg
+static bool fold(qword word, qword reg, qword value, qword &result)
+{
+    std::uint8_t op = word >> 58;
+    std::uint8_t format = (word >> 56) & 3UL;
+    qword imm = (word >> 3) & 0x1FFFFFFFFFFFFF;
+    if ((word & 3UL) != reg)
+        return false;
+    switch (op)
+    {
+    case CPU::INC:
+        result = value + 1;
+        return true;
+    case CPU::DEC:
+        result = value - 1;
+        return true;
+    case CPU::ADD:
+    case CPU::SUB:
+    case CPU::MUL:
+        if (format != 1 && format != 2)
+            return false;
+        result = op == CPU::ADD ? value + imm : op == CPU::SUB ? value - imm : value * imm;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// mul and div by 2^k become shifts by k
+static bool strength_reduce(qword &word)
+{
+    std::uint8_t op = word >> 58;
+    std::uint8_t format = (word >> 56) & 3UL;
+    qword imm = (word >> 3) & 0x1FFFFFFFFFFFFF;
+    if ((op != CPU::MUL && op != CPU::DIV) || (format != 1 && format != 2) || imm < 2 || (imm & (imm - 1)) != 0)
+        return false;
+    qword shift = 0;
+    while ((imm >> shift) != 1)
+        shift++;
+    word = ((qword)(op == CPU::MUL ? CPU::LSHIFT : CPU::RSHIFT) << 58) | (1UL << 56) | (shift << 3) | (word & 3UL);
+    return true;
+}
+
+// could the instruction change ar, anything it isn't known not to
+static bool writes_ar(qword word)
+{
+    switch (ISA::shape(word))
+    {
+    case ISA::NONE:
+    case ISA::MEM: // lea
+        return ISA::opcode(word) != CPU::NOP && ISA::opcode(word) != CPU::PUSH && ISA::opcode(word) != CPU::FENCE;
+    case ISA::REG:
+    case ISA::REG_IMM:
+    case ISA::REG_LOAD:
+    case ISA::REG_MEM:
+        return ISA::last(word) == CPU::ar;
+    case ISA::REG_REG:
+    case ISA::REG_DEREF:
+    case ISA::ATOMIC:
+        return ISA::first(word) == CPU::ar || ISA::last(word) == CPU::ar;
+    default:
+        return false;
+    }
+}
+
+// a syscall the optimizer can't rule out being a spawn[18], whose entry point comes in a register
+static bool may_spawn(const std::vector<Optimizer::Insn> &code, std::size_t i)
+{
+    for (std::size_t j = i; !code[j].leader && j > 0;)
+    {
+        qword word = code[--j].word, reg, value;
+        if (is_const_load(word, reg, value) && reg == CPU::ar)
+            return value == 18;
+        if (writes_ar(word))
+            return true;
+    }
+    return true;
+}
+
+// removing an instruction that can be jumped to makes the next one the target
+static void remove_insn(std::vector<Optimizer::Insn> &code, std::size_t i)
+{
+    code[i].removed = true;
+    if (!code[i].leader)
+        return;
+    for (std::size_t j = i + 1; j < code.size(); j++)
+    {
+        if (!code[j].removed)
+        {
+            code[j].leader = true;
+            return;
+        }
+    }
+}
+
+static std::size_t next_insn(std::vector<Optimizer::Insn> &code, std::size_t i)
+{
+    for (i++; i < code.size(); i++)
+    {
+        if (!code[i].removed)
+            return i;
+    }
+    return code.size();
+}
+
+qword Optimizer::optimize()
+{
+    removed = 0;
+    // the proofs point into the code that's about to move
+    Analysis::drop_proofs();
+    Analysis::own_code();
+    qword code_end = CPU::mem_pointer;
+    qword entry = CPU::_registers[CPU::pc];
+
+    // decode the whole program in a single pass
+    std::vector<Insn> code;
+    std::vector<std::size_t> at((code_end >> 3) + 1, SIZE_MAX); // the instruction starting at an address
+    for (qword pos = 0; pos < code_end;)
+    {
+        qword word = CPU::instruction_memory.mem_read64(pos);
+        qword length = Analysis::instr_length(word);
+        if (pos + length > code_end)
+            return 0;
+        at[pos >> 3] = code.size();
+        code.push_back({word, length == 16 ? CPU::instruction_memory.mem_read64(pos + 8) : 0, length, true, false});
+        pos += length;
+    }
+    at[code_end >> 3] = code.size();
+
+    // the blocks of the reachable code must start on the same instructions, anything unreachable stays a leader
+    if ((entry & 7) != 0 || entry >= code_end || at[entry >> 3] == SIZE_MAX || !Analysis::build_cfg(entry))
+        return 0;
+    std::vector<bool> reached(code.size(), false);
+    for (auto &block : Analysis::blocks)
+    {
+        if (block.end > code_end || at[block.start >> 3] == SIZE_MAX || at[block.end >> 3] == SIZE_MAX)
+            return 0;
+        reached[at[block.start >> 3]] = true;
+        for (std::size_t i = at[block.start >> 3] + 1; i < code.size() && i < at[block.end >> 3]; i++)
+        {
+            code[i].leader = false;
+            reached[i] = true;
+        }
+    }
+    // code the graph doesn't see into stays where it is and so does everything else, it may be jumped to
+    bool pushes = false, returns = false;
+    for (std::size_t i = 0; i < code.size(); i++)
+    {
+        std::uint8_t op = ISA::opcode(code[i].word);
+        if (!reached[i] || (op == CPU::SYSCALL && may_spawn(code, i)))
+            return 0;
+        pushes = pushes || op == CPU::PUSH || op == CPU::PUSH_REG;
+        returns = returns || op == CPU::RET;
+    }
+    // a return address pushed by hand is a code address that isn't relocated
+    if (pushes && returns)
+        return 0;
+    for (auto &insn : code)
+    {
+        if (!has_target(insn.word))
+            continue;
+        qword target = insn.operand + 8;
+        if ((target & 7) != 0 || target >= code_end || at[target >> 3] == SIZE_MAX)
+            return 0;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (std::size_t i = 0; i < code.size(); i++)
+        {
+            if (code[i].removed)
+                continue;
+            if (no_effect(code[i].word))
+            {
+                remove_insn(code, i);
+                changed = true;
+                continue;
+            }
+            std::size_t j = next_insn(code, i);
+            if (j == code.size() || code[j].leader)
+                continue;
+            qword reg, value, result, word;
+            if (is_const_load(code[i].word, reg, value) && fold(code[j].word, reg, value, result) && encode_const(reg, result, word))
+            {
+                // the constant and the arithmetic on it become a single constant
+                code[i].word = word;
+                remove_insn(code, j);
+                changed = true;
+                continue;
+            }
+            std::size_t k = next_insn(code, j);
+            if ((code[i].word >> 58) == CPU::LEA && k != code.size() && !code[k].leader)
+            {
+                // lea then mov reg ar where ar gets a constant right after only needs the address in reg
+                qword mov = code[j].word;
+                qword dst = ISA::first(mov);
+                if (ISA::opcode(mov) == CPU::MOV && (ISA::format(mov) == 0 || ISA::format(mov) == 2) && ISA::last(mov) == CPU::ar &&
+                    dst != CPU::ar && is_const_load(code[k].word, reg, value) && reg == CPU::ar && code[i].operand <= 0x1FFFFFFFFFFFFF)
+                {
+                    code[j].word = ISA::encode(CPU::MOV, 1, code[i].operand, dst);
+                    remove_insn(code, i);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // only once nothing more folds into a constant since a shift doesn't fold
+    for (auto &insn : code)
+    {
+        if (!insn.removed)
+            strength_reduce(insn.word);
+    }
+
+    // pack what is left and relocate the targets
+    std::vector<qword> moved_to(code.size() + 1);
+    qword pos = 0;
+    for (std::size_t i = 0; i < code.size(); i++)
+    {
+        moved_to[i] = pos;
+        if (!code[i].removed)
+            pos += code[i].length;
+        else
+            removed++;
+    }
+    moved_to[code.size()] = pos;
+    // a removed instruction moves to wherever the next one that's kept went, which is what the loop above gives
+    for (std::size_t i = 0; i < code.size(); i++)
+    {
+        if (code[i].removed)
+            continue;
+        qword at_pos = moved_to[i];
+        CPU::instruction_memory.mem_write64(at_pos, code[i].word);
+        if (code[i].length == 16)
+        {
+            qword operand = code[i].operand;
+            if (has_target(code[i].word))
+                operand = moved_to[at[(operand + 8) >> 3]] - 8;
+            CPU::instruction_memory.mem_write64(at_pos + 8, operand);
+        }
+    }
+    for (qword clear = pos; clear < code_end; clear += 8)
+        CPU::instruction_memory.mem_write64(clear, 0);
+    CPU::mem_pointer = pos;
+    CPU::_registers[CPU::pc] = moved_to[at[entry >> 3]];
+    return removed;
+}
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef ENIGMA_REPLAY
+#define ENIGMA_REPLAY
+
+#include "../memory/EnigmaMemory.hpp"
+#include <fstream>
+#include <string>
+
+/*
+Record and replay of everything nondeterministic a guest consumes. The syscalls never read the terminal
+themselves, they ask this module for their input: while recording it comes from std::cin and is appended to a
+log, while replaying it comes from the log and std::cin isn't touched at all.
+
+The log is a 4 byte magic followed by one record per input: a tag byte and the value, numbers as base 128 varints
+[small numbers and short lines take a byte or two] and text as a varint length and the bytes. Records are
+collected in memory and written out in large chunks so leaving the recorder on costs a few stores per input.
+A replay reads the whole log up front. Running out of log or finding a different kind of input than the one
+recorded means the program took another path than when it was recorded, that's a fault.
+
+The recorder belongs to the VM on the thread that started it. The harts it spawns can't read input while it records
+or replays, the order they'd interleave in couldn't be replayed and a replay must not wait on the terminal, so their
+reads fault instead[the clock and the other values stay live on them].
+*/
+
+namespace Replay
+{
+    enum Mode : byte
+    {
+        LIVE,      // straight from std::cin
+        RECORDING, // from std::cin and into the log
+        REPLAYING, // from the log
+    };
+
+    enum Tag : byte
+    {
+        NUMBER = 1, // sysReadNum
+        CHARS,      // sysReadChar, every character of one call
+        TOKEN,      // sysReadFloat
+        VALUE,      // any other nondeterministic value[a clock for example]
+    };
+
+    // flushed once this much has been recorded
+    static const std::size_t CHUNK = 65536;
+
+    static thread_local Mode mode = LIVE;
+    static thread_local std::ofstream *log_out = nullptr;
+    static thread_local std::vector<byte> *log = nullptr; // what's waiting to be written or left to replay
+    static thread_local std::size_t replay_at = 0;
+
+    // the mode of the first hart of the VM when the hart on this thread was spawned[see CPU/EnigmaHarts.hpp]
+    static thread_local Mode spawned_by = LIVE;
+
+    // both return false if the log can't be opened
+    inline bool start_recording(const std::string &path);
+    inline bool start_replay(const std::string &path);
+
+    // write out what has been recorded so far, the runs do it when they stop so a crashing host loses at most one run
+    inline void flush();
+
+    // flush what's left and go back to reading live
+    inline void stop();
+
+    // the inputs of the syscalls
+    inline qword read_number();
+    inline void read_chars(char *out, qword count);
+    inline std::string read_token();
+
+    // a nondeterministic value that is live() unless replaying
+    template <typename Live>
+    inline qword value(Live live);
+};
+
+static const char replay_magic[4] = {'E', 'N', 'R', '1'};
+
+static void replay_put_varint(qword value)
+{
+    while (value >= 0x80)
+    {
+        Replay::log->push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    Replay::log->push_back(value);
+}
+
+static void replay_flush()
+{
+    Replay::log_out->write(reinterpret_cast<const char *>(Replay::log->data()), Replay::log->size());
+    Replay::log->clear();
+}
+
+static void replay_record(Replay::Tag tag)
+{
+    if (Replay::log->size() >= Replay::CHUNK)
+        replay_flush();
+    Replay::log->push_back(tag);
+}
+
+// the next record, faults if it isn't the kind of input asked for
+static bool replay_expect(Replay::Tag tag)
+{
+    if (Replay::replay_at >= Replay::log->size() || (*Replay::log)[Replay::replay_at] != tag)
+    {
+        raise_fault(BAD_OPERAND, Replay::replay_at);
+        return false;
+    }
+    Replay::replay_at++;
+    return true;
+}
+
+// a hart of a VM that records or replays has no input of its own
+static bool replay_hart_input()
+{
+    if (Replay::spawned_by == Replay::LIVE)
+        return true;
+    raise_fault(BAD_OPERAND, 0);
+    return false;
+}
+
+static qword replay_get_varint()
+{
+    qword value = 0;
+    for (int shift = 0; Replay::replay_at < Replay::log->size() && shift < 64; shift += 7)
+    {
+        byte next = (*Replay::log)[Replay::replay_at++];
+        value |= (qword)(next & 0x7F) << shift;
+        if ((next & 0x80) == 0)
+            break;
+    }
+    return value;
+}
+
+bool Replay::start_recording(const std::string &path)
+{
+    stop();
+    log_out = new std::ofstream(path, std::ios::binary);
+    if (!*log_out)
+    {
+        delete log_out;
+        log_out = nullptr;
+        return false;
+    }
+    log_out->write(replay_magic, 4);
+    log = new std::vector<byte>();
+    log->reserve(CHUNK + 256);
+    mode = RECORDING;
+    return true;
+}
+
+bool Replay::start_replay(const std::string &path)
+{
+    stop();
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    log = new std::vector<byte>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (log->size() < 4 || !std::equal(replay_magic, replay_magic + 4, log->begin()))
+    {
+        delete log;
+        log = nullptr;
+        return false;
+    }
+    replay_at = 4;
+    mode = REPLAYING;
+    return true;
+}
+
+void Replay::flush()
+{
+    if (mode != RECORDING)
+        return;
+    replay_flush();
+    log_out->flush();
+}
+
+void Replay::stop()
+{
+    if (mode == RECORDING)
+    {
+        flush();
+        delete log_out;
+        log_out = nullptr;
+    }
+    delete log;
+    log = nullptr;
+    mode = LIVE;
+}
+
+qword Replay::read_number()
+{
+    qword in = 0;
+    if (mode == REPLAYING)
+        return replay_expect(NUMBER) ? replay_get_varint() : 0;
+    if (!replay_hart_input())
+        return 0;
+    std::cin >> in;
+    if (mode == RECORDING)
+    {
+        replay_record(NUMBER);
+        replay_put_varint(in);
+    }
+    return in;
+}
+
+void Replay::read_chars(char *out, qword count)
+{
+    if (mode == REPLAYING)
+    {
+        std::fill(out, out + count, 0);
+        if (!replay_expect(CHARS))
+            return;
+        qword length = replay_get_varint();
+        for (qword i = 0; i < length && replay_at < log->size(); i++, replay_at++)
+        {
+            if (i < count)
+                out[i] = (*log)[replay_at];
+        }
+        return;
+    }
+    if (!replay_hart_input())
+    {
+        std::fill(out, out + count, 0);
+        return;
+    }
+    for (qword i = 0; i < count; i++)
+    {
+        out[i] = 0;
+        std::cin >> out[i];
+    }
+    if (mode == RECORDING)
+    {
+        replay_record(CHARS);
+        replay_put_varint(count);
+        log->insert(log->end(), out, out + count);
+    }
+}
+
+std::string Replay::read_token()
+{
+    std::string in;
+    if (mode == REPLAYING)
+    {
+        if (!replay_expect(TOKEN))
+            return in;
+        qword length = replay_get_varint();
+        for (qword i = 0; i < length && replay_at < log->size(); i++)
+            in.push_back((*log)[replay_at++]);
+        return in;
+    }
+    if (!replay_hart_input())
+        return in;
+    std::cin >> in;
+    if (mode == RECORDING)
+    {
+        replay_record(TOKEN);
+        replay_put_varint(in.size());
+        log->insert(log->end(), in.begin(), in.end());
+    }
+    return in;
+}
+
+template <typename Live>
+qword Replay::value(Live live)
+{
+    if (mode == REPLAYING)
+        return replay_expect(VALUE) ? replay_get_varint() : 0;
+    qword in = live();
+    if (mode == RECORDING)
+    {
+        replay_record(VALUE);
+        replay_put_varint(in);
+    }
+    return in;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef ENIGMA_STREAM
+#define ENIGMA_STREAM
+
+#include "EnigmaAnalysis.hpp"
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+
+/*
+Running an image while it's still being read. A thread reads the file or pipe in chunks as fast as it can and the
+streamed dispatch loop takes what has arrived into the instruction memory whenever the pc gets near the end of
+what's in, waiting for more if it has to. So the program starts as soon as its first instruction arrives however
+big the image is and a jump ahead only waits for the code up to where it lands.
+
+The check costs a compare per instruction while the image is coming in, once all of it is in the loop carries on
+as the plain one. An instruction that still hasn't arrived after STREAM_WAIT_MS runs anyway and faults out of
+bounds like it would past the end of any program. A streamed program isn't proven[the analysis needs all of it
+from the start] and spawning a hart waits for the whole image since the hart only sees the code that is in
+when it's spawned. Only whole words are taken in and their reserved bits are cleared like the ones of a loaded
+program[see Analysis::strip_reserved], a partial word at the end of the image is dropped.
+*/
+
+#ifndef STREAM_CHUNK
+#define STREAM_CHUNK 65536
+#endif
+
+#ifndef STREAM_WAIT_MS
+#define STREAM_WAIT_MS 10000
+#endif
+
+namespace Stream
+{
+    // what the reader thread has read and the VM hasn't taken yet
+    struct Source
+    {
+        std::mutex lock;
+        std::condition_variable arrived;
+        std::vector<byte> pending;
+        bool done = false; // the reader got to the end of the file or failed
+    };
+
+    // the image the VM on this thread is streaming, nullptr once all of it is in
+    static thread_local std::shared_ptr<Source> source;
+
+    // start reading the image from fd at the end of the program, the fd is closed once it's read
+    inline void open(int fd);
+
+    // take in what has arrived, waiting until the instruction memory has the bytes up to until or the image ends
+    // returns false if nothing arrived in STREAM_WAIT_MS
+    inline bool take(qword until);
+
+    // take in all of the image, unless it stops arriving
+    inline void finish();
+
+    // the streamed dispatch loop, runs until the program halts or faults
+    inline CPU::Trap run();
+};
+
+static void stream_read(std::shared_ptr<Stream::Source> source, int fd)
+{
+    std::vector<byte> chunk(STREAM_CHUNK);
+    for (;;)
+    {
+        ssize_t got = read(fd, chunk.data(), chunk.size());
+        if (got < 0 && errno == EINTR)
+            continue;
+        std::lock_guard<std::mutex> guard(source->lock);
+        if (got <= 0)
+        {
+            source->done = true;
+            source->arrived.notify_all();
+            break;
+        }
+        source->pending.insert(source->pending.end(), chunk.begin(), chunk.begin() + got);
+        source->arrived.notify_all();
+    }
+    close(fd);
+}
+
+void Stream::open(int fd)
+{
+    Analysis::own_code();
+    source = std::make_shared<Source>();
+    // nothing waits for the reader, it holds on to the source until the end of the file
+    std::thread(stream_read, source, fd).detach();
+}
+
+bool Stream::take(qword until)
+{
+    std::vector<byte> bytes;
+    bool done;
+    {
+        std::unique_lock<std::mutex> guard(source->lock);
+        source->arrived.wait_for(guard, std::chrono::milliseconds(STREAM_WAIT_MS), [&]() {
+            return source->done || CPU::mem_pointer + source->pending.size() >= until;
+        });
+        // only whole words go in, the start of one stays until the rest of it arrives
+        bytes.swap(source->pending);
+        source->pending.assign(bytes.end() - bytes.size() % 8, bytes.end());
+        bytes.resize(bytes.size() - bytes.size() % 8);
+        done = source->done;
+    }
+    if (!bytes.empty())
+    {
+        // the image's words are big endian just like the instruction memory's so the bytes go in as they are
+        qword needed = CPU::mem_pointer + bytes.size();
+        if (needed > CPU::instruction_memory.current_size())
+            CPU::instruction_memory.add_size(needed - CPU::instruction_memory.current_size());
+        byte *to = CPU::instruction_memory.mem_span(CPU::mem_pointer, bytes.size());
+        if (to == nullptr)
+            done = true;
+        else
+        {
+            std::memcpy(to, bytes.data(), bytes.size());
+            // the image can't claim proofs any more than a loaded one can
+            Analysis::strip_reserved(CPU::mem_pointer, needed);
+            CPU::mem_pointer = needed;
+        }
+    }
+    // a partial word left at the end goes with the source
+    if (done)
+        source = nullptr;
+    return done || !bytes.empty();
+}
+
+void Stream::finish()
+{
+    while (source != nullptr && take(~0UL))
+        ;
+}
+
+CPU::Trap Stream::run()
+{
+    CPU::begin_run();
+    while (CPU::running == true && source != nullptr)
+    {
+        qword pc = CPU::_registers[CPU::pc];
+        if (pc + 16 > CPU::mem_pointer)
+        {
+            // the whole instruction has to be in, its length is in its first word which may only just arrive
+            qword need = pc + 8;
+            if (need > CPU::mem_pointer)
+                take(need);
+            if (need <= CPU::mem_pointer)
+                need = pc + ISA::length(CPU::instruction_memory.mem_read64(pc));
+            if (need > CPU::mem_pointer && source != nullptr)
+                take(need);
+        }
+        CPU::fetch();
+        CPU::decode();
+        CPU::execute();
+        CPU::_registers[CPU::pc] += 8;
+        CPU::retired++;
+    }
+    if (CPU::running == false)
+        return CPU::end_run();
+    // all of it is in
+    return CPU::run();
+}
+
+#endif
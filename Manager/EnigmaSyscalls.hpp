@@ -2,6 +2,11 @@
 #define ENIGMA_SYSCALLS
 
 #include "../CPU/EnigmaInstructions.hpp"
+#include "../CPU/EnigmaHarts.hpp"
+#include "EnigmaChannels.hpp"
+#include "EnigmaAnalysis.hpp"
+#include "EnigmaReplay.hpp"
+#include "EnigmaHeap.hpp"
 #include <cmath>
 
 namespace Syscalls
@@ -12,8 +17,15 @@ namespace Syscalls
     inline void sysMemIncrease()
     {
         auto __increse_by = CPU::_registers[CPU::br];
+        if (Harts::others_running())
+        {
+            // the other harts are using the memory
+            raise_fault(BAD_OPERAND, __increse_by);
+            return;
+        }
         CPU::data_memory.pointer_limit_increase(__increse_by);
         CPU::data_memory.resize(CPU::data_memory.current_size());
+        Analysis::revalidate();
     }
 
     // increase the upper limit
@@ -33,10 +45,47 @@ namespace Syscalls
     inline void sysIncrPointerLim()
     {
         auto __incr_by = CPU::_registers[CPU::br];
+        if (Harts::others_running())
+        {
+            raise_fault(BAD_OPERAND, __incr_by);
+            return;
+        }
         CPU::data_memory.add_size(__incr_by);
+        Analysis::revalidate();
+    }
+
+    // the heap[see EnigmaHeap.hpp], the addresses are plain data memory addresses to be mapped with a size
+    // ar = 3
+    // br = size in bytes
+    // ar gets the address of the block, 0 if there is no room for it
+    inline void sysMalloc()
+    {
+        CPU::_registers[CPU::ar] = Heap::allocate(CPU::_registers[CPU::br]);
+    }
+
+    // ar = 4
+    // br = address of the block, 0 does nothing
+    inline void sysFree()
+    {
+        if (!Heap::release(CPU::_registers[CPU::br]))
+            raise_fault(BAD_OPERAND, CPU::_registers[CPU::br]);
+    }
+
+    // ar = 5
+    // br = address of the block, cr = new size in bytes
+    // ar gets the address of the moved block, 0 if there is no room for it and the old block is left as it was
+    inline void sysRealloc()
+    {
+        qword address = CPU::_registers[CPU::br];
+        if (address != 0 && Heap::block_size(address) == 0)
+        {
+            raise_fault(BAD_OPERAND, address);
+            return;
+        }
+        CPU::_registers[CPU::ar] = Heap::reallocate(address, CPU::_registers[CPU::cr]);
     }
 
-    // calls from 3 to 10 have been reserved for more operations
+    // calls from 6 to 10 have been reserved for more operations
     // ar = 11
     // br = exit code
     inline void sysExit()
@@ -49,8 +98,7 @@ namespace Syscalls
     // br = memory address to store the read data
     inline void sysReadNum()
     {
-        std::uint64_t in;
-        std::cin >> in;
+        std::uint64_t in = Replay::read_number();
         auto mapped = map_mem(CPU::_registers[CPU::br]);
         switch (mapped.first)
         {
@@ -74,22 +122,17 @@ namespace Syscalls
     // cr = length of characters to be read
     inline void sysReadChar()
     {
-        //this is not how it should be
         auto mapped = map_mem(CPU::_registers[CPU::br]);
-        for (std::uint64_t i = 0; i < CPU::_registers[CPU::cr]; i++)
-        {
-            char in;
-            std::cin >> in;
-            CPU::data_memory.mem_write8(mapped.second + i, (int)in);
-        }
+        byte *to = CPU::data_memory.mem_span(mapped.second, CPU::_registers[CPU::cr]);
+        if (to != nullptr)
+            Replay::read_chars(reinterpret_cast<char *>(to), CPU::_registers[CPU::cr]);
     }
 
     // ar = 14
     // br = memory address
     inline void sysReadFloat()
     {
-        std::string in;
-        std::cin >> in;
+        std::string in = Replay::read_token();
         auto mapped = map_mem(CPU::_registers[CPU::br]);
         switch (mapped.first)
         {
@@ -100,8 +143,9 @@ namespace Syscalls
             CPU::data_memory.mem_write64(mapped.second, strtoDec64(in));
             break;
         default:
-            std::cerr << "Error: Float implementation only supports 4 bytes or 8 bytes." << std::endl;
-            exit(-1);
+            // float implementation only supports 4 bytes or 8 bytes
+            raise_fault(BAD_OPERAND, CPU::_registers[CPU::br]);
+            break;
         }
     }
 
@@ -165,10 +209,84 @@ namespace Syscalls
             std::cout << (num >> 33) << '.' << (num & 0b11111111111111111111111111111111);
             break;
         default:
-            std::cerr << "Error: Float implementation only supports 4 bytes or 8 bytes." << std::endl;
-            exit(-1);
+            // float implementation only supports 4 bytes or 8 bytes
+            raise_fault(BAD_OPERAND, CPU::_registers[CPU::br]);
+            break;
         }
     }
+
+    // ar = 18
+    // br = address of the first instruction of the new hart
+    // cr = the value the new hart starts with in ar
+    // ar gets the id of the new hart, 0 if it couldn't be started
+    inline void sysSpawn()
+    {
+        CPU::_registers[CPU::ar] = Harts::spawn(CPU::_registers[CPU::br], CPU::_registers[CPU::cr]);
+    }
+
+    // ar = 19
+    // br = id of the hart to wait for
+    // ar gets the hart's ar and br why it stopped[see CPU::Status], ar is all ones if there is no such hart
+    inline void sysJoin()
+    {
+        qword result;
+        CPU::Trap trap;
+        if (!Harts::join(CPU::_registers[CPU::br], result, trap))
+        {
+            CPU::_registers[CPU::ar] = BIN_MAX;
+            return;
+        }
+        CPU::_registers[CPU::ar] = result;
+        CPU::_registers[CPU::br] = trap.status;
+    }
+
+    // ar = 20
+    // br = number of messages the channel can hold
+    // cr = biggest message in bytes
+    // ar gets the id of the channel[see Manager/EnigmaChannels.hpp], 0 if it couldn't be made
+    inline void sysChannelCreate()
+    {
+        CPU::_registers[CPU::ar] = Channels::create(CPU::_registers[CPU::br], CPU::_registers[CPU::cr]);
+    }
+
+    // ar = 21
+    // br = channel id
+    // cr = memory address of the message
+    // dr = length of the message in bytes
+    // waits while the channel is full, ar gets 0 once sent and all ones if the channel is closed or the message too long
+    inline void sysChannelSend()
+    {
+        auto mapped = map_mem(CPU::_registers[CPU::cr]);
+        CPU::_registers[CPU::ar] = Channels::send(CPU::_registers[CPU::br], mapped.second, CPU::_registers[CPU::dr], true);
+    }
+
+    // ar = 22
+    // br = channel id
+    // cr = memory address to receive to
+    // dr = room there in bytes, a longer message is cut short
+    // waits while the channel is empty, ar gets the length of the message and all ones once the channel is closed and empty
+    inline void sysChannelReceive()
+    {
+        auto mapped = map_mem(CPU::_registers[CPU::cr]);
+        CPU::_registers[CPU::ar] = Channels::receive(CPU::_registers[CPU::br], mapped.second, CPU::_registers[CPU::dr], true);
+    }
+
+    // ar = 23
+    // same as 22 without waiting, ar gets all ones - 1 if the channel is empty
+    inline void sysChannelTryReceive()
+    {
+        auto mapped = map_mem(CPU::_registers[CPU::cr]);
+        CPU::_registers[CPU::ar] = Channels::receive(CPU::_registers[CPU::br], mapped.second, CPU::_registers[CPU::dr], false);
+    }
+
+    // ar = 24
+    // br = channel id
+    // closes the channel for good, what's still in it is dropped and the id can be handed out again
+    // ar gets 0 and all ones if there is no such channel
+    inline void sysChannelClose()
+    {
+        CPU::_registers[CPU::ar] = Channels::destroy(CPU::_registers[CPU::br]) ? 0 : Channels::FAILED;
+    }
    
 };
 
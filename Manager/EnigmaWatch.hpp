@@ -0,0 +1,316 @@
+#ifndef ENIGMA_WATCH
+#define ENIGMA_WATCH
+
+#include "EnigmaManager.hpp"
+#include <signal.h>
+#include <sys/mman.h>
+
+/*
+Watchpoints on ranges of the data memory, for finding the instruction that writes where it shouldn't. The host
+pages a watched range is on are protected, so the accesses to every other page cost nothing and nothing in the
+dispatch loop knows about them. An access to a protected page traps into the handler here, which counts a hit if
+it touched the watched range[a spurious one if it only touched the same page], takes the protection off and
+single-steps the host past the access before putting it back.
+
+The watchpoints are on the data memory of the thread that adds the first one and see the accesses of all of its
+harts, a hit records the pc of the hart that made it. Only the interpreter keeps pc up to date on every
+instruction, in a translated program[see EnigmaAOT.hpp] it is the last instruction that could fault.
+The kernel doesn't go through the handler, a host syscall that reads into a watched page fails with EFAULT, none
+of the built in syscalls or devices do that. While one thread is being stepped past an access its page is open to
+the others as well, those accesses aren't seen. A SIGSEGV or SIGTRAP that isn't about a watched page goes on to
+the handler there was before and the watchpoints stay armed, so do the resizes of every other memory.
+
+Single stepping the host needs the trap flag, so watchpoints are only there on x86-64 Linux, add fails elsewhere.
+It fails as well on a data memory with explicit huge pages[see memory/EnigmaPages.hpp].
+*/
+
+#ifndef MAX_WATCHPOINTS
+#define MAX_WATCHPOINTS 4
+#endif
+
+#ifndef WATCH_LOG_SIZE
+#define WATCH_LOG_SIZE 256
+#endif
+
+#if defined(__linux__) && defined(__x86_64__)
+#define ENIGMA_WATCH_SUPPORTED
+#include <ucontext.h>
+#endif
+
+namespace Watch
+{
+    enum Kind : byte
+    {
+        WRITES,   // the page is read only
+        ACCESSES, // the page can't be touched at all
+    };
+
+    struct Hit
+    {
+        qword address; // in the data memory
+        qword pc;
+        bool write;
+    };
+
+    // adds a watchpoint, returns its id or -1 if all MAX_WATCHPOINTS are taken, the range isn't all in the data
+    // memory, the data memory has explicit huge pages or watchpoints aren't supported here
+    inline int add(qword address, qword length, Kind kind = WRITES);
+    inline bool remove(int id);
+    inline void remove_all();
+
+    // the instructions that hit the watchpoint's range
+    inline qword hits(int id);
+
+    // the host accesses that only hit a page with a watchpoint on it, what the watchpoints cost
+    inline qword spurious();
+
+    // the last WATCH_LOG_SIZE hits in the order they happened, older ones are dropped
+    inline std::vector<Hit> log();
+};
+
+struct Watchpoint
+{
+    std::atomic<bool> active{false};
+    qword address = 0;
+    qword length = 0;
+    Watch::Kind kind = Watch::WRITES;
+    std::atomic<qword> hits{0};
+};
+
+static Watchpoint watchpoints[MAX_WATCHPOINTS];
+static Memory watched_memory;                     // a handle to the memory the watchpoints are on
+static std::atomic<byte *> watch_base{nullptr};   // where its storage is in the host while it's armed
+static std::atomic<const Region *> watched_storage{nullptr}; // its storage, the resizes of any other are none of ours
+static std::atomic<qword> watch_spurious{0};
+static Watch::Hit watch_log[WATCH_LOG_SIZE];
+static std::atomic<qword> watch_logged{0};
+static thread_local byte *watch_stepping[2];        // the pages this thread is being stepped past, an access can straddle two
+static thread_local qword watch_last_retired = ~0UL; // the instruction that made the last hit on this thread
+static thread_local qword watch_last_pc = ~0UL;
+static struct sigaction watch_old_segv, watch_old_trap;
+
+static byte *watch_page(qword address)
+{
+    return watch_base.load() + address / host_page_size() * host_page_size();
+}
+
+// the protection of the page at the host address, what the strictest watchpoint on it wants
+static int watch_protection(byte *page)
+{
+    int protection = PROT_READ | PROT_WRITE;
+    for (auto &point : watchpoints)
+    {
+        if (!point.active.load())
+            continue;
+        byte *first = watch_page(point.address), *last = watch_page(point.address + point.length - 1);
+        if (page < first || page > last)
+            continue;
+        protection = point.kind == Watch::ACCESSES ? PROT_NONE : (protection & PROT_READ);
+    }
+    return protection;
+}
+
+static void watch_protect(const Watchpoint &point)
+{
+    byte *first = watch_page(point.address), *last = watch_page(point.address + point.length - 1);
+    for (byte *page = first; page <= last; page += host_page_size())
+        mprotect(page, host_page_size(), watch_protection(page));
+}
+
+// off before the storage is resized, back on wherever it is after
+static void watch_resized(const Region *storage, bool resized)
+{
+    if (storage != watched_storage.load())
+        return;
+    if (watch_base.load() == nullptr && !resized)
+        return;
+    if (!resized)
+    {
+        for (auto &point : watchpoints)
+        {
+            if (point.active.load())
+                mprotect(watch_page(point.address), watch_page(point.address + point.length - 1) - watch_page(point.address) + host_page_size(), PROT_READ | PROT_WRITE);
+        }
+        watch_base = nullptr;
+        return;
+    }
+    if (watch_base.load() != nullptr)
+        return;
+    watch_base = watched_memory.mem_span(0, 1);
+    for (auto &point : watchpoints)
+    {
+        if (point.active.load())
+            watch_protect(point);
+    }
+}
+
+#ifdef ENIGMA_WATCH_SUPPORTED
+
+// not ours, it goes to whoever had the signal before us and ours stays installed for the next one
+static void watch_chain(int signal, siginfo_t *info, void *context, const struct sigaction &old)
+{
+    if (old.sa_flags & SA_SIGINFO)
+    {
+        if (old.sa_sigaction != nullptr)
+            old.sa_sigaction(signal, info, context);
+    }
+    else if (old.sa_handler == SIG_DFL)
+    {
+        // the default action ends the process when the instruction runs again, there's nothing left to watch then
+        sigaction(signal, &old, nullptr);
+    }
+    else if (old.sa_handler != SIG_IGN)
+        old.sa_handler(signal);
+}
+
+static void watch_segv(int signal, siginfo_t *info, void *context)
+{
+    byte *at = static_cast<byte *>(info->si_addr);
+    byte *base = watch_base.load();
+    ucontext_t *uc = static_cast<ucontext_t *>(context);
+    byte *page = nullptr;
+    if (base != nullptr && at >= base)
+    {
+        qword address = at - base;
+        byte *candidate = watch_page(address);
+        bool hit = false, near = false;
+        for (auto &point : watchpoints)
+        {
+            if (!point.active.load())
+                continue;
+            if (address >= point.address && address - point.address < point.length)
+                hit = true;
+            if (candidate >= watch_page(point.address) && candidate <= watch_page(point.address + point.length - 1))
+                near = true;
+        }
+        // the memory reads and writes a word a byte at a time, an instruction is only one hit however many it makes
+        if (hit && (CPU::retired != watch_last_retired || CPU::_registers[CPU::pc] != watch_last_pc))
+        {
+            watch_last_retired = CPU::retired;
+            watch_last_pc = CPU::_registers[CPU::pc];
+            for (auto &point : watchpoints)
+            {
+                if (point.active.load() && address >= point.address && address - point.address < point.length)
+                    point.hits++;
+            }
+            qword n = watch_logged++;
+            watch_log[n % WATCH_LOG_SIZE] = {address, CPU::_registers[CPU::pc], (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0};
+        }
+        else if (!hit && near)
+            watch_spurious++;
+        if (hit || near)
+            page = candidate;
+    }
+    if (page == nullptr)
+    {
+        watch_chain(signal, info, context, watch_old_segv);
+        return;
+    }
+    // let the access through and trap right after it
+    mprotect(page, host_page_size(), PROT_READ | PROT_WRITE);
+    watch_stepping[watch_stepping[0] == nullptr ? 0 : 1] = page;
+    uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+}
+
+static void watch_trap(int signal, siginfo_t *info, void *context)
+{
+    if (watch_stepping[0] == nullptr)
+    {
+        watch_chain(signal, info, context, watch_old_trap);
+        return;
+    }
+    static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+    for (byte *&page : watch_stepping)
+    {
+        if (page != nullptr && watch_base.load() != nullptr)
+            mprotect(page, host_page_size(), watch_protection(page));
+        page = nullptr;
+    }
+}
+
+static void watch_install()
+{
+    static bool installed = false;
+    if (installed)
+        return;
+    struct sigaction action = {};
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = watch_segv;
+    sigaction(SIGSEGV, &action, &watch_old_segv);
+    action.sa_sigaction = watch_trap;
+    sigaction(SIGTRAP, &action, &watch_old_trap);
+    resize_hook = watch_resized;
+    installed = true;
+}
+
+#endif
+
+int Watch::add(qword address, qword length, Kind kind)
+{
+#ifdef ENIGMA_WATCH_SUPPORTED
+    if (length == 0 || address >= CPU::data_memory.safe_size() || CPU::data_memory.safe_size() - address < length)
+        return -1;
+    // mprotect can't split a page from the hugetlbfs pool, it would protect the whole 2 MiB or nothing
+    if (CPU::data_memory.has_explicit_huge_pages())
+        return -1;
+    for (int id = 0; id < MAX_WATCHPOINTS; id++)
+    {
+        Watchpoint &point = watchpoints[id];
+        if (point.active.load())
+            continue;
+        watch_install();
+        if (watch_base.load() == nullptr)
+        {
+            watched_memory = CPU::data_memory;
+            watched_storage = watched_memory.region();
+            watch_base = watched_memory.mem_span(0, 1);
+        }
+        point.address = address;
+        point.length = length;
+        point.kind = kind;
+        point.hits = 0;
+        point.active = true;
+        watch_protect(point);
+        return id;
+    }
+#endif
+    return -1;
+}
+
+bool Watch::remove(int id)
+{
+    if (id < 0 || id >= MAX_WATCHPOINTS || !watchpoints[id].active.load())
+        return false;
+    watchpoints[id].active = false;
+    if (watch_base.load() != nullptr)
+        watch_protect(watchpoints[id]); // what the others on its pages still want
+    return true;
+}
+
+void Watch::remove_all()
+{
+    for (int id = 0; id < MAX_WATCHPOINTS; id++)
+        remove(id);
+}
+
+qword Watch::hits(int id)
+{
+    return id < 0 || id >= MAX_WATCHPOINTS ? 0 : watchpoints[id].hits.load();
+}
+
+qword Watch::spurious()
+{
+    return watch_spurious.load();
+}
+
+std::vector<Watch::Hit> Watch::log()
+{
+    qword logged = watch_logged.load();
+    std::vector<Hit> out;
+    for (qword n = logged > WATCH_LOG_SIZE ? logged - WATCH_LOG_SIZE : 0; n < logged; n++)
+        out.push_back(watch_log[n % WATCH_LOG_SIZE]);
+    return out;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include "../Manager/EnigmaManager.hpp"
+#include <chrono>
+
+// PROGRAM: A program that reads 10,000,000 words at random out of a 256 MiB data memory[A program for checking
+// what huge pages save on TLB misses], run on small pages, transparent huge pages and explicit ones from the
+// hugetlbfs pool. It prints the kind each run asked for and got, how long it took and how much of the memory
+// the host put on huge pages. br holds the random generator, what is read goes back into it
+// 001110 01 00000000000000000000000000000000000000000000000001000000 ; mov ar 8
+// 001100 01 00000000000000000000000000000000000000000000000111100000 ; lshift ar 60[ar is the mapped address 8 bytes: 0]
+// 001110 01 00000000000000000000000000000100110001001011010000000010 ; mov cr 10000000[the accesses]
+// 000011 01 00000000000000000010111011110111011001110011001101101001 ; mul br 25214903917[the loop starts here, br = br * 0x5DEECE66D + 11]
+// 000001 01 00000000000000000000000000000000000000000000000001011001 ; add br 11
+// 001110 00 00000000000000000000000000000000000000000000000000011001 ; mov dr br
+// 001101 01 00000000000000000000000000000000000000000000000010000011 ; rshift dr 16[the low bits of the generator aren't random]
+// 001000 01 00000000000000000000000001111111111111111111111111000011 ; and dr 268435448[a word in the 256 MiB]
+// 001010 00 00000000000000000000000000000000000000000000000000011000 ; or dr ar
+// 001110 11 00000000000000000000000000000000000000000000000000011011 ; mov dr [dr]
+// 001011 00 00000000000000000000000000000000000000000000000000001011 ; xor br dr[the next address depends on what was read]
+// 000110 00 00000000000000000000000000000000000000000000000000000010 ; dec cr
+// 001110 01 00000000000000000000000000000000000000000000000000000011 ; mov dr 0
+// 011000 00 00000000000000000000000000000000000000000000000000010011 ; cmp cr dr
+// 011111 00 00000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 00 00000000000000000000000000000000000000000000000000010000 ; address to jump to[24, the mul]
+// 101101 00 00000000000000000000000000000000000000000000000000000000 ; halt
+
+#define BENCH_MEMORY (1UL << 28)
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000000001000000,
+        0b0011000100000000000000000000000000000000000000000000000111100000,
+        0b0011100100000000000000000000000000000100110001001011010000000010,
+        0b0000110100000000000000000010111011110111011001110011001101101001,
+        0b0000010100000000000000000000000000000000000000000000000001011001,
+        0b0011100000000000000000000000000000000000000000000000000000011001,
+        0b0011010100000000000000000000000000000000000000000000000010000011,
+        0b0010000100000000000000000000000001111111111111111111111111000011,
+        0b0010100000000000000000000000000000000000000000000000000000011000,
+        0b0011101100000000000000000000000000000000000000000000000000011011,
+        0b0010110000000000000000000000000000000000000000000000000000001011,
+        0b0001100000000000000000000000000000000000000000000000000000000010,
+        0b0011100100000000000000000000000000000000000000000000000000000011,
+        0b0110000000000000000000000000000000000000000000000000000000010011,
+        0b0111110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000010000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    Manager::load_instructions(instructions);
+    const char *names[] = {"small pages", "transparent huge pages", "explicit huge pages"};
+    for (HugePages kind : {NO_HUGE_PAGES, TRANSPARENT_HUGE_PAGES, EXPLICIT_HUGE_PAGES})
+    {
+        // a fresh memory every time, the pages of the last run would keep what they were on
+        CPU::data_memory = Memory();
+        CPU::data_memory.increase_upper_limit(BENCH_MEMORY);
+        HugePages got = CPU::data_memory.use_huge_pages(kind);
+        CPU::data_memory.add_size(BENCH_MEMORY);
+        std::memset(CPU::data_memory.mem_span(0, BENCH_MEMORY), 1, BENCH_MEMORY);
+        CPU::_registers[CPU::pc] = 0;
+        CPU::_registers[CPU::br] = 1;
+        auto start = std::chrono::steady_clock::now();
+        Manager::start_execution();
+        auto took = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << names[kind] << "[got " << names[got] << "]: " << took.count() << " ms, "
+                  << CPU::data_memory.huge_page_bytes() / (1UL << 20) << " MiB on huge pages" << std::endl;
+    }
+}
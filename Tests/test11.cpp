@@ -0,0 +1,64 @@
+#include "../Manager/EnigmaManager.hpp"
+#include <thread>
+
+// PROGRAM: One program shared by 4 VMs, each on its own thread. The program adds up the numbers from cr down to 1
+// and saves the sum, every VM gets its own cr[1000, 2000, 3000, 4000] and has its own data memory but all of them
+// run the same frozen code segment. Afterwards a VM that loads more code gets a copy of its own and the segment
+// stays as it was
+// 001110 01 00000000000000000000000000000000000000000000000000000000 ; mov ar 0
+// 000001 00 00000000000000000000000000000000000000000000000000000010 ; add ar cr[the loop starts here]
+// 000110 00 00000000000000000000000000000000000000000000000000000010 ; dec cr
+// 001110 01 00000000000000000000000000000000000000000000000000000011 ; mov dr 0
+// 011000 00 00000000000000000000000000000000000000000000000000010011 ; cmp cr dr
+// 011111 00 00000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 00 00000000000000000000000000000000000000000000000000000000 ; address to jump to[8, the add]
+// 101100 00 00000000000000000000000000000000000000000000000000000000 ; save ar
+// 100000 00 00000000000000000000000000000000000000000000001000000000 ; the address to save to[8 bytes: address 512]
+// 101101 00 00000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000000000000000,
+        0b0000010000000000000000000000000000000000000000000000000000000010,
+        0b0001100000000000000000000000000000000000000000000000000000000010,
+        0b0011100100000000000000000000000000000000000000000000000000000011,
+        0b0110000000000000000000000000000000000000000000000000000000010011,
+        0b0111110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000000000,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    Manager::load_instructions(instructions);
+    std::shared_ptr<const Analysis::CodeSegment> segment = Manager::share_program();
+    Memory code = segment->code, proven = segment->proven;
+
+    // every thread is a VM of its own
+    std::vector<std::thread> vms;
+    qword sums[4] = {}, shared[4] = {};
+    for (int vm = 0; vm < 4; vm++)
+    {
+        vms.emplace_back([&, vm]() {
+            Manager::load_program(segment);
+            CPU::_registers[CPU::cr] = 1000 * (vm + 1);
+            Manager::start_execution();
+            sums[vm] = CPU::data_memory.mem_read64(0b1000000000);
+            // it ran from the segment's bytes and not a copy of them
+            shared[vm] = CPU::instruction_memory.mem_span(0, 1) == proven.mem_span(0, 1) ||
+                         CPU::instruction_memory.mem_span(0, 1) == code.mem_span(0, 1);
+        });
+    }
+    for (auto &vm : vms)
+        vm.join();
+    for (int vm = 0; vm < 4; vm++)
+        std::cout << sums[vm] << " " << shared[vm] << " ";
+
+    // loading more code on top of the shared program writes to a copy
+    qword size = code.current_size();
+    std::vector<std::uint64_t> more = {0b1011010000000000000000000000000000000000000000000000000000000000};
+    Manager::load_program(segment);
+    Manager::load_instructions(more);
+    std::cout << (CPU::instruction_memory.mem_span(0, 1) != code.mem_span(0, 1)) << " "
+              << (code.current_size() == size) << std::endl;
+}
@@ -0,0 +1,68 @@
+#include "../Manager/EnigmaManager.hpp"
+#include <thread>
+#include <chrono>
+
+// PROGRAM: A program streamed in through a pipe 3 bytes at a time with 3 stray bytes at the end, so words keep
+// arriving in pieces. It adds up the numbers from 100 down to 1 and saves the sum, then saves it again far outside
+// the data memory with bit 55 set as if the access was proven. The words have to go in whole and the claim has to
+// be cleared, so the second save faults out of bounds
+// 001110 01 00000000000000000000000000000000000000000000001100100010 ; mov cr 100
+// 001110 01 00000000000000000000000000000000000000000000000000000000 ; mov ar 0
+// 000001 00 00000000000000000000000000000000000000000000000000000010 ; add ar cr[the loop starts here]
+// 000110 00 00000000000000000000000000000000000000000000000000000010 ; dec cr
+// 001110 01 00000000000000000000000000000000000000000000000000000011 ; mov dr 0
+// 011000 00 00000000000000000000000000000000000000000000000000010011 ; cmp cr dr
+// 011111 00 00000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 00 00000000000000000000000000000000000000000000000000001000 ; address to jump to[16, the add]
+// 101100 00 00000000000000000000000000000000000000000000000000000000 ; save ar
+// 100000 00 00000000000000000000000000000000000000000000001000000000 ; the address to save to[8 bytes: address 512]
+// 101100 00 10000000000000000000000000000000000000000000000000000000 ; save ar with bit 55 set by the program
+// 100000 00 00000000000000000001000000000000000000000000000000000000 ; the address to save to[8 bytes: address 2^36]
+// 101101 00 00000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000001100100010,
+        0b0011100100000000000000000000000000000000000000000000000000000000,
+        0b0000010000000000000000000000000000000000000000000000000000000010,
+        0b0001100000000000000000000000000000000000000000000000000000000010,
+        0b0011100100000000000000000000000000000000000000000000000000000011,
+        0b0110000000000000000000000000000000000000000000000000000000010011,
+        0b0111110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000001000,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b1011000010000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000001000000000000000000000000000000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    // the image is big endian
+    std::vector<byte> image;
+    for (std::uint64_t instruction : instructions)
+    {
+        for (int shift = 56; shift >= 0; shift -= 8)
+            image.push_back(instruction >> shift);
+    }
+    image.insert(image.end(), {0b10110100, 0, 0});
+
+    int ends[2];
+    if (pipe(ends) != 0)
+        return 1;
+    std::thread writer([&]() {
+        for (std::size_t at = 0; at < image.size(); at += 3)
+        {
+            if (write(ends[1], image.data() + at, std::min<std::size_t>(3, image.size() - at)) < 0)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        close(ends[1]);
+    });
+    Manager::stream_image(ends[0]);
+    CPU::Trap trap = Manager::start_streamed_execution();
+    // the rest of the image, the stray bytes at the end aren't a word
+    Stream::finish();
+    writer.join();
+    std::cout << CPU::data_memory.mem_read64(0b1000000000) << " " << (int)trap.status << " " << (int)trap.fault << " "
+              << CPU::mem_pointer << std::endl;
+}
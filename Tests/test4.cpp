@@ -0,0 +1,30 @@
+#include "../Manager/EnigmaManager.hpp"
+
+// PROGRAM: A program that calls a subroutine to add two numbers and stores the result in memory
+// 001110 01 00000000000000000000000000000000000000000000000000010100 000 ; mov enia 20
+// 001110 01 00000000000000000000000000000000000000000000000000010110 001 ; mov enib 22
+// 101111 0000000000000000000000000000000000000000000000000000000000 ; call
+// 000000 0000000000000000000000000000000000000000000000000000110000 ; the subroutine[at 56, jumping to 48]
+// 101100 0000000000000000000000000000000000000000000000000000000 000 ; save enia
+// 100000 0000000000000000000000000000000000000000000000001000000000 ; the address to save to[ 8 bytes: address 512]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+// 000001 00 00000000000000000000000000000000000000000000000000 000 001; add enia enib[the subroutine]
+// 110000 0000000000000000000000000000000000000000000000000000000000 ; ret
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000000010100000,
+        0b0011100100000000000000000000000000000000000000000000000010110001,
+        0b1011110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000110000,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+        0b0000010000000000000000000000000000000000000000000000000000000001,
+        0b1100000000000000000000000000000000000000000000000000000000000000,
+    };
+    Manager::load_instructions(instructions);
+    Manager::start_execution();
+    std::cout << CPU::data_memory.mem_read64(0b1000000000) << std::endl;
+}
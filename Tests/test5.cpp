@@ -0,0 +1,81 @@
+#include "../Manager/EnigmaManager.hpp"
+
+// PROGRAM: A program that starts 4 harts which all add 1 to the same counter a million times with fetch_add
+// the first hart waits for the other 4 and the counter must be exactly 4,000,000
+// 001110 0100000000000000000000000000000000000000000000000010010000 ; mov ar 18
+// 001110 0100000000000000000000000000000000000000000000010111000001 ; mov br 184[the hart's first instruction]
+// 001110 0100000000000000000000000000000000011110100001001000000010 ; mov cr 1000000[what the hart gets in ar]
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[spawn hart 1]
+// 001110 0100000000000000000000000000000000000000000000000010010000 ; mov ar 18
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[spawn hart 2]
+// 001110 0100000000000000000000000000000000000000000000000010010000 ; mov ar 18
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[spawn hart 3]
+// 001110 0100000000000000000000000000000000000000000000000010010000 ; mov ar 18
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[spawn hart 4]
+// 001110 0100000000000000000000000000000000000000000000000010011000 ; mov ar 19
+// 001110 0100000000000000000000000000000000000000000000000000001001 ; mov br 1
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[join hart 1]
+// 001110 0100000000000000000000000000000000000000000000000010011000 ; mov ar 19
+// 001110 0100000000000000000000000000000000000000000000000000010001 ; mov br 2
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[join hart 2]
+// 001110 0100000000000000000000000000000000000000000000000010011000 ; mov ar 19
+// 001110 0100000000000000000000000000000000000000000000000000011001 ; mov br 3
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[join hart 3]
+// 001110 0100000000000000000000000000000000000000000000000010011000 ; mov ar 19
+// 001110 0100000000000000000000000000000000000000000000000000100001 ; mov br 4
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[join hart 4]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+// 001110 0100000000000000000000000000000000000000000000000001000011 ; mov dr 8[the hart starts here]
+// 001100 0100000000000000000000000000000000000000000000000111100011 ; lshift dr 60
+// 000001 0100000000000000000000000000000000000000000001000000000011 ; add dr 512[dr is the mapped address 8 bytes: 512]
+// 001110 0100000000000000000000000000000000000000000000000000000001 ; mov br 0
+// 001110 0100000000000000000000000000000000000000000000000000001010 ; mov cr 1
+// 110010 0000000000000000000000000000000000000000000000000000010011 ; fetch_add dr cr
+// 000110 0000000000000000000000000000000000000000000000000000000000 ; dec ar
+// 011000 0000000000000000000000000000000000000000000000000000000001 ; cmp ar br
+// 011111 0000000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 0000000000000000000000000000000000000000000000000011010000 ; address to jump to[208, the mov cr 1]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+    0b0011100100000000000000000000000000000000000000000000000010010000,
+    0b0011100100000000000000000000000000000000000000000000010111000001,
+    0b0011100100000000000000000000000000000000011110100001001000000010,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010010000,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010010000,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010010000,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010011000,
+    0b0011100100000000000000000000000000000000000000000000000000001001,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010011000,
+    0b0011100100000000000000000000000000000000000000000000000000010001,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010011000,
+    0b0011100100000000000000000000000000000000000000000000000000011001,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000010011000,
+    0b0011100100000000000000000000000000000000000000000000000000100001,
+    0b1011100000000000000000000000000000000000000000000000000000000000,
+    0b1011010000000000000000000000000000000000000000000000000000000000,
+    0b0011100100000000000000000000000000000000000000000000000001000011,
+    0b0011000100000000000000000000000000000000000000000000000111100011,
+    0b0000010100000000000000000000000000000000000000000001000000000011,
+    0b0011100100000000000000000000000000000000000000000000000000000001,
+    0b0011100100000000000000000000000000000000000000000000000000001010,
+    0b1100100000000000000000000000000000000000000000000000000000010011,
+    0b0001100000000000000000000000000000000000000000000000000000000000,
+    0b0110000000000000000000000000000000000000000000000000000000000001,
+    0b0111110000000000000000000000000000000000000000000000000000000000,
+    0b0000000000000000000000000000000000000000000000000000000011010000,
+    0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    Manager::load_instructions(instructions);
+    Manager::start_execution();
+    std::cout << CPU::data_memory.mem_read64(0b1000000000) << std::endl;
+}
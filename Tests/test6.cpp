@@ -0,0 +1,117 @@
+#include "../Manager/EnigmaManager.hpp"
+#include <thread>
+
+// PROGRAM: Two VMs in the same process, one sends the numbers from 100,000 down to 1 over a channel and then 0
+// to say it's done, the other adds up what it receives until it gets the 0 and saves the sum[5000050000]
+// the sender:
+// 001110 0100000000000000000000000000000000000011000011010100000100 ; mov er1 100000
+// 001110 0000000000000000000000000000000000000000000000000000000100 ; mov ar er1[the loop starts here]
+// 101100 0000000000000000000000000000000000000000000000000000000000 ; save ar
+// 100000 0000000000000000000000000000000000000000000000001000000000 ; the address to save to[8 bytes: address 512]
+// 001110 0100000000000000000000000000000000000000000000000010101000 ; mov ar 21
+// 001110 0100000000000000000000000000000000000000000000000000001001 ; mov br 1[the channel]
+// 001110 0100000000000000000000000000000000000000000001000000000010 ; mov cr 512
+// 001110 0100000000000000000000000000000000000000000000000001000011 ; mov dr 8
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[send]
+// 001110 0000000000000000000000000000000000000000000000000000000100 ; mov ar er1
+// 000110 0000000000000000000000000000000000000000000000000000000000 ; dec ar
+// 001110 0000000000000000000000000000000000000000000000000000100000 ; mov er1 ar
+// 001110 0100000000000000000000000000000000000000000000000000000001 ; mov br 0
+// 011000 0000000000000000000000000000000000000000000000000000000001 ; cmp ar br
+// 011111 0000000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 0000000000000000000000000000000000000000000000000000000000 ; address to jump to[0]
+// 101100 0000000000000000000000000000000000000000000000000000000000 ; save ar[ar is 0 here, that's the end]
+// 100000 0000000000000000000000000000000000000000000000001000000000 ; the address to save to[8 bytes: address 512]
+// 001110 0100000000000000000000000000000000000000000000000010101000 ; mov ar 21
+// 001110 0100000000000000000000000000000000000000000000000000001001 ; mov br 1
+// 001110 0100000000000000000000000000000000000000000001000000000010 ; mov cr 512
+// 001110 0100000000000000000000000000000000000000000000000001000011 ; mov dr 8
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[send]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+// the receiver:
+// 001110 0100000000000000000000000000000000000000000000000000000101 ; mov er2 0
+// 001110 0100000000000000000000000000000000000000000000000010110000 ; mov ar 22[the loop starts here]
+// 001110 0100000000000000000000000000000000000000000000000000001001 ; mov br 1[the channel]
+// 001110 0100000000000000000000000000000000000000000001000000000010 ; mov cr 512
+// 001110 0100000000000000000000000000000000000000000000000001000011 ; mov dr 8
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[receive]
+// 001110 0000000000000000000000000000000000000000000000000000000101 ; mov ar er2
+// 000001 1100000000000000000000000000000000000000000000000000000000 ; add ar
+// 100000 0000000000000000000000000000000000000000000000001000000000 ; the address to add from[8 bytes: address 512]
+// 001110 0000000000000000000000000000000000000000000000000000101000 ; mov er2 ar
+// 001110 0100000000000000000000000000000000000000000000000000000001 ; mov br 0
+// 000001 1100000000000000000000000000000000000000000000000000000001 ; add br
+// 100000 0000000000000000000000000000000000000000000000001000000000 ; the address to add from[8 bytes: address 512]
+// 001110 0100000000000000000000000000000000000000000000000000000010 ; mov cr 0
+// 011000 0000000000000000000000000000000000000000000000000000001010 ; cmp br cr
+// 011111 0000000000000000000000000000000000000000000000000000000000 ; jne
+// 000000 0000000000000000000000000000000000000000000000000000000000 ; address to jump to[0]
+// 101100 0000000000000000000000000000000000000000000000000000000000 ; save ar
+// 100000 0000000000000000000000000000000000000000000000001000001000 ; the address to save to[8 bytes: address 520]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> sender = {
+        0b0011100100000000000000000000000000000000000011000011010100000100,
+        0b0011100000000000000000000000000000000000000000000000000000000100,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b0011100100000000000000000000000000000000000000000000000010101000,
+        0b0011100100000000000000000000000000000000000000000000000000001001,
+        0b0011100100000000000000000000000000000000000000000001000000000010,
+        0b0011100100000000000000000000000000000000000000000000000001000011,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b0011100000000000000000000000000000000000000000000000000000000100,
+        0b0001100000000000000000000000000000000000000000000000000000000000,
+        0b0011100000000000000000000000000000000000000000000000000000100000,
+        0b0011100100000000000000000000000000000000000000000000000000000001,
+        0b0110000000000000000000000000000000000000000000000000000000000001,
+        0b0111110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000000000,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b0011100100000000000000000000000000000000000000000000000010101000,
+        0b0011100100000000000000000000000000000000000000000000000000001001,
+        0b0011100100000000000000000000000000000000000000000001000000000010,
+        0b0011100100000000000000000000000000000000000000000000000001000011,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    std::vector<std::uint64_t> receiver = {
+        0b0011100100000000000000000000000000000000000000000000000000000101,
+        0b0011100100000000000000000000000000000000000000000000000010110000,
+        0b0011100100000000000000000000000000000000000000000000000000001001,
+        0b0011100100000000000000000000000000000000000000000001000000000010,
+        0b0011100100000000000000000000000000000000000000000000000001000011,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b0011100000000000000000000000000000000000000000000000000000000101,
+        0b0000011100000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b0011100000000000000000000000000000000000000000000000000000101000,
+        0b0011100100000000000000000000000000000000000000000000000000000001,
+        0b0000011100000000000000000000000000000000000000000000000000000001,
+        0b1000000000000000000000000000000000000000000000000000001000000000,
+        0b0011100100000000000000000000000000000000000000000000000000000010,
+        0b0110000000000000000000000000000000000000000000000000000000001010,
+        0b0111110000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000000000,
+        0b1011000000000000000000000000000000000000000000000000000000000000,
+        0b1000000000000000000000000000000000000000000000000000001000001000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    // the host makes the channel so both programs know its id
+    Channels::create(16, 8);
+    // every thread is a VM of its own
+    std::thread sending([&]() {
+        Manager::load_instructions(sender);
+        Manager::start_execution();
+    });
+    std::thread receiving([&]() {
+        Manager::load_instructions(receiver);
+        Manager::start_execution();
+        std::cout << CPU::data_memory.mem_read64(0b1000001000) << std::endl;
+    });
+    sending.join();
+    receiving.join();
+}
@@ -0,0 +1,22 @@
+#include "../Manager/EnigmaManager.hpp"
+
+// PROGRAM: A program that jumps into the middle of its own code where a word claims its access was proven, the
+// host has br pointing far outside the data memory so the access has to be checked and fault
+// 011010 0000000000000000000000000000000000000000000000000000000000 ; jz
+// 000000 0000000000000000000000000000000000000000000000000000000011 ; the target[3, not a multiple of 8]
+// 001110 1 1 1000000000000000000000000000000000000000000000000000 001 ; mov ar [br] with bit 55 set by the program
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0110100000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000000011,
+        0b0011101110000000000000000000000000000000000000000000000000000001,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    CPU::_registers[CPU::br] = (8UL << 60) | (1UL << 36);
+    Manager::load_instructions(instructions);
+    CPU::Trap trap = Manager::start_execution();
+    std::cout << (int)trap.status << " " << (int)trap.fault << std::endl;
+}
@@ -0,0 +1,25 @@
+#include "../Manager/EnigmaManager.hpp"
+
+// PROGRAM: A program that starts a hart which spins forever and halts right away, the program is done once its
+// first hart stops so the spinning one has to be stopped for start_execution to return
+// 001110 0100000000000000000000000000000000000000000000000010010000 ; mov ar 18
+// 001110 0100000000000000000000000000000000000000000000000100000001 ; mov br 32[the hart's first instruction]
+// 101110 0000000000000000000000000000000000000000000000000000000000 ; syscall[spawn hart 1]
+// 101101 0000000000000000000000000000000000000000000000000000000000 ; halt
+// 011001 0000000000000000000000000000000000000000000000000000000000 ; jmp[the hart starts here]
+// 000000 0000000000000000000000000000000000000000000000000000100000 ; address to jump to[32, the jmp itself]
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000000010010000,
+        0b0011100100000000000000000000000000000000000000000000000100000001,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+        0b0110010000000000000000000000000000000000000000000000000000000000,
+        0b0000000000000000000000000000000000000000000000000000000000100000,
+    };
+    Manager::load_instructions(instructions);
+    CPU::Trap trap = Manager::start_execution();
+    std::cout << (int)trap.status << std::endl;
+}
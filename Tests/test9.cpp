@@ -0,0 +1,37 @@
+#include "../Manager/EnigmaManager.hpp"
+
+// PROGRAM: A program that mallocs 24 bytes, reallocs them to 100 bytes which moves the block and frees the old
+// block, then frees the old block again. The second free has to fault instead of handing the block out twice
+// 001110 01 00000000000000000000000000000000000000000000000000011000 ; mov ar 3
+// 001110 01 00000000000000000000000000000000000000000000000011000001 ; mov br 24
+// 101110 00 00000000000000000000000000000000000000000000000000000000 ; syscall[malloc, ar gets the block]
+// 001110 00 00000000000000000000000000000000000000000000000000001000 ; mov br ar
+// 001110 01 00000000000000000000000000000000000000000000000000101000 ; mov ar 5
+// 001110 01 00000000000000000000000000000000000000000000001100100010 ; mov cr 100
+// 101110 00 00000000000000000000000000000000000000000000000000000000 ; syscall[realloc, ar gets the moved block]
+// 001110 00 00000000000000000000000000000000000000000000000000011000 ; mov dr ar
+// 001110 01 00000000000000000000000000000000000000000000000000100000 ; mov ar 4
+// 101110 00 00000000000000000000000000000000000000000000000000000000 ; syscall[free the old block again]
+// 101101 00 00000000000000000000000000000000000000000000000000000000 ; halt
+
+int main()
+{
+    std::vector<std::uint64_t> instructions = {
+        0b0011100100000000000000000000000000000000000000000000000000011000,
+        0b0011100100000000000000000000000000000000000000000000000011000001,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b0011100000000000000000000000000000000000000000000000000000001000,
+        0b0011100100000000000000000000000000000000000000000000000000101000,
+        0b0011100100000000000000000000000000000000000000000000001100100010,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b0011100000000000000000000000000000000000000000000000000000011000,
+        0b0011100100000000000000000000000000000000000000000000000000100000,
+        0b1011100000000000000000000000000000000000000000000000000000000000,
+        0b1011010000000000000000000000000000000000000000000000000000000000,
+    };
+    Manager::load_instructions(instructions);
+    CPU::Trap trap = Manager::start_execution();
+    // the moved block is still handed out, the old one isn't
+    std::cout << (int)trap.status << " " << (int)trap.fault << " " << (trap.address == CPU::_registers[CPU::br]) << " "
+              << (Heap::block_size(CPU::_registers[CPU::dr]) >= 100) << " " << Heap::block_size(CPU::_registers[CPU::br]) << std::endl;
+}
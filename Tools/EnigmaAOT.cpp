@@ -0,0 +1,27 @@
+#include "../Manager/EnigmaManager.hpp"
+#include "../Manager/EnigmaAOT.hpp"
+
+// TOOL: translates a program image[see Manager::save_image] to C++ ahead of time
+// usage: EnigmaAOT program.img program.cpp
+// then:  g++ -O2 -I<the VM's root> program.cpp -o program
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: " << argv[0] << " <image> <output.cpp>" << std::endl;
+        return 1;
+    }
+    if (!Manager::load_image(argv[1]))
+    {
+        std::cerr << "can't load the image " << argv[1] << std::endl;
+        return 1;
+    }
+    std::ofstream out(argv[2]);
+    if (!out || !AOT::emit(out, argv[1]))
+    {
+        std::cerr << "can't translate " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "../Manager/EnigmaManager.hpp"
+#include "../Manager/EnigmaDebugger.hpp"
+#include <iomanip>
+#include <sstream>
+
+// TOOL: debugs a program image[see Manager::save_image]
+// usage: EnigmaDebug program.img             the commands below on stdin
+//        EnigmaDebug program.img --gdb 1234  serve a gdb client on 127.0.0.1:1234 instead[target remote :1234]
+//
+// b <addr>      set a breakpoint         d <addr>          clear it
+// c             continue                 s                 step one instruction
+// r             the registers            x <addr> <len>    dump the data memory
+// i <addr> [n]  disassemble n instructions from addr[pc by default]
+// q             quit
+
+static void print_trap(const CPU::Trap &trap)
+{
+    switch (trap.status)
+    {
+    case CPU::BREAKPOINT:
+        std::cout << "stopped at 0x" << std::hex << CPU::_registers[CPU::pc] << ": " << Debugger::disassemble(CPU::_registers[CPU::pc]) << std::dec << std::endl;
+        break;
+    case CPU::HALTED:
+        std::cout << "halted, ar = " << CPU::_registers[CPU::ar] << std::endl;
+        break;
+    default:
+        std::cout << "faulted at 0x" << std::hex << trap.pc << " on 0x" << trap.address << std::dec << " kind " << (int)trap.fault << std::endl;
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && !(argc == 4 && std::string(argv[2]) == "--gdb"))
+    {
+        std::cerr << "usage: " << argv[0] << " <image> [--gdb <port>]" << std::endl;
+        return 1;
+    }
+    if (!Manager::load_image(argv[1]))
+    {
+        std::cerr << "can't load the image " << argv[1] << std::endl;
+        return 1;
+    }
+    if (argc == 4)
+    {
+        if (!Debugger::serve_gdb(std::stoi(argv[3])))
+        {
+            std::cerr << "can't listen on port " << argv[3] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    static const char *names[] = {"ar", "br", "cr", "dr", "er1", "er2", "er3", "er4", "sp", "pc"};
+    std::string line;
+    while (std::cout << "(enigma) " << std::flush, std::getline(std::cin, line))
+    {
+        std::istringstream in(line);
+        std::string command, a, b;
+        in >> command >> a >> b;
+        try
+        {
+            if (command == "b")
+                std::cout << (Debugger::set_breakpoint(std::stoull(a, nullptr, 0)) ? "set" : "no instruction there") << std::endl;
+            else if (command == "d")
+                std::cout << (Debugger::clear_breakpoint(std::stoull(a, nullptr, 0)) ? "cleared" : "no breakpoint there") << std::endl;
+            else if (command == "c")
+                print_trap(Debugger::resume());
+            else if (command == "s")
+                print_trap(Debugger::step());
+            else if (command == "r")
+            {
+                for (qword i = 0; i < CPU::regr_count; i++)
+                    std::cout << std::setw(4) << names[i] << " 0x" << std::hex << CPU::_registers[i] << std::dec << std::endl;
+            }
+            else if (command == "x")
+            {
+                std::vector<byte> bytes;
+                qword address = std::stoull(a, nullptr, 0);
+                if (!Debugger::read_memory(address | Debugger::DATA_SPACE, b.empty() ? 8 : std::stoull(b, nullptr, 0), bytes))
+                {
+                    std::cout << "not in the data memory" << std::endl;
+                    continue;
+                }
+                for (std::size_t i = 0; i < bytes.size(); i++)
+                {
+                    if (i % 16 == 0)
+                        std::cout << (i ? "\n" : "") << "0x" << std::hex << address + i << ":";
+                    std::cout << " " << std::setw(2) << std::setfill('0') << (int)bytes[i] << std::setfill(' ');
+                }
+                std::cout << std::dec << std::endl;
+            }
+            else if (command == "i")
+            {
+                qword address = a.empty() ? CPU::_registers[CPU::pc] : std::stoull(a, nullptr, 0);
+                for (qword n = b.empty() ? 8 : std::stoull(b, nullptr, 0); n > 0; n--)
+                {
+                    std::string text = Debugger::disassemble(address);
+                    if (text.empty())
+                        break;
+                    std::cout << (Debugger::breakpoints.count(address) ? "*" : " ") << " 0x" << std::hex << address << std::dec << ": " << text << std::endl;
+                    address += ISA::length(CPU::instruction_memory.mem_read64(address));
+                }
+            }
+            else if (command == "q")
+                break;
+            else if (!command.empty())
+                std::cout << "unknown command " << command << std::endl;
+        }
+        catch (const std::exception &)
+        {
+            std::cout << "bad number" << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef ENIGMA_BUS
+#define ENIGMA_BUS
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+/*
+The device bus of a memory. Devices are mapped at MMIO_BASE and up, far above anything the memory itself can ever
+grow to, so an access only gets to the bus once it has already failed the memory's bounds check: programs that
+don't touch a device pay nothing for the bus being there. On the bus, a single compare against the range covering
+all of the devices settles accesses that don't hit any of them.
+
+A device either has a buffer that the accesses go straight to[bytes in the same big endian order as the memory]
+or read and write callbacks that get the offset into the device and the width of the access.
+*/
+
+#ifndef MMIO_BASE
+#define MMIO_BASE 0x10000000000000
+#endif
+
+struct Device
+{
+  std::uint64_t base;
+  std::uint64_t length;
+  std::uint8_t *buffer; // nullptr if the callbacks handle the accesses
+  std::function<std::uint64_t(std::uint64_t offset, std::uint8_t width)> read;
+  std::function<void(std::uint64_t offset, std::uint8_t width, std::uint64_t value)> write;
+  std::shared_ptr<void> owner; // keeps what the buffer points into alive for as long as the device is mapped
+};
+
+class Bus
+{
+public:
+  // returns false if the device overlaps one that is already mapped or is below MMIO_BASE
+  bool map(const Device &device);
+
+  // the device that all of [address, address + width) falls in or nullptr
+  Device *find(std::uint64_t address, std::uint64_t width);
+
+private:
+  std::vector<Device> devices;
+  std::uint64_t low = UINT64_MAX; // the range covering every device
+  std::uint64_t high = 0;
+};
+
+bool Bus::map(const Device &device)
+{
+  if (device.base < MMIO_BASE || device.length == 0 || device.base + device.length < device.base)
+    return false;
+  for (auto &mapped : devices)
+  {
+    if (device.base < mapped.base + mapped.length && mapped.base < device.base + device.length)
+      return false;
+  }
+  devices.push_back(device);
+  low = device.base < low ? device.base : low;
+  high = device.base + device.length > high ? device.base + device.length : high;
+  return true;
+}
+
+Device *Bus::find(std::uint64_t address, std::uint64_t width)
+{
+  if (address < low || address >= high)
+    return nullptr;
+  for (auto &device : devices)
+  {
+    if (address >= device.base && address - device.base < device.length && device.length - (address - device.base) >= width)
+      return &device;
+  }
+  return nullptr;
+}
+
+#endif
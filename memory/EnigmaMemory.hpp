@@ -2,15 +2,28 @@
 #define ENIGMA_MEMORY
 
 /*
-This module itself is allowed to stop execution completely without the VM knowing.
-It can abort or exit the program entirely.
-It will display necessary error messages before exiting.
+This module reports every bad access or resize as a fault through fault_handler.
+While a program is running, the CPU installs its handler which stops the dispatch loop and records the fault so
+the host can look at it and carry on. Without a handler, it displays the error message and exits like before.
+After a fault, reads give 0 and writes and resizes are dropped.
+The fault handler is per thread since every hart runs its own dispatch loop[see CPU/EnigmaHarts.hpp].
+
+A Memory is a handle to its storage, copies of it share the same bytes but the limits are every handle's own, a
+guest raising the upper limit of its memory raises it for nobody else. That's how the harts of a VM share its
+memories while every VM running in the process has memories of its own. The devices mapped on a memory are shared
+the same way.
 */
 
 #include <vector>
 #include <cstdint>
 #include <iostream>
 #include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include "EnigmaBus.hpp"
+#include "EnigmaSpan.hpp"
+#include "EnigmaPages.hpp"
 
 typedef std::uint8_t byte;
 typedef std::uint16_t word;
@@ -29,7 +42,67 @@ typedef std::uint64_t qword;
 
 #define BIN_MAX 0b1111111111111111111111111111111111111111111111111111111111111111
 
-static qword max_memory_length = 524288;
+// the upper limit every memory starts with, each one raises its own[see Memory::increase_upper_limit]
+static const qword max_memory_length = 524288;
+
+// the faults a guest can cause
+enum FaultKind : byte
+{
+  NO_FAULT,
+  OUT_OF_BOUNDS,   // accessing memory beyond the pointer limit
+  LIMIT_EXCEEDED,  // growing the memory beyond its upper limit
+  STACK_OVERFLOW,
+  STACK_UNDERFLOW,
+  DIVIDE_BY_ZERO,
+  BAD_OPERAND,     // an operand the instruction or syscall can't work with
+  MISALIGNED,      // an atomic access to a word that isn't 8 byte aligned
+};
+
+typedef void (*FaultHandler)(FaultKind kind, qword address);
+
+static thread_local FaultHandler fault_handler = nullptr;
+
+// called right before the storage of any memory is resized and right after, on the thread resizing it and with
+// the storage it's about. The pages at its end come and go and growing past its reservation moves it[see
+// memory/EnigmaPages.hpp], the watchpoints take their page protection off and put it back on wherever it is now
+// with it when it's the storage they're on[see Manager/EnigmaWatch.hpp]
+typedef void (*ResizeHook)(const Region *storage, bool resized);
+
+static std::atomic<ResizeHook> resize_hook{nullptr};
+
+static void raise_fault(FaultKind kind, qword address)
+{
+  if (fault_handler != nullptr)
+  {
+    fault_handler(kind, address);
+    return;
+  }
+  switch (kind)
+  {
+  case OUT_OF_BOUNDS:
+    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
+    break;
+  case LIMIT_EXCEEDED:
+    std::cerr << "Memory expansion requested exceeding the upper limit. The memory would be " << address << " bytes" << std::endl;
+    break;
+  case STACK_OVERFLOW:
+    std::cerr << "Stack overflow." << std::endl;
+    break;
+  case STACK_UNDERFLOW:
+    std::cerr << "Stack underflow." << std::endl;
+    break;
+  case DIVIDE_BY_ZERO:
+    std::cerr << "Division by zero." << std::endl;
+    break;
+  case MISALIGNED:
+    std::cerr << "Misaligned atomic access." << std::endl;
+    break;
+  default:
+    std::cerr << "Bad operand." << std::endl;
+    break;
+  }
+  exit(-1);
+}
 
 class Memory
 {
@@ -46,177 +119,497 @@ public:
   qword mem_read16(qword address);
   qword mem_read8(qword address);
 
-  void resize(word __new_size);
+  // these skip the bounds check and must only be used for accesses that have been proven to be in bounds
+  void mem_write64_unchecked(qword address, qword value);
+  void mem_write32_unchecked(qword address, qword value);
+  void mem_write16_unchecked(qword address, qword value);
+  void mem_write8_unchecked(qword address, qword value);
+
+  qword mem_read64_unchecked(qword address);
+  qword mem_read32_unchecked(qword address);
+  qword mem_read16_unchecked(qword address);
+  qword mem_read8_unchecked(qword address);
+
+  // atomic accesses to an aligned 64-bit word, the value is big endian just like mem_read64 so both can be mixed
+  // cas returns the old value, desired was written only if that is expected
+  qword mem_cas64(qword address, qword expected, qword desired);
+  qword mem_fetch_add64(qword address, qword value);
+  qword mem_exchange64(qword address, qword value);
 
-  void pointer_limit_increase(word __increase_by);
+  // the bytes [address, address + length) to copy in or out of in one go, raises the fault and returns nullptr
+  // if they aren't all there. The pointer is good until the memory shrinks past it
+  byte *mem_span(qword address, qword length);
 
+  // returns true if [address, address + width) doesn't fit below the pointer limit
+  bool out_of_bounds(qword address, qword width) { return address >= pointer_limit || pointer_limit - address < width; }
+
+  // the number of bytes that can safely be accessed: the pointer limit unless the storage is smaller
+  std::size_t safe_size() { return pointer_limit < storage->size() ? pointer_limit : storage->size(); }
+
+  void resize(qword __new_size);
+
+  void pointer_limit_increase(qword __increase_by);
+
+  // the limit is the handle's own like the pointer limit, a copy starts with the one of the handle it's copied from
   void increase_upper_limit(qword __increase_by);
+  std::size_t upper_limit() { return max_length; }
 
   std::size_t current_size() { return pointer_limit; }
 
   void add_size(qword size_to_add);
 
+  // put the storage on huge pages or take it off them, for all the copies like the storage. Returns the kind it
+  // got and huge_page_bytes how much of it the host has on them right now[see memory/EnigmaPages.hpp]
+  HugePages use_huge_pages(HugePages kind) { return storage->use_huge_pages(kind); }
+  std::size_t huge_page_bytes() { return storage->huge_page_bytes(); }
+  bool has_explicit_huge_pages() { return storage->has_explicit_pages(); }
+
+  // the storage the handle is on, the same for all of its copies
+  const Region *region() const { return storage.get(); }
+
+  // keep the storage on the NUMA node, false if the host can't[see memory/EnigmaPages.hpp]
+  bool prefer_node(int node) { return storage->prefer_node(node); }
+
+  // a handle to a copy of the bytes that can never be written or resized again, for sharing between VMs
+  Memory frozen_copy();
+
+  // a frozen memory over size bytes of the file from offset, mapped and not read in[see memory/EnigmaPages.hpp]
+  // returns false and leaves the memory as it was if the file can't be mapped
+  bool map_file(int fd, qword offset, qword size);
+  bool frozen() { return storage->frozen(); }
+
+  // swap frozen storage for a writable copy of it that's this handle's own, the other handles keep the frozen one
+  void unshare();
+
+  // map a device on the bus of this memory, shared by its copies like the storage[see memory/EnigmaBus.hpp]
+  bool map_device(const Device &device);
+
 private:
-  std::vector<std::uint8_t> memory;
+  Memory(std::shared_ptr<Region> storage, qword pointer_limit, qword max_length) : storage(storage), pointer_limit(pointer_limit), max_length(max_length) {}
+
+  // a new storage with the same bytes
+  std::shared_ptr<Region> copy_storage();
+
+  std::shared_ptr<Region> storage;
+  std::shared_ptr<Bus> bus; // nullptr until a device is mapped
+
+  // the accesses that failed the bounds check, they fault unless they hit a device
+  qword device_read(qword address, byte width);
+  void device_write(qword address, byte width, qword value);
+
+  // raises the fault and returns nullptr if the word can't be accessed atomically
+  qword *atomic_word(qword address);
+
+  // every resize of the storage goes through here for the resize hook, raises the fault if it can't be done
+  bool resize_storage(qword size);
 
   qword pointer_limit;
+  qword max_length = max_memory_length; // how far the memory may grow
 };
 
 Memory::Memory()
 {
-  memory.resize(MEM_SIZE);
+  storage = std::make_shared<Region>(MEM_SIZE, max_length);
   pointer_limit = MEM_SIZE;
 }
 
 void Memory::mem_write64(qword address, qword value)
 {
-  if (address + 7 >= pointer_limit)
+  if (out_of_bounds(address, 8))
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    device_write(address, 8, value);
+    return;
   }
-  std::uint32_t shift_by = 56;
-  for (std::uint32_t i = 0; i < 8; i++)
+  mem_write64_unchecked(address, value);
+}
+
+void Memory::mem_write32(qword address, qword value)
+{
+  if (out_of_bounds(address, 4))
   {
-    memory[i + address] = (value >> shift_by) & GET_BYTE;
-    shift_by -= 8;
+    device_write(address, 4, value);
+    return;
   }
+  mem_write32_unchecked(address, value);
 }
 
-void Memory::mem_write32(qword address, qword value)
+void Memory::mem_write16(qword address, qword value)
 {
-  if (address + 3 >= pointer_limit)
+  if (out_of_bounds(address, 2))
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    device_write(address, 2, value);
+    return;
   }
-  std::uint32_t shift_by = 24;
-  for (std::uint32_t i = 0; i < 4; i++)
+  mem_write16_unchecked(address, value);
+}
+
+void Memory::mem_write8(qword address, qword value)
+{
+  if (out_of_bounds(address, 1))
   {
-    memory[i + address] = (value >> shift_by) & GET_BYTE;
-    shift_by -= 8;
+    device_write(address, 1, value);
+    return;
   }
+  mem_write8_unchecked(address, value);
 }
 
-void Memory::mem_write16(qword address, qword value)
+qword Memory::mem_read64(qword address)
+{
+  if (out_of_bounds(address, 8))
+    return device_read(address, 8);
+  return mem_read64_unchecked(address);
+}
+
+qword Memory::mem_read32(qword address)
+{
+  if (out_of_bounds(address, 4))
+    return device_read(address, 4);
+  return mem_read32_unchecked(address);
+}
+
+qword Memory::mem_read16(qword address)
+{
+  if (out_of_bounds(address, 2))
+    return device_read(address, 2);
+  return mem_read16_unchecked(address);
+}
+
+qword Memory::mem_read8(qword address)
+{
+  if (out_of_bounds(address, 1))
+    return device_read(address, 1);
+  return mem_read8_unchecked(address);
+}
+
+// the words are stored big endian, the atomics work on them in the host's order
+static qword host_order(qword value)
 {
-  if (address + 1 >= pointer_limit)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(value);
+#else
+  return value;
+#endif
+}
+
+// a whole run of values into and out of guest order at once, a plain copy for bytes
+// the byte swaps are in a loop of their own so the compiler can vectorise it
+template <typename T>
+static void copy_to_guest(byte *to, const T *from, std::size_t count)
+{
+  if constexpr (sizeof(T) == 1)
+    std::memcpy(to, from, count);
+  else
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    for (std::size_t i = 0; i < count; i++)
+    {
+      T value = from[i];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if constexpr (sizeof(T) == 2)
+        value = __builtin_bswap16(value);
+      else if constexpr (sizeof(T) == 4)
+        value = __builtin_bswap32(value);
+      else
+        value = __builtin_bswap64(value);
+#endif
+      std::memcpy(to + i * sizeof(T), &value, sizeof(T));
+    }
   }
-  std::uint32_t shift_by = 8;
-  for (std::uint32_t i = 0; i < 2; i++)
+}
+
+template <typename T>
+static void copy_from_guest(T *to, const byte *from, std::size_t count)
+{
+  if constexpr (sizeof(T) == 1)
+    std::memcpy(to, from, count);
+  else
   {
-    memory[i + address] = (value >> shift_by) & GET_BYTE;
-    shift_by -= 8;
+    for (std::size_t i = 0; i < count; i++)
+    {
+      T value;
+      std::memcpy(&value, from + i * sizeof(T), sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if constexpr (sizeof(T) == 2)
+        value = __builtin_bswap16(value);
+      else if constexpr (sizeof(T) == 4)
+        value = __builtin_bswap32(value);
+      else
+        value = __builtin_bswap64(value);
+#endif
+      to[i] = value;
+    }
   }
 }
 
-void Memory::mem_write8(qword address, qword value)
+byte *Memory::mem_span(qword address, qword length)
 {
-  if (address + 1 >= pointer_limit)
+  if (out_of_bounds(address, length) || address + length > storage->size())
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    // a device with a buffer can be copied in and out of just like the memory
+    Device *device = bus == nullptr ? nullptr : bus->find(address, length);
+    if (device != nullptr && device->buffer != nullptr)
+      return device->buffer + (address - device->base);
+    raise_fault(OUT_OF_BOUNDS, address);
+    return nullptr;
   }
-  memory[address] = (value & 255);
+  return storage->data() + address;
 }
 
-qword Memory::mem_read64(qword address)
+bool Memory::map_device(const Device &device)
 {
-  if (address + 8 >= pointer_limit)
+  if (bus == nullptr)
+    bus = std::make_shared<Bus>();
+  return bus->map(device);
+}
+
+qword Memory::device_read(qword address, byte width)
+{
+  Device *device = bus == nullptr ? nullptr : bus->find(address, width);
+  if (device == nullptr)
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    raise_fault(OUT_OF_BOUNDS, address);
+    return 0;
   }
+  qword offset = address - device->base;
+  if (device->buffer == nullptr)
+    return device->read ? device->read(offset, width) : 0;
   qword output = 0;
+  for (byte i = 0; i < width; i++)
+    output = (output << 8) | device->buffer[offset + i];
+  return output;
+}
+
+void Memory::device_write(qword address, byte width, qword value)
+{
+  Device *device = bus == nullptr ? nullptr : bus->find(address, width);
+  if (device == nullptr)
+  {
+    raise_fault(OUT_OF_BOUNDS, address);
+    return;
+  }
+  qword offset = address - device->base;
+  if (device->buffer == nullptr)
+  {
+    if (device->write)
+      device->write(offset, width, value);
+    return;
+  }
+  for (byte i = width; i > 0; i--, value >>= 8)
+    device->buffer[offset + i - 1] = value & GET_BYTE;
+}
+
+qword *Memory::atomic_word(qword address)
+{
+  if (out_of_bounds(address, 8) || address + 8 > storage->size())
+  {
+    raise_fault(OUT_OF_BOUNDS, address);
+    return nullptr;
+  }
+  // the storage itself is always aligned to more than 8 bytes
+  if ((address & 7) != 0)
+  {
+    raise_fault(MISALIGNED, address);
+    return nullptr;
+  }
+  return reinterpret_cast<qword *>(storage->data() + address);
+}
+
+// std::atomic_ref where the library has it[C++20], the builtins it is made of otherwise
+#ifdef __cpp_lib_atomic_ref
+#define ATOMIC_CAS(word, expected, desired) std::atomic_ref<qword>(*(word)).compare_exchange_strong(expected, desired)
+#define ATOMIC_LOAD(word) std::atomic_ref<qword>(*(word)).load()
+#define ATOMIC_EXCHANGE(word, value) std::atomic_ref<qword>(*(word)).exchange(value)
+#else
+#define ATOMIC_CAS(word, expected, desired) __atomic_compare_exchange_n(word, &(expected), desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(word) __atomic_load_n(word, __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE(word, value) __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST)
+#endif
+
+qword Memory::mem_cas64(qword address, qword expected, qword desired)
+{
+  qword *word = atomic_word(address);
+  if (word == nullptr)
+    return 0;
+  qword old = host_order(expected);
+  ATOMIC_CAS(word, old, host_order(desired));
+  return host_order(old);
+}
+
+qword Memory::mem_fetch_add64(qword address, qword value)
+{
+  qword *word = atomic_word(address);
+  if (word == nullptr)
+    return 0;
+  // the add has to carry across the bytes in guest order, so it is a cas loop on little endian hosts
+  qword old = ATOMIC_LOAD(word);
+  while (!ATOMIC_CAS(word, old, host_order(host_order(old) + value)))
+    ;
+  return host_order(old);
+}
+
+qword Memory::mem_exchange64(qword address, qword value)
+{
+  qword *word = atomic_word(address);
+  if (word == nullptr)
+    return 0;
+  return host_order(ATOMIC_EXCHANGE(word, host_order(value)));
+}
+
+void Memory::mem_write64_unchecked(qword address, qword value)
+{
+  std::uint32_t shift_by = 56;
   for (std::uint32_t i = 0; i < 8; i++)
   {
-    output = (output << 8) | memory[i + address];
+    (*storage)[i + address] = (value >> shift_by) & GET_BYTE;
+    shift_by -= 8;
   }
-  return output;
 }
 
-qword Memory::mem_read32(qword address)
+void Memory::mem_write32_unchecked(qword address, qword value)
 {
+  std::uint32_t shift_by = 24;
+  for (std::uint32_t i = 0; i < 4; i++)
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    (*storage)[i + address] = (value >> shift_by) & GET_BYTE;
+    shift_by -= 8;
+  }
+}
+
+void Memory::mem_write16_unchecked(qword address, qword value)
+{
+  std::uint32_t shift_by = 8;
+  for (std::uint32_t i = 0; i < 2; i++)
+  {
+    (*storage)[i + address] = (value >> shift_by) & GET_BYTE;
+    shift_by -= 8;
   }
+}
+
+void Memory::mem_write8_unchecked(qword address, qword value)
+{
+  (*storage)[address] = (value & 255);
+}
+
+qword Memory::mem_read64_unchecked(qword address)
+{
   qword output = 0;
-  for (std::uint32_t i = 0; i < 4; i++)
+  for (std::uint32_t i = 0; i < 8; i++)
   {
-    output = (output << 8) | memory[i + address];
+    output = (output << 8) | (*storage)[i + address];
   }
   return output;
 }
 
-qword Memory::mem_read16(qword address)
+qword Memory::mem_read32_unchecked(qword address)
 {
-  if (address + 1 >= pointer_limit)
+  qword output = 0;
+  for (std::uint32_t i = 0; i < 4; i++)
   {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
+    output = (output << 8) | (*storage)[i + address];
   }
-  qword output;
+  return output;
+}
+
+qword Memory::mem_read16_unchecked(qword address)
+{
+  qword output = 0;
   for (std::uint32_t i = 0; i < 2; i++)
   {
-    output = (output << 8) | memory[i + address];
+    output = (output << 8) | (*storage)[i + address];
   }
   return output;
 }
 
-qword Memory::mem_read8(qword address)
+qword Memory::mem_read8_unchecked(qword address)
 {
-  if (address >= pointer_limit)
-  {
-    std::cerr << "Segmentation fault. Accessing out of bounds memory." << std::endl;
-    exit(-1);
-  }
-  qword output = memory[address];
+  qword output = (*storage)[address];
   return output;
 }
 
-void Memory::resize(word __new_size)
+void Memory::resize(qword __new_size)
 {
-  if (__new_size > max_memory_length)
+  if (__new_size > max_length)
   {
-    std::cerr << "Memory expansion requested exceeding the upper limit" << std::endl;
-    exit(-1);
+    raise_fault(LIMIT_EXCEEDED, __new_size);
+    return;
   }
-  memory.resize(__new_size);
+  resize_storage(__new_size);
 }
 
-void Memory::pointer_limit_increase(word __increase_by)
+void Memory::pointer_limit_increase(qword __increase_by)
 {
-  if (pointer_limit + __increase_by > max_memory_length)
+  if (pointer_limit + __increase_by > max_length || pointer_limit + __increase_by < pointer_limit)
   {
-    std::cerr << "Error increasing the pointer limit[Increasing above the limit]. max_memory_length is " << max_memory_length << std::endl;
-    exit(-1);
+    raise_fault(LIMIT_EXCEEDED, pointer_limit + __increase_by);
+    return;
   }
   pointer_limit += __increase_by;
 }
 
 void Memory::increase_upper_limit(qword __increase_by)
 {
-  if (max_memory_length + __increase_by > 1073741824)
+  if (max_length + __increase_by > MEMORY_RESERVE || max_length + __increase_by < max_length)
   {
-    std::cerr << "Increasing memory by leaps and bounds" << std::endl;
-    exit(-1);
+    raise_fault(LIMIT_EXCEEDED, max_length + __increase_by);
+    return;
   }
-  max_memory_length += __increase_by;
+  max_length += __increase_by;
+  // only a head start, a storage that can't be extended where it is moves when it grows into the new room
+  if (!storage->frozen())
+    storage->reserve(max_length);
 }
 
 void Memory::add_size(qword size_to_add)
 {
-  if (pointer_limit + size_to_add > max_memory_length)
+  if (pointer_limit + size_to_add > max_length || pointer_limit + size_to_add < pointer_limit)
   {
-    std::cerr << "Error increasing the pointer limit. max_memory_length is " << max_memory_length << std::endl;
-    exit(-1);
+    raise_fault(LIMIT_EXCEEDED, pointer_limit + size_to_add);
+    return;
   }
-  pointer_limit += size_to_add;
-  memory.resize(pointer_limit);
+  if (resize_storage(pointer_limit + size_to_add))
+    pointer_limit += size_to_add;
+}
+
+std::shared_ptr<Region> Memory::copy_storage()
+{
+  std::shared_ptr<Region> copy = std::make_shared<Region>(storage->size(), max_length);
+  std::memcpy(copy->data(), storage->data(), storage->size());
+  return copy;
+}
+
+Memory Memory::frozen_copy()
+{
+  std::shared_ptr<Region> copy = copy_storage();
+  copy->freeze();
+  return Memory(copy, pointer_limit, max_length);
+}
+
+bool Memory::map_file(int fd, qword offset, qword size)
+{
+  std::shared_ptr<Region> mapped = Region::map_file(fd, offset, size);
+  if (mapped == nullptr)
+    return false;
+  storage = mapped;
+  pointer_limit = size;
+  return true;
+}
+
+void Memory::unshare()
+{
+  if (storage->frozen())
+    storage = copy_storage();
+}
+
+bool Memory::resize_storage(qword size)
+{
+  ResizeHook hook = resize_hook.load();
+  if (hook != nullptr)
+    hook(storage.get(), false);
+  bool resized = storage->resize(size);
+  if (hook != nullptr)
+    hook(storage.get(), true);
+  if (!resized)
+    raise_fault(LIMIT_EXCEEDED, size);
+  return resized;
 }
 
 #endif
\ No newline at end of file
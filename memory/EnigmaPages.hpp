@@ -0,0 +1,470 @@
+#ifndef ENIGMA_PAGES
+#define ENIGMA_PAGES
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+The storage of a memory: address space for the biggest the memory is allowed to get[its upper limit] is
+reserved when it's made and pages are committed at the end of it as it grows. Growing within the reservation costs
+only the new pages and nothing is copied. The pages are the storage's own, they can be protected or advised
+without touching anything else the host has on the heap[see Manager/EnigmaWatch.hpp].
+
+A reservation is only address space but a host limits how much of it a process gets, so a memory only reserves
+what it may need, never more than MEMORY_RESERVE, and thousands of them fit. Growing past the reservation first
+tries to extend it in place and only if something else is mapped right after it does the region move to a bigger
+reservation somewhere else, the committed bytes are copied over. So pointers into a memory stay good until it
+grows past its reservation, that only happens on a resize and the resize hook of the memory is called around
+every one[see memory/EnigmaMemory.hpp]. The memory faults with LIMIT_EXCEEDED if the host won't give it the room.
+
+A big memory read at random misses the host TLB on most accesses, so a region can be put on huge pages. The
+reservation always starts on a HUGE_PAGE_SIZE boundary and while huge pages are on it's committed a whole huge page
+at a time. Transparent ones are only asked for with madvise, the kernel backs what it can when the pages are first
+touched and khugepaged collapses what was touched before later on. Explicit ones come from the hugetlbfs pool
+which has to be set up on the host[vm.nr_hugepages], every huge page of the region is mapped from it when it is
+committed and once the pool runs dry the rest of the region is transparent. What the host actually gave is only
+known from /proc/self/smaps, huge_page_bytes reads it. A watchpoint splits the transparent huge page it is on and
+can't protect an explicit one at all, it isn't added on a region that has any[see Manager/EnigmaWatch.hpp].
+
+A region can prefer a NUMA node, the whole reservation gets the policy so the pages committed later land there too
+and the ones it already has are moved[see Manager/EnigmaNuma.hpp].
+
+A frozen region is read only for good, what's left of its reservation is given back and it can't be resized,
+advised or moved to another node. That's how a program is shared between VMs, none of them can write to it and
+the host faults if it tries to[see Manager/EnigmaAnalysis.hpp]. A region mapped from a file is frozen from the
+start and the file is only read as its pages are touched[see Manager/EnigmaCache.hpp].
+*/
+
+#ifndef MEMORY_RESERVE
+#define MEMORY_RESERVE (1UL << 33) // 8 GiB
+#endif
+
+#define HUGE_PAGE_SIZE (1UL << 21)
+
+enum HugePages : std::uint8_t
+{
+  NO_HUGE_PAGES,
+  TRANSPARENT_HUGE_PAGES,
+  EXPLICIT_HUGE_PAGES,
+};
+
+inline std::size_t host_page_size()
+{
+  static const std::size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+inline std::size_t round_to_pages(std::size_t bytes, std::size_t page = host_page_size())
+{
+  return (bytes + page - 1) / page * page;
+}
+
+// the kernel hands out transparent huge pages to the regions that ask for them
+inline bool transparent_huge_pages_available()
+{
+#ifdef MADV_HUGEPAGE
+  std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string setting;
+  std::getline(enabled, setting);
+  return !setting.empty() && setting.find("[never]") == std::string::npos;
+#else
+  return false;
+#endif
+}
+
+// the huge pages of HUGE_PAGE_SIZE left in the hugetlbfs pool
+inline std::size_t explicit_huge_pages_free()
+{
+#ifdef MAP_HUGETLB
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  std::size_t free = 0, size = 0;
+  while (std::getline(meminfo, line))
+  {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+    if (key == "HugePages_Free:")
+      fields >> free;
+    else if (key == "Hugepagesize:")
+      fields >> size;
+  }
+  return size * 1024 == HUGE_PAGE_SIZE ? free : 0;
+#else
+  return 0;
+#endif
+}
+
+class Region
+{
+public:
+  // reserve room for reserve bytes[at least size, at most MEMORY_RESERVE unless size is more] and commit size bytes,
+  // all zero
+  explicit Region(std::size_t size, std::size_t reserve = 0);
+  ~Region();
+
+  // a frozen region over size bytes of the file from offset[a multiple of the page size], nullptr if it can't be
+  // mapped. The file can be closed once it's made
+  static std::shared_ptr<Region> map_file(int fd, std::size_t offset, std::size_t size);
+
+  Region(const Region &) = delete;
+  Region &operator=(const Region &) = delete;
+
+  std::uint8_t *data() { return base; }
+  std::size_t size() const { return length; }
+  std::size_t reserved() const { return reservation; }
+  std::uint8_t &operator[](std::size_t i) { return base[i]; }
+
+  // grow or shrink, bytes past the old size read zero. Growing past the reservation extends it or moves the
+  // region, false if the host has no room for it
+  bool resize(std::size_t size);
+
+  // extend the reservation to size bytes where it is, false if something else is mapped there. Nothing moves
+  bool reserve(std::size_t size);
+
+  // put the region on huge pages from now on or take it off them, returns the kind it got: explicit falls back to
+  // transparent when the pool is empty and transparent to none when the kernel has them off
+  HugePages use_huge_pages(HugePages kind);
+  HugePages huge_pages() const { return huge; }
+
+  // the committed bytes the host has on huge pages right now
+  std::size_t huge_page_bytes() const;
+
+  // some of the pages came from the hugetlbfs pool, they can only be protected a whole huge page at a time
+  bool has_explicit_pages() const { return explicit_pages; }
+
+  // keep the pages on the NUMA node from now on and move the ones already elsewhere, -1 for wherever they're
+  // touched first again, false if the host can't
+  bool prefer_node(int node);
+
+  // make the region read only for good
+  void freeze();
+  bool frozen() const { return is_frozen; }
+
+private:
+  Region() = default;
+
+  std::uint8_t *base = nullptr;
+  std::size_t length = 0;
+  std::size_t committed = 0; // the bytes from base that are readable and writable, whole pages
+  std::size_t reservation = 0;
+  HugePages huge = NO_HUGE_PAGES;
+  int node = -1; // the NUMA node the pages are kept on, -1 for wherever they're first touched
+  bool is_frozen = false;
+  bool explicit_pages = false; // map_explicit got one from the pool, for good since nothing tells when it's gone
+
+  // what is committed at a time, a whole huge page while they're on
+  std::size_t granule() const { return huge == NO_HUGE_PAGES ? host_page_size() : HUGE_PAGE_SIZE; }
+
+  bool commit(std::size_t size);
+
+  // move to a fresh reservation of size bytes with the same pages and settings, false if there's no room for it
+  bool move(std::size_t size);
+
+  // map the huge page at offset from the pool, false if the pool has none left
+  bool map_explicit(std::size_t offset);
+
+  // hand the pages from offset to the end of what's committed back to the reservation
+  void release(std::size_t offset);
+
+  // give [offset, offset + size) the node's policy, a fresh mapping over part of the region starts without one
+  bool apply_node(std::size_t offset, std::size_t size, unsigned flags);
+};
+
+// address space for size bytes starting on a huge page boundary, nullptr if the host won't give it
+static std::uint8_t *reserve_address_space(std::size_t size)
+{
+  // a huge page more than needed so the start can be moved up to a huge page boundary
+  void *pointer = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pointer == MAP_FAILED)
+    return nullptr;
+  std::uint8_t *start = static_cast<std::uint8_t *>(pointer);
+  std::uint8_t *base = reinterpret_cast<std::uint8_t *>(round_to_pages(reinterpret_cast<std::size_t>(start), HUGE_PAGE_SIZE));
+  if (base != start)
+    munmap(start, base - start);
+  munmap(base + size, start + HUGE_PAGE_SIZE - base);
+  return base;
+}
+
+Region::Region(std::size_t size, std::size_t reserve)
+{
+  std::size_t want = reserve < MEMORY_RESERVE ? reserve : MEMORY_RESERVE;
+  want = round_to_pages(want > size ? want : size, HUGE_PAGE_SIZE);
+  // the limit is only what the memory may grow to, a host short on address space gets away with what's needed now
+  std::size_t least = round_to_pages(size > 1 ? size : 1, HUGE_PAGE_SIZE);
+  for (reservation = want; base == nullptr; reservation = reservation / 2 > least ? reservation / 2 : least)
+  {
+    base = reserve_address_space(reservation);
+    if (reservation == least)
+      break;
+  }
+  if (base == nullptr || !resize(size))
+    throw std::bad_alloc();
+}
+
+std::shared_ptr<Region> Region::map_file(int fd, std::size_t offset, std::size_t size)
+{
+  if (size == 0 || offset % host_page_size() != 0)
+    return nullptr;
+  void *pointer = mmap(nullptr, round_to_pages(size), PROT_READ, MAP_PRIVATE, fd, offset);
+  if (pointer == MAP_FAILED)
+    return nullptr;
+  std::shared_ptr<Region> region(new Region());
+  region->base = static_cast<std::uint8_t *>(pointer);
+  region->length = size;
+  region->committed = region->reservation = round_to_pages(size);
+  region->is_frozen = true;
+  return region;
+}
+
+Region::~Region()
+{
+  if (base != nullptr)
+    munmap(base, reservation);
+}
+
+bool Region::resize(std::size_t size)
+{
+  if (is_frozen)
+    return false;
+  if (size > reservation && !reserve(size))
+  {
+    // at least twice the room so a memory growing a bit at a time doesn't move every time
+    std::size_t room = reservation * 2 > size ? reservation * 2 : size;
+    if (room > MEMORY_RESERVE && size <= MEMORY_RESERVE)
+      room = MEMORY_RESERVE;
+    if (!move(round_to_pages(room, HUGE_PAGE_SIZE)))
+      return false;
+  }
+  std::size_t pages = round_to_pages(size, granule());
+  if (pages > reservation)
+    pages = reservation;
+  if (pages > committed)
+  {
+    if (!commit(pages))
+      return false;
+  }
+  else if (size < length)
+  {
+    // what's past the size is always zero, the pages let go of come back zeroed and the rest is done by hand
+    std::memset(base + size, 0, (length < pages ? length : pages) - size);
+    if (pages < committed)
+      release(pages);
+  }
+  length = size;
+  return true;
+}
+
+bool Region::commit(std::size_t size)
+{
+  while (committed < size)
+  {
+    std::size_t next = size;
+    if (huge == EXPLICIT_HUGE_PAGES)
+    {
+      if (committed % HUGE_PAGE_SIZE == 0 && committed + HUGE_PAGE_SIZE <= size && map_explicit(committed))
+      {
+        committed += HUGE_PAGE_SIZE;
+        continue;
+      }
+      // up to the next huge page boundary, the pool gets another go there unless it ran dry
+      std::size_t boundary = round_to_pages(committed + 1, HUGE_PAGE_SIZE);
+      next = boundary < size ? boundary : size;
+    }
+    if (mprotect(base + committed, next - committed, PROT_READ | PROT_WRITE) != 0)
+      return false;
+    committed = next;
+  }
+  return true;
+}
+
+bool Region::reserve(std::size_t size)
+{
+  size = round_to_pages(size, HUGE_PAGE_SIZE);
+  if (size <= reservation)
+    return true;
+  if (is_frozen)
+    return false;
+  std::size_t more = size - reservation;
+#ifdef MAP_FIXED_NOREPLACE
+  void *pointer = mmap(base + reservation, more, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+#else
+  void *pointer = mmap(base + reservation, more, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+  // kernels older than the flag take the address as a hint and map it anywhere
+  if (pointer != base + reservation)
+  {
+    if (pointer != MAP_FAILED)
+      munmap(pointer, more);
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge != NO_HUGE_PAGES)
+    madvise(base + reservation, more, MADV_HUGEPAGE);
+#endif
+  apply_node(reservation, more, 0);
+  reservation = size;
+  return true;
+}
+
+bool Region::move(std::size_t size)
+{
+  std::uint8_t *fresh = reserve_address_space(size);
+  if (fresh == nullptr)
+    return false;
+  std::uint8_t *old = base;
+  std::size_t old_committed = committed, old_reservation = reservation;
+  HugePages old_huge = huge;
+  base = fresh;
+  reservation = size;
+  committed = 0;
+#ifdef MADV_HUGEPAGE
+  if (huge != NO_HUGE_PAGES)
+    madvise(base, reservation, MADV_HUGEPAGE);
+#endif
+  apply_node(0, reservation, 0);
+  if (!commit(old_committed))
+  {
+    munmap(fresh, size);
+    base = old;
+    reservation = old_reservation;
+    committed = old_committed;
+    huge = old_huge;
+    return false;
+  }
+  // past the size it's all zero anyway
+  std::memcpy(base, old, length);
+  munmap(old, old_reservation);
+  return true;
+}
+
+bool Region::map_explicit(std::size_t offset)
+{
+#ifdef MAP_HUGETLB
+  // a private mapping takes its page from the pool right away, so running dry fails here and not on first touch
+  void *pointer = mmap(base + offset, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+  if (pointer != MAP_FAILED)
+  {
+    apply_node(offset, HUGE_PAGE_SIZE, 0);
+    explicit_pages = true;
+    return true;
+  }
+  // older kernels leave a hole where the reservation was when a fixed mapping fails
+  mmap(base + offset, HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+#ifdef MADV_HUGEPAGE
+  madvise(base + offset, HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+  apply_node(offset, HUGE_PAGE_SIZE, 0);
+  huge = transparent_huge_pages_available() ? TRANSPARENT_HUGE_PAGES : NO_HUGE_PAGES;
+#endif
+  return false;
+}
+
+void Region::release(std::size_t offset)
+{
+  // a fresh mapping over them lets go of the pages whatever they were, explicit huge pages can't just be advised away
+  mmap(base + offset, committed - offset, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+#ifdef MADV_HUGEPAGE
+  if (huge != NO_HUGE_PAGES)
+    madvise(base + offset, committed - offset, MADV_HUGEPAGE);
+#endif
+  apply_node(offset, committed - offset, 0);
+  committed = offset;
+}
+
+bool Region::prefer_node(int preferred)
+{
+  // the VMs sharing it can be anywhere
+  if (is_frozen)
+    return false;
+  int previous = node;
+  node = preferred;
+  // MPOL_MF_MOVE
+  if (apply_node(0, reservation, 1 << 1))
+    return true;
+  node = previous;
+  return false;
+}
+
+void Region::freeze()
+{
+  if (is_frozen)
+    return;
+  if (committed < reservation)
+    munmap(base + committed, reservation - committed);
+  reservation = committed;
+  mprotect(base, committed, PROT_READ);
+  is_frozen = true;
+}
+
+bool Region::apply_node(std::size_t offset, std::size_t size, unsigned flags)
+{
+#ifdef SYS_mbind
+  if (node >= 64)
+    return false;
+  // MPOL_PREFERRED or MPOL_DEFAULT without a node, the kernel wants one more than the bits in the mask
+  unsigned long mask = node < 0 ? 0 : 1UL << node;
+  return syscall(SYS_mbind, base + offset, size, node < 0 ? 0 : 1, node < 0 ? nullptr : &mask, node < 0 ? 0 : 65, flags) == 0;
+#else
+  return false;
+#endif
+}
+
+HugePages Region::use_huge_pages(HugePages kind)
+{
+  if (is_frozen)
+    return huge;
+  if (kind == EXPLICIT_HUGE_PAGES && explicit_huge_pages_free() == 0)
+    kind = TRANSPARENT_HUGE_PAGES;
+  if (kind == TRANSPARENT_HUGE_PAGES && !transparent_huge_pages_available())
+    kind = NO_HUGE_PAGES;
+#ifdef MADV_HUGEPAGE
+  if (kind != NO_HUGE_PAGES)
+    madvise(base, reservation, MADV_HUGEPAGE);
+  else if (huge != NO_HUGE_PAGES)
+    madvise(base, reservation, MADV_NOHUGEPAGE);
+#endif
+  huge = kind;
+  // the rest of the huge page the end is on, the pages after it are committed whole
+  std::size_t boundary = round_to_pages(committed, granule());
+  commit(boundary < reservation ? boundary : reservation);
+  return huge;
+}
+
+std::size_t Region::huge_page_bytes() const
+{
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  std::size_t bytes = 0;
+  bool inside = false;
+  while (std::getline(smaps, line))
+  {
+    std::size_t start, end;
+    char dash;
+    std::istringstream fields(line);
+    // the first line of every mapping is its range, the ones after it are "Key: value kB"
+    if (line.find(':') > line.find(' ') && fields >> std::hex >> start >> dash >> end && dash == '-')
+    {
+      std::size_t from = reinterpret_cast<std::size_t>(base);
+      inside = start < from + committed && end > from;
+      continue;
+    }
+    std::string key;
+    std::size_t kilobytes = 0;
+    fields >> key >> kilobytes;
+    if (inside && (key == "AnonHugePages:" || key == "Private_Hugetlb:" || key == "Shared_Hugetlb:"))
+      bytes += kilobytes * 1024;
+  }
+  return bytes;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef ENIGMA_SPAN
+#define ENIGMA_SPAN
+
+#include <cstddef>
+#include <utility>
+#if __has_include(<version>)
+#include <version>
+#endif
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+
+/*
+A view of a run of elements: std::span where the library has it[C++20] and the part of it that the VM uses
+otherwise, so the same code builds either way.
+*/
+
+#ifdef __cpp_lib_span
+template <typename T>
+using Span = std::span<T>;
+#else
+template <typename T>
+class Span
+{
+public:
+  Span() = default;
+  Span(T *pointer, std::size_t length) : pointer(pointer), length(length) {}
+
+  // any container with data() and size()[std::vector, std::array, std::string]
+  template <typename C, typename = decltype(std::declval<C &>().data()), typename = decltype(std::declval<C &>().size())>
+  Span(C &container) : pointer(container.data()), length(container.size()) {}
+
+  // a view of T is a view of const T as well
+  template <typename U>
+  Span(const Span<U> &other) : pointer(other.data()), length(other.size()) {}
+
+  T *data() const { return pointer; }
+  std::size_t size() const { return length; }
+  std::size_t size_bytes() const { return length * sizeof(T); }
+  bool empty() const { return length == 0; }
+  T *begin() const { return pointer; }
+  T *end() const { return pointer + length; }
+  T &operator[](std::size_t i) const { return pointer[i]; }
+
+private:
+  T *pointer = nullptr;
+  std::size_t length = 0;
+};
+#endif
+
+#endif
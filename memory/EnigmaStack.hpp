@@ -0,0 +1,106 @@
+#ifndef ENIGMA_STACK
+#define ENIGMA_STACK
+
+/*
+The stack has its own segment instead of living inside the data memory.
+The guest can only reach it through the stack instructions, so the values are kept in the host's byte order and
+a push or pop of any number of registers is one range check and one block copy.
+Just like the memory, overflows and underflows are raised as faults.
+Shrinking the stack drops the bounds proofs since they were made against the size it had[see Manager/EnigmaAnalysis.hpp].
+*/
+
+#include "EnigmaMemory.hpp"
+#include <cstring>
+
+#ifndef STACK_SIZE
+#define STACK_SIZE 4096
+#endif
+
+class Stack
+{
+public:
+  Stack();
+
+  // push count words from values starting at sp, sp is moved past them
+  void push(qword &sp, const qword *values, qword count);
+
+  // pop count words below sp into values, values[0] gets the deepest one
+  void pop(qword &sp, qword *values, qword count);
+
+  // these skip the range check and must only be used when the access has been proven to fit
+  void push_unchecked(qword &sp, const qword *values, qword count);
+  void pop_unchecked(qword &sp, qword *values, qword count);
+
+  void resize(qword __new_size);
+
+  qword size() { return stack.size(); }
+
+  // the deepest the stack has been, in bytes
+  qword high_water_mark() { return high_water; }
+
+private:
+  std::vector<byte> stack;
+
+  qword high_water;
+};
+
+namespace Analysis
+{
+  // the proven pushes and pops only fit the stack they were proven against
+  inline void drop_proofs();
+};
+
+Stack::Stack()
+{
+  stack.resize(STACK_SIZE);
+  high_water = 0;
+}
+
+void Stack::push(qword &sp, const qword *values, qword count)
+{
+  if (sp > stack.size() || stack.size() - sp < count * 8)
+  {
+    raise_fault(STACK_OVERFLOW, sp);
+    return;
+  }
+  push_unchecked(sp, values, count);
+}
+
+void Stack::pop(qword &sp, qword *values, qword count)
+{
+  if (sp > stack.size() || sp < count * 8)
+  {
+    raise_fault(STACK_UNDERFLOW, sp);
+    return;
+  }
+  pop_unchecked(sp, values, count);
+}
+
+void Stack::push_unchecked(qword &sp, const qword *values, qword count)
+{
+  std::memcpy(stack.data() + sp, values, count * 8);
+  sp += count * 8;
+  if (sp > high_water)
+    high_water = sp;
+}
+
+void Stack::pop_unchecked(qword &sp, qword *values, qword count)
+{
+  sp -= count * 8;
+  std::memcpy(values, stack.data() + sp, count * 8);
+}
+
+void Stack::resize(qword __new_size)
+{
+  // only the host resizes a stack, it gets the limit a memory starts with
+  if (__new_size > max_memory_length)
+  {
+    raise_fault(LIMIT_EXCEEDED, __new_size);
+    return;
+  }
+  if (__new_size < stack.size())
+    Analysis::drop_proofs();
+  stack.resize(__new_size);
+}
+
+#endif